@@ -5,6 +5,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include "ble.h"
 #include "nrf_sdm.h"
 #include "nrf_mbr.h"
@@ -18,6 +19,15 @@
 
 #define GATT_MTU_SIZE_DEFAULT (23)
 
+// Largest ATT MTU supported by the SoftDevice. Together with the LE Data
+// Length Extension (up to 251 bytes per link layer packet) this allows a
+// single write to carry GATT_MTU_SIZE - 3 = 244 bytes of firmware data.
+#define GATT_MTU_SIZE (247)
+
+// Connection configuration tag used for the DFU connection. It can't be
+// BLE_CONN_CFG_TAG_DEFAULT, as that is the SoftDevice default configuration.
+#define BLE_CONN_CFG_TAG_DFU (1)
+
 // Use the highest speed possible (lowest connection interval allowed,
 // 7.5ms), while trying to keep the connection alive by setting the
 // connection timeout to the largest allowed (4 seconds).
@@ -26,6 +36,14 @@
 #define BLE_SLAVE_LATENCY            0
 #define BLE_CONN_SUP_TIMEOUT         MSEC_TO_UNITS(4000, UNIT_10_MS)
 
+// Advertising starts fast, so that a client waiting for the bootloader (after
+// a reset into DFU mode or a lost connection) finds it quickly, and backs off
+// after a while. If the application passed the address of its client (see
+// dfu_peer_t), the bootloader first advertises directly to that client.
+#define ADV_FAST_INTERVAL            MSEC_TO_UNITS(20, UNIT_0_625_MS)
+#define ADV_FAST_DURATION            MSEC_TO_UNITS(30000, UNIT_10_MS)
+#define ADV_SLOW_INTERVAL            MSEC_TO_UNITS(100, UNIT_0_625_MS)
+
 // Randomly generated UUID. This UUID is the base UUID, but also the
 // service UUID.
 // cb150001-2404-4e66-ab07-a5f1053f14ce
@@ -34,12 +52,62 @@
 #define UUID_DFU_CHAR_COMMAND 0x0002
 #define UUID_DFU_CHAR_BUFFER  0x0003
 
+// Service data of broadcast updates (BROADCAST=1), the base UUID with 0x0004.
+// cb150004-2404-4e66-ab07-a5f1053f14ce
+#define UUID_BROADCAST {0xce, 0x14, 0x3f, 0x05, 0xf1, 0xa5, 0x07, 0xab, 0x66, 0x4e, 0x04, 0x24, 0x04, 0x00, 0x15, 0xcb}
+
+// Scanning for broadcast updates. The scanner has the lowest priority in the
+// SoftDevice, so scanning all the time still leaves room for advertising and
+// flash operations.
+#define SCAN_INTERVAL MSEC_TO_UNITS(100, UNIT_0_625_MS)
+#define SCAN_WINDOW   MSEC_TO_UNITS(100, UNIT_0_625_MS)
+
 static uint16_t ble_command_conn_handle;
 
+static uint32_t ble_send_reply(uint16_t data_len, const void *data);
+static void ble_disconnect(void);
+
+// The ATT MTU as negotiated with the client and the PHY currently used for
+// transmitting (BLE_GAP_PHY_*) are kept up to date in the transport. Every new
+// connection starts at the default ATT MTU on the 1M PHY.
+transport_t ble_transport = {
+    .send_reply = ble_send_reply,
+    .disconnect = ble_disconnect,
+    .mtu        = GATT_MTU_SIZE_DEFAULT,
+    .phy        = BLE_GAP_PHY_1MBPS,
+};
+
+#if BROADCAST
+static uint32_t ble_broadcast_reply(uint16_t data_len, const void *data);
+static void ble_broadcast_disconnect(void);
+
+// Broadcast updates are received while scanning, so there is nobody to reply
+// to and no connection.
+transport_t ble_broadcast_transport = {
+    .send_reply = ble_broadcast_reply,
+    .disconnect = ble_broadcast_disconnect,
+    .mtu        = GATT_MTU_SIZE_DEFAULT,
+    .phy        = 0,
+};
+#endif
+
+#if SIMULATOR
+static uint32_t app_ram_base = 0x20004000; // there is no linker script
+#else
 extern uint32_t _sdata;
 static uint32_t app_ram_base = (uint32_t)&_sdata;
+#endif
 
-static uint8_t adv_handle;
+static uint8_t adv_handle = BLE_GAP_ADV_SET_HANDLE_NOT_SET;
+
+// Advertising modes, from first to last.
+enum {
+    ADV_DIRECTED, // high duty cycle directed advertising to adv_peer (1.28s)
+    ADV_FAST,     // undirected, every ADV_FAST_INTERVAL for ADV_FAST_DURATION
+    ADV_SLOW,     // undirected, every ADV_SLOW_INTERVAL
+};
+static uint8_t        adv_mode;
+static ble_gap_addr_t adv_peer;
 
 static ble_uuid128_t uuid_base = {
     UUID_BASE,
@@ -96,8 +164,8 @@ static ble_gap_adv_params_t m_adv_params = {
         .include_tx_power = 0,
     },
     .p_peer_addr = NULL,
-    .interval    = MSEC_TO_UNITS(100, UNIT_0_625_MS), // approx 100ms
-    .duration    = 0,    // unlimited advertisement?
+    .interval    = ADV_FAST_INTERVAL, // see ble_adv_start
+    .duration    = ADV_FAST_DURATION,
     .max_adv_evts = 0,   // no max advertisement events
     .channel_mask = {0}, // ?
     .filter_policy = BLE_GAP_ADV_FP_ANY,
@@ -107,8 +175,44 @@ static ble_gap_adv_params_t m_adv_params = {
     .scan_req_notification = 0,
 };
 
+// Switch to the 2M PHY when the client supports it, which roughly doubles
+// throughput. When the client doesn't support it, the PHY update procedure
+// fails and the connection simply stays on the 1M PHY.
+static const ble_gap_phys_t phys_2m = {
+    .tx_phys = BLE_GAP_PHY_2MBPS,
+    .rx_phys = BLE_GAP_PHY_2MBPS,
+};
+
+// PHYs accepted when the client requests a PHY update.
+static const ble_gap_phys_t phys_any = {
+    .tx_phys = BLE_GAP_PHY_2MBPS | BLE_GAP_PHY_1MBPS,
+    .rx_phys = BLE_GAP_PHY_2MBPS | BLE_GAP_PHY_1MBPS,
+};
+
 static ble_uuid_t uuid;
 
+#if BROADCAST
+// The service data of a broadcast update starts with this UUID, followed by a
+// broadcast_chunk_t.
+static const uint8_t uuid_broadcast[16] = UUID_BROADCAST;
+
+static ble_gap_scan_params_t scan_params = {
+    .extended      = 1, // the chunks only fit in extended advertising packets
+    .active        = 0,
+    .filter_policy = BLE_GAP_SCAN_FP_ACCEPT_ALL,
+    .scan_phys     = BLE_GAP_PHY_1MBPS,
+    .interval      = SCAN_INTERVAL,
+    .window        = SCAN_WINDOW,
+    .timeout       = BLE_GAP_SCAN_TIMEOUT_UNLIMITED,
+};
+static uint8_t    scan_buf[BLE_GAP_SCAN_BUFFER_EXTENDED_MIN];
+static ble_data_t scan_data = {
+    .p_data = scan_buf,
+    .len    = sizeof(scan_buf),
+};
+static uint8_t    scanning; // scanning was started and not stopped for a connection
+#endif
+
 static ble_gatts_attr_md_t attr_md_writeonly = {
     .vloc    = BLE_GATTS_VLOC_STACK,
     .rd_auth = 0,
@@ -129,7 +233,7 @@ static ble_gatts_attr_t attr_char_write = {
     .init_len  = 0,
     .init_offs = 0,
     .p_value   = NULL,
-    .max_len   = (GATT_MTU_SIZE_DEFAULT - 3),
+    .max_len   = (GATT_MTU_SIZE - 3),
 };
 
 static ble_gatts_char_md_t char_md_write_notify = {
@@ -165,16 +269,123 @@ static ble_gatts_char_md_t char_md_write_wo_resp = {
 static ble_gatts_char_handles_t char_command_handles;
 static ble_gatts_char_handles_t char_data_handles;
 
+// ble_adv_start configures advertising for the given mode and starts it.
+static void ble_adv_start(uint8_t mode) {
+    adv_mode = mode;
+    ble_gap_adv_data_t *data = &m_adv_data;
+    m_adv_params.properties.type = BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED;
+    m_adv_params.p_peer_addr = NULL;
+    m_adv_params.interval = ADV_FAST_INTERVAL;
+    m_adv_params.duration = ADV_FAST_DURATION;
+    if (mode == ADV_DIRECTED) {
+        // Directed advertising carries no data.
+        data = NULL;
+        m_adv_params.properties.type = BLE_GAP_ADV_TYPE_CONNECTABLE_NONSCANNABLE_DIRECTED_HIGH_DUTY_CYCLE;
+        m_adv_params.p_peer_addr = &adv_peer;
+        m_adv_params.duration = BLE_GAP_ADV_TIMEOUT_HIGH_DUTY_MAX;
+    } else if (mode == ADV_SLOW) {
+        m_adv_params.interval = ADV_SLOW_INTERVAL;
+        m_adv_params.duration = 0; // until connected
+    }
+    if (sd_ble_gap_adv_set_configure(&adv_handle, data, &m_adv_params) != 0) {
+        LOG("cannot configure advertisment");
+    }
+    if (sd_ble_gap_adv_start(adv_handle, BLE_CONN_CFG_TAG_DFU) != 0) {
+        LOG("cannot start advertisment");
+    }
+}
+
+#if BROADCAST
+// ble_scan_start starts scanning for broadcast updates, or continues after an
+// advertising report: the SoftDevice pauses scanning after each report, so
+// that the scan buffer can be read.
+static void ble_scan_start(const ble_gap_scan_params_t *params) {
+    if (sd_ble_gap_scan_start(params, &scan_data) != 0) {
+        LOG("cannot start scanning");
+        return;
+    }
+    scanning = 1;
+}
+
+// ble_handle_adv_report passes the chunk of a broadcast update on to main.c,
+// if the report has one.
+static void ble_handle_adv_report(const ble_gap_evt_adv_report_t *report) {
+    if (report->type.status != BLE_GAP_ADV_DATA_STATUS_COMPLETE) {
+        return;
+    }
+    const uint8_t *data = report->data.p_data;
+    uint16_t len = report->data.len;
+    for (uint16_t i = 0; i + 1 < len && data[i] != 0; i += data[i] + 1) {
+        uint8_t field_len = data[i]; // type and value
+        if (i + 1 + field_len > len) {
+            break;
+        }
+        if (data[i + 1] != BLE_GAP_AD_TYPE_SERVICE_DATA_128BIT_UUID || field_len < 1 + 16 ||
+                memcmp(&data[i + 2], uuid_broadcast, 16) != 0) {
+            continue;
+        }
+        // The chunk isn't aligned in the scan buffer.
+        broadcast_chunk_t chunk;
+        uint16_t chunk_len = field_len - 1 - 16;
+        if (chunk_len > sizeof(chunk)) {
+            chunk_len = sizeof(chunk);
+        }
+        memcpy(&chunk, &data[i + 2 + 16], chunk_len);
+        handle_broadcast(&ble_broadcast_transport, chunk_len, &chunk);
+        break;
+    }
+}
+#endif
+
 // Initialize the BLE stack.
 void ble_init(void) {
     LOG("enable ble");
 
+    // Configure the DFU connection. This must be done before enabling the
+    // BLE stack. See BLE_PROFILE in the Makefile.
+    // Use a large ATT MTU.
+    ble_cfg_t cfg = {
+        .conn_cfg = {
+            .conn_cfg_tag = BLE_CONN_CFG_TAG_DFU,
+            .params.gatt_conn_cfg.att_mtu = GATT_MTU_SIZE,
+        },
+    };
+    if (sd_ble_cfg_set(BLE_CONN_CFG_GATT, &cfg, app_ram_base) != 0) {
+        LOG("cannot set ATT MTU");
+    }
+    // Use a long connection event, so that many packets can be received in
+    // each connection interval.
+    cfg.conn_cfg.params.gap_conn_cfg.conn_count = 1;
+    cfg.conn_cfg.params.gap_conn_cfg.event_length = BLE_EVENT_LENGTH;
+    if (sd_ble_cfg_set(BLE_CONN_CFG_GAP, &cfg, app_ram_base) != 0) {
+        LOG("cannot set event length");
+    }
+    // Allow a few notifications to be queued.
+    cfg.conn_cfg.params.gatts_conn_cfg.hvn_tx_queue_size = BLE_HVN_QUEUE_SIZE;
+    if (sd_ble_cfg_set(BLE_CONN_CFG_GATTS, &cfg, app_ram_base) != 0) {
+        LOG("cannot set notification queue size");
+    }
+
     // Enable BLE stack.
 
     uint32_t err_code = sd_ble_enable(&app_ram_base);
     if (err_code != 0) {
         LOG_NUM("cannot enable BLE:", err_code);
     }
+    // The SoftDevice reports how much RAM it needs for this configuration.
+    // It must be below the RAM start in the linker script.
+    LOG_NUM("SoftDevice RAM end:", app_ram_base);
+
+#if BLE_CONN_EVT_EXT
+    // Extend connection events while there is data to send or receive, up
+    // to the connection interval.
+    ble_opt_t opt = {
+        .common_opt.conn_evt_ext.enable = 1,
+    };
+    if (sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt) != 0) {
+        LOG("cannot enable connection event extension");
+    }
+#endif
 
     if (sd_ble_gap_device_name_set(&sec_mode,
                                    adv_data.name_value,
@@ -187,13 +398,19 @@ void ble_init(void) {
         LOG("cannot set PPCP parameters");
     }
 
-    // start advertising
-    if (sd_ble_gap_adv_set_configure(&adv_handle, &m_adv_data, &m_adv_params) != 0) {
-        LOG("cannot configure advertisment");
-    }
-    if (sd_ble_gap_adv_start(adv_handle, BLE_CONN_CFG_TAG_DEFAULT) != 0) {
-        LOG("cannot start advertisment");
+    // start advertising, directly to the client of the application if it
+    // left its address
+    if (dfu_peer.magic == DFU_PEER_MAGIC) {
+        dfu_peer.magic = 0;
+        adv_peer.addr_type = dfu_peer.addr_type;
+        memcpy(adv_peer.addr, dfu_peer.addr, sizeof(adv_peer.addr));
+        ble_adv_start(ADV_DIRECTED);
+    } else {
+        ble_adv_start(ADV_FAST);
     }
+#if BROADCAST
+    ble_scan_start(&scan_params);
+#endif
 
     uuid.uuid = UUID_DFU_SERVICE;
     if (sd_ble_uuid_vs_add(&uuid_base, &uuid.type) != 0) {
@@ -228,16 +445,20 @@ void ble_init(void) {
 
 
 
-static uint8_t m_ble_evt_buf[sizeof(ble_evt_t) + (GATT_MTU_SIZE_DEFAULT)] __attribute__ ((aligned (4)));
+static uint8_t m_ble_evt_buf[sizeof(ble_evt_t) + (GATT_MTU_SIZE)] __attribute__ ((aligned (4)));
 
 static void ble_evt_handler(ble_evt_t * p_ble_evt);
 
-static void handle_irq(void) {
-    uint32_t evt_id;
-    while (sd_evt_get(&evt_id) != NRF_ERROR_NOT_FOUND) {
-        sd_evt_handler(evt_id);
-    }
+// ble_set_conn_params records the connection parameters in use, for
+// COMMAND_STATS.
+static void ble_set_conn_params(const ble_gap_conn_params_t *params) {
+    dfu_stats.conn_interval = params->max_conn_interval;
+    dfu_stats.slave_latency = params->slave_latency;
+    dfu_stats.sup_timeout = params->conn_sup_timeout;
+}
 
+// ble_poll handles the BLE events that came in, see dfu_run.
+void ble_poll(void) {
     while (1) {
         uint16_t evt_len = sizeof(m_ble_evt_buf);
         uint32_t err_code = sd_ble_evt_get(m_ble_evt_buf, &evt_len);
@@ -259,48 +480,101 @@ static void handle_irq(void) {
     };
 }
 
-// Main loop for BLE. This function will not return.
-void ble_run() {
-    // Now wait for incoming events, using the 'thread model' (instead of
-    // the IRQ model). This saves 20 bytes.
-    while (1) {
-        __WFE();
-        sd_app_evt_wait();
-        handle_irq();
-    }
-}
-
 static void ble_evt_handler(ble_evt_t * p_ble_evt) {
     switch (p_ble_evt->header.evt_id) {
         // GAP events
         case BLE_GAP_EVT_CONNECTED: {
             LOG("ble: connected");
             uint16_t  conn_handle = p_ble_evt->evt.gatts_evt.conn_handle;
+            ble_transport.mtu = GATT_MTU_SIZE_DEFAULT;
+            ble_transport.phy = BLE_GAP_PHY_1MBPS;
+            ble_set_conn_params(&p_ble_evt->evt.gap_evt.params.connected.conn_params);
+#if BROADCAST
+            // A client that connects takes over from a broadcast.
+            if (scanning) {
+                sd_ble_gap_scan_stop();
+                scanning = 0;
+            }
+#endif
             if (sd_ble_gap_conn_param_update(conn_handle, &gap_conn_params) != 0) {
                 LOG("! failed to update conn params");
             }
+#if NRF52XXX
+            if (sd_ble_gap_phy_update(conn_handle, &phys_2m) != 0) {
+                LOG("! failed to request 2M PHY");
+            }
+            // Ask for the largest link layer packets the SoftDevice supports.
+            // The client may do the same, see
+            // BLE_GAP_EVT_DATA_LENGTH_UPDATE_REQUEST.
+            if (sd_ble_gap_data_length_update(conn_handle, NULL, NULL) != 0) {
+                LOG("! failed to update data length");
+            }
+#endif
             break;
         }
         case BLE_GAP_EVT_DISCONNECTED: {
             LOG("ble: disconnected");
-            handle_disconnect();
-            if (sd_ble_gap_adv_start(adv_handle, BLE_CONN_CFG_TAG_DEFAULT) != 0) {
-                LOG("Could not restart advertising after disconnect.");
-            }
+            handle_disconnect(&ble_transport);
+            // The client is probably trying to reconnect.
+            ble_adv_start(ADV_FAST);
+#if BROADCAST
+            ble_scan_start(&scan_params);
+#endif
             break;
         }
 #if NRF52XXX
+        case BLE_GAP_EVT_ADV_SET_TERMINATED:
+            if (p_ble_evt->evt.gap_evt.params.adv_set_terminated.reason == BLE_GAP_EVT_ADV_SET_TERMINATED_REASON_TIMEOUT && adv_mode != ADV_SLOW) {
+                LOG_NUM("ble: advertising timeout, mode", adv_mode);
+                ble_adv_start(adv_mode + 1);
+            }
+            break;
         case BLE_GAP_EVT_ADV_REPORT:
+#if BROADCAST
+            // Reports that were queued before a client connected are
+            // ignored, the client has taken over.
+            if (scanning) {
+                ble_handle_adv_report(&p_ble_evt->evt.gap_evt.params.adv_report);
+                ble_scan_start(NULL); // continue
+            }
+#else
             LOG("ble: adv report");
+#endif
             break;
         case BLE_GAP_EVT_CONN_PARAM_UPDATE: {
             LOG_NUM("ble: conn param update", p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params.min_conn_interval);
+            ble_set_conn_params(&p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params);
             break;
         }
         case BLE_GAP_EVT_CONN_PARAM_UPDATE_REQUEST:
             LOG("ble: conn param update request");
             sd_ble_gap_conn_param_update(p_ble_evt->evt.gap_evt.conn_handle, NULL);
             break;
+        case BLE_GAP_EVT_PHY_UPDATE_REQUEST:
+            LOG("ble: phy update request");
+            sd_ble_gap_phy_update(p_ble_evt->evt.gap_evt.conn_handle, &phys_any);
+            break;
+        case BLE_GAP_EVT_PHY_UPDATE: {
+            ble_gap_evt_phy_update_t *phy_update = &p_ble_evt->evt.gap_evt.params.phy_update;
+            if (phy_update->status == BLE_HCI_STATUS_CODE_SUCCESS) {
+                LOG_NUM("ble: phy update", phy_update->tx_phy);
+                ble_transport.phy = phy_update->tx_phy;
+            } else {
+                // Most likely the client doesn't support 2M, so keep using
+                // the current PHY.
+                LOG_NUM("ble: phy update failed", phy_update->status);
+            }
+            break;
+        }
+        case BLE_GAP_EVT_DATA_LENGTH_UPDATE_REQUEST:
+            // Let the SoftDevice pick the largest data length supported by
+            // both sides.
+            LOG("ble: data length update request");
+            sd_ble_gap_data_length_update(p_ble_evt->evt.gap_evt.conn_handle, NULL, NULL);
+            break;
+        case BLE_GAP_EVT_DATA_LENGTH_UPDATE:
+            LOG_NUM("ble: data length update", p_ble_evt->evt.gap_evt.params.data_length_update.effective_params.max_rx_octets);
+            break;
 #endif
 
         // GATTS events
@@ -316,21 +590,31 @@ static void ble_evt_handler(ble_evt_t * p_ble_evt) {
 
             if (attr_handle == char_command_handles.value_handle) {
                 ble_command_conn_handle = conn_handle;
-                handle_command(data_len, (ble_command_t*)data);
+                handle_command(&ble_transport, data_len, (ble_command_t*)data);
             } else if (attr_handle == char_data_handles.value_handle) {
                 ble_command_conn_handle = conn_handle;
-                handle_data(data_len, data);
+                handle_data(&ble_transport, data_len, data);
             }
             break;
         }
+#if NRF52XXX
+        case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+            // There is room in the notification queue again.
+            handle_notification_sent();
+            break;
+#endif
         case BLE_GATTS_EVT_SYS_ATTR_MISSING:
             LOG("ble: sys attr missing");
             break;
 #if NRF52XXX
-        case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST:
-            LOG("ble: exchange MTU request");
-            sd_ble_gatts_exchange_mtu_reply(p_ble_evt->evt.gatts_evt.conn_handle, GATT_MTU_SIZE_DEFAULT);
+        case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST: {
+            // The effective ATT MTU is the smallest of the two.
+            uint16_t client_rx_mtu = p_ble_evt->evt.gatts_evt.params.exchange_mtu_request.client_rx_mtu;
+            LOG_NUM("ble: exchange MTU request", client_rx_mtu);
+            ble_transport.mtu = client_rx_mtu < GATT_MTU_SIZE ? client_rx_mtu : GATT_MTU_SIZE;
+            sd_ble_gatts_exchange_mtu_reply(p_ble_evt->evt.gatts_evt.conn_handle, GATT_MTU_SIZE);
             break;
+        }
 #endif
 
         default: {
@@ -342,24 +626,36 @@ static void ble_evt_handler(ble_evt_t * p_ble_evt) {
 
 
 // ble_send_reply sends a notification to the connected client on the command
-// characteristic. It is used for various status updates.
-void ble_send_reply(uint8_t code) {
-    uint8_t reply_ok[] = {code};
-    uint16_t reply_ok_len = sizeof(reply_ok);
+// characteristic: a status code followed by a payload (see ble_reply_t). It
+// returns an error code when the notification could not be queued, for
+// example because the queue is full.
+static uint32_t ble_send_reply(uint16_t data_len, const void *data) {
     const ble_gatts_hvx_params_t hvx_params = {
         .handle = char_command_handles.value_handle,
         .type = BLE_GATT_HVX_NOTIFICATION,
         .offset = 0,
-        .p_len = &reply_ok_len,
-        .p_data = reply_ok,
+        .p_len = &data_len,
+        .p_data = data,
     };
     uint32_t err_val = sd_ble_gatts_hvx(ble_command_conn_handle, &hvx_params);
     if (err_val != 0) {
         LOG_NUM("  notify: failed to send notification", err_val);
     }
+    return err_val;
 }
 
-// ble_disconnect_reset will disconnect the currently connected client.
-void ble_disconnect(void) {
+// ble_disconnect will disconnect the currently connected client.
+static void ble_disconnect(void) {
     sd_ble_gap_disconnect(ble_command_conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
 }
+
+#if BROADCAST
+// ble_broadcast_reply drops a reply to a broadcast.
+static uint32_t ble_broadcast_reply(uint16_t data_len, const void *data) {
+    return 0;
+}
+
+// ble_broadcast_disconnect has no connection to end.
+static void ble_broadcast_disconnect(void) {
+}
+#endif
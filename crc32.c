@@ -0,0 +1,24 @@
+
+// This file implements the CRC-32 used by zlib, PNG and Ethernet (polynomial
+// 0xEDB88320, reflected). It uses a 16 entry lookup table, which is a lot
+// smaller than the usual 256 entry table and still reasonably fast.
+
+#include "dfu.h"
+
+static const uint32_t crc32_table[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+    0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+// crc32_update continues calculating a CRC-32 over the given data. Start with
+// a crc of 0. The result is the same as crc32.ChecksumIEEE in Go.
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t len) {
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++) {
+        crc = crc32_table[(crc ^ data[i]) & 0xf] ^ (crc >> 4);
+        crc = crc32_table[(crc ^ (data[i] >> 4)) & 0xf] ^ (crc >> 4);
+    }
+    return ~crc;
+}
@@ -8,69 +8,390 @@ enum {
     COMMAND_RESET_BOOTLOADER = 0x00, // reset into the bootloader
     COMMAND_RESET            = 0x01, // regular reset
     COMMAND_START            = 0x02, // start DFU process
+    COMMAND_PAGE_HASHES      = 0x03, // return the CRC-32 of a number of flash pages
+    COMMAND_SIGNATURE        = 0x04, // part of the signature of the next update
+    COMMAND_STATS            = 0x05, // return the performance counters (see dfu_stats_t)
+    COMMAND_IMAGE_INFO       = 0x06, // chip and version of the image of the next update
     COMMAND_PING             = 0x10, // just ask a response (debug)
 };
 
+// Flags for COMMAND_START.
+enum {
+    START_FLAG_STREAM     = 0x01, // accept data as soon as the first page is erased
+    START_FLAG_COMPRESSED = 0x02, // data is compressed (see below)
+    START_FLAG_RESUME     = 0x04, // continue an interrupted update of the same image, if possible
+    START_FLAG_OFFSETS    = 0x08, // data packets start with their offset (see below)
+    START_FLAG_SIGNED     = 0x10, // only in STATUS_ERASE_STARTED: the update must be signed (see below)
+    START_FLAG_MORE       = 0x20, // more ranges of the same image follow (see below)
+    START_FLAG_STAGE      = 0x40, // only for the application: store the update to install at the next reset (see below)
+};
+
+// An image with gaps is written as a list of ranges, with a COMMAND_START for
+// each. All but the last one set START_FLAG_MORE: the application is then only
+// started once the last range has been written, so that an update that stops
+// between two ranges isn't mistaken for a complete one.
+
+// Bootloaders built with a PUBLIC_KEY only accept signed updates. Before
+// COMMAND_START, the client sends the 64 byte Ed25519 signature in parts of 16
+// bytes with COMMAND_SIGNATURE. The signed message is the SHA-256 of the start
+// address and length (both 4 byte little endian) followed by the data.
+#define SIGNATURE_PART_SIZE 16
+
+// With START_FLAG_OFFSETS, each data packet starts with the 4 byte little endian
+// offset of the data in the image. The offset must be a multiple of
+// DATA_BLOCK_SIZE, and so must the length, except for the last packet of the
+// image. Packets may be lost or sent more than once. The bootloader reports
+// missing data with STATUS_DATA_MISSING, either when a packet arrives after a
+// gap or when the client sends a packet with just an offset (a poll).
+// This can't be combined with START_FLAG_COMPRESSED.
+#define DATA_BLOCK_SIZE 16
+
+// Compressed data uses a simple LZSS format. The data is sent in groups of up
+// to 8 items, each preceded by a flags byte. Starting at the lowest bit, each
+// bit in the flags byte tells whether the next item is a literal byte (0) or a
+// match (1). A match is 2 bytes: the low 8 bits of the offset, followed by a
+// byte with the high 4 bits of the offset in the upper nibble and the length
+// in the lower nibble. It copies length+LZ_MIN_MATCH bytes, starting
+// offset+1 bytes back in the decompressed data.
+// The window fits in the page buffer, so it needs no extra RAM.
+#define LZ_MIN_MATCH   3
+#define LZ_WINDOW_SIZE 4096
+
+// The serial transport (serial.c) carries the same commands, data and replies
+// as frames over a UART with hardware flow control. A frame starts with
+// SERIAL_MAGIC, the frame type and the length of the data (2 bytes little
+// endian), followed by the data. Frames from the client are always padded to
+// SERIAL_FRAME_SIZE bytes, so that the bootloader can receive them with DMA.
+// Replies are only as long as needed.
+// The client starts a session with at least SERIAL_SYNC_LEN SERIAL_SYNC bytes.
+// A frame that doesn't start with SERIAL_MAGIC ends the session, like a lost
+// connection: the bootloader then looks for SERIAL_SYNC bytes followed by
+// SERIAL_MAGIC to find the start of the next frame.
+#define SERIAL_MAGIC      (0xd5)
+#define SERIAL_SYNC       (0x7e)
+#define SERIAL_SYNC_LEN   (2 * SERIAL_FRAME_SIZE + 8) // enough to skip the rest of a frame and a whole one
+#define SERIAL_FRAME_SIZE (4 + 244) // header and data, as much data as the largest BLE write
+
+// Frame types of the serial transport.
+enum {
+    SERIAL_FRAME_COMMAND = 'c', // a command, like a write to the command characteristic
+    SERIAL_FRAME_DATA    = 'd', // data, like a write to the data characteristic
+    SERIAL_FRAME_REPLY   = 'n', // a reply, like a notification of the command characteristic
+};
+
+// Bootloaders built with BROADCAST=1 can also receive an update that is
+// broadcast to many devices at once, in extended advertising packets. Each
+// packet carries a chunk of the image as service data of UUID_BROADCAST
+// (see ble.c): the devices it is for, the parameters of the image as in
+// COMMAND_START, the offset of the chunk and the data. Chunks for another
+// BROADCAST_TARGET are ignored, so that a broadcast to other devices in range
+// isn't installed. All chunks are BROADCAST_CHUNK_SIZE bytes, except
+// the last one. The sender repeats the image a few times, and the bootloader
+// writes the chunks it receives in any order. A device that still misses
+// chunks at the end stays in DFU mode, and a client can then write the pages
+// that differ, like a delta update.
+// For bootloaders built with a PUBLIC_KEY, a chunk at offset
+// BROADCAST_OFFSET_SIGNATURE carries the signature of the image.
+#define BROADCAST_CHUNK_SIZE       (208) // a multiple of 16, so the packet fits in 255 bytes of advertising data
+#define BROADCAST_OFFSET_SIGNATURE (0xffffffff)
+
+// The devices that a broadcast update is for, usually a product or fleet ID
+// (see BROADCAST_TARGET in the Makefile). The default only tells chips apart.
+#ifndef BROADCAST_TARGET
+#define BROADCAST_TARGET DFU_CHIP
+#endif
+
 // Statuses send back via a notification on the command characteristic.
 enum {
     STATUS_PONG                 = 0x01, // ping reply
-    STATUS_ERASE_STARTED        = 0x02, // erase started
-    STATUS_ERASE_FINISHED       = 0x03, // erase finished, client may start to stream data
-    STATUS_WRITE_FINISHED       = 0x04, // write finished, firmware has been rewritten
+    STATUS_ERASE_STARTED        = 0x02, // erase started (see ble_reply_t for the payload)
+    STATUS_ERASE_FINISHED       = 0x03, // erase finished, client may start to stream data (see ble_reply_t)
+    STATUS_WRITE_FINISHED       = 0x04, // write finished, firmware has been rewritten (see ble_reply_t)
+    STATUS_PAGE_HASHES          = 0x05, // reply to COMMAND_PAGE_HASHES (see ble_reply_t)
+    STATUS_CREDIT               = 0x06, // a page has been written, more data may be sent (see ble_reply_t)
+    STATUS_DATA_MISSING         = 0x07, // some data must be sent again (see ble_reply_t)
+    STATUS_STATS                = 0x08, // reply to COMMAND_STATS (see ble_reply_t)
     STATUS_BUSY                 = 0x10, // another command is still running
-    STATUS_INVALID_ERASE_START  = 0x20, // invalid start address for erase command (not at APP_CODE_BASE)
+    STATUS_INVALID_ERASE_START  = 0x20, // invalid start address for erase command (before APP_CODE_BASE or not page aligned)
     STATUS_INVALID_ERASE_LENGTH = 0x21, // invalid length for erase command (would overwrite bootloader)
+    STATUS_INVALID_CHIP         = 0x22, // the image was made for another chip (see COMMAND_IMAGE_INFO)
     STATUS_ERASE_FAILED         = 0x30, // could not erase flash page
     STATUS_WRITE_FAILED         = 0x31, // could not write flash page
-    STATUS_WRITE_TOO_FAST       = 0x32, // could not write flash page: data came in faster than could be written
+    STATUS_WRITE_TOO_FAST       = 0x32, // could not write flash page: data came in faster than could be written (more than credited)
+    STATUS_CRC_MISMATCH         = 0x33, // all data was written, but its CRC-32 differs from the one in COMMAND_START
+    STATUS_SIGNATURE_INVALID    = 0x34, // all data was written, but the signature is missing or invalid
 };
 
 // Now follow regular declarations shared between main.c and ble.c.
 
 #include <stdint.h>
 
+// FLASH_PTR converts a flash address to a pointer. In the host simulator (see
+// sim/) flash is an array in RAM.
+#if SIMULATOR
+extern uint8_t sim_flash[];
+#define FLASH_PTR(addr) ((void*)(sim_flash + (addr)))
+#else
+#define FLASH_PTR(addr) ((void*)(addr))
+#endif
+
+// An application that resets into DFU mode may pass the address of its client
+// in the last 16 bytes of the bootloader RAM (0x20007ff0 on all chips, see
+// common.ld), which are kept across the reset. The bootloader then first
+// advertises directly to that client, so that it can reconnect without a scan.
+#define DFU_PEER_MAGIC 0x50554644 // "DFUP"
+typedef struct {
+    uint32_t magic;     // DFU_PEER_MAGIC if the address is valid
+    uint8_t  addr_type; // BLE_GAP_ADDR_TYPE_*
+    uint8_t  addr[6];   // little endian, as in ble_gap_addr_t
+    uint8_t  padding[5];
+} dfu_peer_t;
+
+extern dfu_peer_t dfu_peer;
+
+// An application with the DFU service can receive an update while it keeps
+// running (START_FLAG_STAGE). It stores the image in the upper half of the
+// application area and then describes it with a dfu_staged_t at the start of
+// the progress record page, below the bootloader. At the next reset, the
+// bootloader checks the staged image and copies it to its start address, so
+// the device is only down for the copy.
+#define DFU_STAGED_MAGIC (0x47545344) // "DSTG"
+typedef struct {
+    uint32_t start;         // where the image is copied to (page aligned)
+    uint32_t length;
+    uint32_t image_crc;     // CRC-32 of the image
+    uint32_t magic;         // DFU_STAGED_MAGIC, written last
+    uint32_t source;        // where the application stored the image (page aligned)
+    uint8_t  signature[64]; // see COMMAND_SIGNATURE, for bootloaders that only accept signed updates
+} dfu_staged_t;
+
 // Internal states for keeping track where we are in the DFU process.
 enum {
     PHASE_READY,
     PHASE_ERASING,
     PHASE_WRITING,
+    PHASE_STREAMING, // erasing the remaining pages while receiving data
     PHASE_WRITING_LAST_PAGE,
     PHASE_RESETTING,
+    PHASE_BROADCAST, // receiving a broadcast update (BROADCAST=1)
+};
+
+// Types of debug trace records (see uart.c).
+enum {
+    TRACE_MSG     = 0xa5, // LOG
+    TRACE_NUM     = 0xa6, // LOG_NUM
+    TRACE_DROPPED = 0xa7, // the buffer was full, the argument is the number of records lost
 };
 
 #if DEBUG
-void uart_write(char *s);
-void uart_write_num(uint32_t n);
+void trace(uint32_t type, const char *msg, uint32_t arg);
+void trace_flush(void);
+void trace_flush_all(void);
 void uart_enable(void);
 void uart_disable(void);
-#define LOG(s)        uart_write(s "\r\n")
-#define LOG_NUM(s, n) uart_write(s " "); uart_write_num(n); uart_write("\r\n")
+#define LOG(s)        trace(TRACE_MSG, s, 0)
+#define LOG_NUM(s, n) trace(TRACE_NUM, s, n)
+#define LOG_FLUSH()   trace_flush_all()
 #else
 #define LOG(x)
 #define LOG_NUM(s, n)
+#define LOG_FLUSH()
 #endif
 
+// A transport carries commands and data from a client to main.c, and the
+// replies back. It passes itself to handle_command, handle_data and
+// handle_disconnect. The replies of an update go to the transport that started
+// it.
+typedef struct {
+    // send_reply queues a reply (status code and payload, see ble_reply_t). It
+    // returns non-zero when the reply could not be queued, for example because
+    // the queue is full: handle_notification_sent is called once there is
+    // room again.
+    uint32_t (*send_reply)(uint16_t data_len, const void *data);
+
+    // disconnect ends the session with the client. The transport calls
+    // handle_disconnect once it has ended.
+    void (*disconnect)(void);
+
+    uint16_t mtu; // ATT MTU, or the equivalent: packets carry up to mtu - 3 bytes
+    uint8_t  phy; // BLE_GAP_PHY_* in use, 0 for a wired link or a broadcast
+} transport_t;
+
+// Which transports are built in is set in the Makefile (TRANSPORT_BLE and
+// TRANSPORT_SERIAL). Broadcast updates arrive through ble_broadcast_transport,
+// which has nobody to send replies to.
+extern transport_t ble_transport;
+extern transport_t ble_broadcast_transport;
+extern transport_t serial_transport;
+
+void dfu_run(void) __attribute__((noreturn));
 void ble_init(void);
-void ble_run(void);
-void ble_send_reply(uint8_t code);
-void ble_disconnect(void);
+void ble_poll(void);
+void serial_init(void);
+void serial_poll(void);
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, uint32_t len);
+
+typedef struct {
+    uint32_t state[8];
+    uint32_t length;
+    uint8_t  buf[64];
+} sha256_t;
+
+void sha256_init(sha256_t *ctx);
+void sha256_update(sha256_t *ctx, const uint8_t *data, uint32_t len);
+void sha256_final(sha256_t *ctx, uint8_t hash[32]);
+
+int ed25519_verify(const uint8_t sig[64], const uint8_t *msg, uint32_t len, const uint8_t key[32]);
+
+// Latency of one kind of flash operation, in ticks of the 32768Hz RTC.
+typedef struct {
+    uint16_t min;
+    uint16_t max;
+    uint32_t total; // divide by the number of operations for the average
+} dfu_latency_t;
+
+// Performance counters of the bootloader, read with COMMAND_STATS. All but the
+// connection parameters are reset by COMMAND_START, so after an update they
+// describe that update.
+typedef struct {
+    uint32_t bytes_received; // bytes in data packets, including offsets and data sent again
+    uint32_t packets;        // data packets received
+    uint32_t intervals;      // connection intervals in which data packets were received
+    dfu_latency_t erase;     // page erases
+    dfu_latency_t write;     // page writes
+    uint16_t max_packets;    // most data packets received in one connection interval
+    uint16_t pages_erased;
+    uint16_t pages_written;
+    uint16_t too_fast;       // STATUS_WRITE_TOO_FAST replies
+    uint16_t busy;           // flash operations that had to wait for the SoftDevice
+    uint16_t conn_interval;  // connection interval in 1.25ms units
+    uint16_t slave_latency;
+    uint16_t sup_timeout;    // supervision timeout in 10ms units
+    uint16_t att_mtu;        // see transport_t
+    uint8_t  phy;            // BLE_GAP_PHY_*, 0 for the serial transport
+    uint8_t  padding;
+} dfu_stats_t;
+
+extern dfu_stats_t dfu_stats;
 
 extern const uint32_t _stext[];
 
+// The chip the bootloader was built for, by its number. A COMMAND_START after
+// a COMMAND_IMAGE_INFO for another chip is refused before anything is erased.
+// The image info is a separate command so that COMMAND_START still fits in a
+// write at the default ATT MTU.
+#if defined(NRF52832_XXAA)
+#define DFU_CHIP (52832)
+#else
+#define DFU_CHIP (52840)
+#endif
+
 typedef union {
     struct {
         uint8_t  command;
     } any;
     struct {
         uint8_t  command;
-        uint8_t  padding[3];
+        uint8_t  flags; // START_FLAG_*
+        uint8_t  padding[2];
         uint32_t startAddr;
         uint32_t length;
+        uint32_t image_crc; // identifies the image for START_FLAG_RESUME (optional)
     } start; // COMMAND_START
+    struct {
+        uint8_t  command;
+        uint8_t  count; // number of pages
+        uint8_t  padding[2];
+        uint32_t startAddr;
+    } page_hashes; // COMMAND_PAGE_HASHES
+    struct {
+        uint8_t  command;
+        uint8_t  offset; // offset in the signature, a multiple of SIGNATURE_PART_SIZE
+        uint8_t  padding[2];
+        uint8_t  data[SIGNATURE_PART_SIZE];
+    } signature; // COMMAND_SIGNATURE
+    struct {
+        uint8_t  command;
+        uint8_t  offset; // offset in dfu_stats_t
+    } stats; // COMMAND_STATS
+    struct {
+        uint8_t  command;
+        uint8_t  padding[3];
+        uint32_t chip;    // DFU_CHIP the image was made for
+        uint32_t version; // version of the image, only logged
+    } image_info; // COMMAND_IMAGE_INFO
 } ble_command_t;
 
-void handle_command(uint16_t data_len, ble_command_t *data);
-void handle_data(uint16_t data_len, uint8_t *data);
-void handle_disconnect(void);
+// Replies that carry more than just a status code. The status code is always
+// the first byte, so clients that only look at the status keep working.
+typedef union {
+    struct {
+        uint8_t  status;
+    } any;
+    struct {
+        uint8_t  status;
+        uint8_t  phy;          // PHY in use: 1 for 1M, 2 for 2M (BLE_GAP_PHY_*)
+        uint16_t max_data_len; // largest data packet the client may send
+        uint8_t  flags;        // START_FLAG_* flags that are supported
+        uint8_t  padding[3];
+        uint32_t resume_offset; // where the client should continue (START_FLAG_RESUME)
+    } erase_started; // STATUS_ERASE_STARTED
+    struct {
+        uint8_t  status;
+        uint8_t  padding;
+        uint16_t erased;       // number of pages that were erased
+        uint16_t skipped;      // number of pages that were already erased
+        uint16_t buffer_pages; // number of pages that may be sent before the first STATUS_CREDIT
+    } erase_finished; // STATUS_ERASE_FINISHED
+    struct {
+        uint8_t  status;
+        uint8_t  padding[3];
+        uint32_t data_cycles;  // CPU cycles spent processing (decompressing) data
+        uint32_t hash_cycles;  // CPU cycles spent hashing written pages (CRC-32 and SHA-256)
+        uint32_t verify_cycles; // CPU cycles spent checking the signature
+    } write_finished; // STATUS_WRITE_FINISHED
+    struct {
+        uint8_t  status;
+        uint8_t  count;        // number of hashes that follow, may be less than requested
+        uint8_t  padding[2];
+        uint32_t crc[];        // CRC-32 of each page
+    } page_hashes; // STATUS_PAGE_HASHES
+    struct {
+        uint8_t  status;
+        uint8_t  padding[3];
+        uint32_t committed;    // number of bytes written to flash
+        uint32_t buffer_size;  // number of bytes that may be sent after those
+    } credit; // STATUS_CREDIT
+    struct {
+        uint8_t  status;
+        uint8_t  padding[3];
+        uint32_t offset;       // first byte that is missing
+        uint32_t length;       // number of bytes missing from that offset
+    } data_missing; // STATUS_DATA_MISSING
+    struct {
+        uint8_t  status;
+        uint8_t  offset;       // offset of the data in dfu_stats_t
+        uint8_t  length;       // number of bytes that follow, may be less than the rest of dfu_stats_t
+        uint8_t  padding;
+        uint8_t  data[];
+    } stats; // STATUS_STATS
+} ble_reply_t;
+
+// A chunk of a broadcast update (see BROADCAST_CHUNK_SIZE).
+typedef struct {
+    uint32_t target;    // BROADCAST_TARGET of the devices it is for
+    uint32_t start;     // COMMAND_START parameters of the image
+    uint32_t length;
+    uint32_t image_crc;
+    uint32_t offset;    // offset of the chunk in the image, or BROADCAST_OFFSET_SIGNATURE
+    uint8_t  data[BROADCAST_CHUNK_SIZE];
+} broadcast_chunk_t;
+
+void handle_command(transport_t *transport, uint16_t data_len, ble_command_t *data);
+void handle_data(transport_t *transport, uint16_t data_len, uint8_t *data);
+void handle_disconnect(transport_t *transport);
+void handle_broadcast(transport_t *transport, uint16_t data_len, const broadcast_chunk_t *chunk);
+void handle_notification_sent(void);
 
 void sd_evt_handler(uint32_t evt_id);
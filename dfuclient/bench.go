@@ -0,0 +1,196 @@
+package main
+
+import (
+	"bufio"
+	"flag"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"strconv"
+	"strings"
+	"time"
+)
+
+// benchLink is a link model of the simulated bootloader, see
+// build/sim/bootloader-server -h.
+type benchLink struct {
+	interval float64 // connection interval in ms
+	packets  int     // packets per connection event (0: as many as fit)
+	mtu      int
+	phy      int
+	loss     int // a packet is lost with probability 1/loss (0: none)
+}
+
+func (l benchLink) args() []string {
+	return []string{
+		"-interval", strconv.Itoa(int(l.interval * 1000)),
+		"-packets", strconv.Itoa(l.packets),
+		"-mtu", strconv.Itoa(l.mtu),
+		"-phy", strconv.Itoa(l.phy),
+		"-loss", strconv.Itoa(l.loss),
+	}
+}
+
+// bench implements the bench command: it updates the simulated bootloader
+// with every given image over every combination of the given link
+// parameters, and prints the throughput, the time spent in each phase and how
+// many updates failed.
+func bench(args []string) {
+	flags := flag.NewFlagSet("bench", flag.ExitOnError)
+	// The flags for an update apply to every run.
+	flag.VisitAll(func(f *flag.Flag) {
+		flags.Var(f.Value, f.Name, f.Usage)
+	})
+	server := flags.String("server", "build/sim/bootloader-server", "simulated bootloader to update (see make sim)")
+	intervals := flags.String("interval", "7.5,15,30", "connection intervals in ms")
+	packets := flags.String("packets", "0", "packets per connection event (0: as many as fit)")
+	mtus := flags.String("mtu", "247", "ATT MTUs")
+	phys := flags.String("phy", "2", "PHYs (1 or 2)")
+	losses := flags.String("loss", "0", "lose a packet with probability 1/n (0: none)")
+	runs := flags.Int("runs", 3, "number of updates for each combination")
+	timeout := flags.Duration("timeout", 10*time.Second, "how long to wait for a reply before an update fails")
+	flags.Usage = func() {
+		fmt.Printf("usage: %s bench [flags] <filename>...\n", os.Args[0])
+		fmt.Println("Lists of values are separated by commas, every combination is tried.")
+		flags.PrintDefaults()
+		os.Exit(0)
+	}
+	flags.Parse(args)
+	if flags.NArg() == 0 {
+		flags.Usage()
+	}
+	responseTimeout = *timeout
+	if *flagKey != "" {
+		var err error
+		signingKey, err = loadPrivateKey(*flagKey)
+		handleError("could not read private key", err)
+	}
+
+	var links []benchLink
+	for _, interval := range parseList(*intervals) {
+		for _, packets := range parseList(*packets) {
+			for _, mtu := range parseList(*mtus) {
+				for _, phy := range parseList(*phys) {
+					for _, loss := range parseList(*losses) {
+						links = append(links, benchLink{interval, int(packets), int(mtu), int(phy), int(loss)})
+					}
+				}
+			}
+		}
+	}
+
+	fmt.Printf("%-20s %8s %7s %4s %3s %5s %6s %8s %10s %10s %10s %10s\n", "image", "interval", "packets", "mtu", "phy", "loss", "failed", "kB/s", phaseNames[0], phaseNames[1], phaseNames[2], phaseNames[3])
+	for _, path := range flags.Args() {
+		ranges, err := readImage(path)
+		handleError("could not read input file", err)
+		for _, link := range links {
+			var total [numPhases]time.Duration
+			failed := 0
+			for i := 0; i < *runs; i++ {
+				phases, err := benchUpdate(*server, link, ranges)
+				if err != nil {
+					fmt.Fprintf(os.Stderr, "%s (%s) run %d: %s\n", filepath.Base(path), strings.Join(link.args(), " "), i+1, err)
+					failed++
+					continue
+				}
+				for phase := range total {
+					total[phase] += phases[phase]
+				}
+			}
+
+			// Print the averages of the updates that succeeded.
+			packetsText := "max"
+			if link.packets != 0 {
+				packetsText = strconv.Itoa(link.packets)
+			}
+			lossText := "-"
+			if link.loss != 0 {
+				lossText = fmt.Sprintf("1/%d", link.loss)
+			}
+			fmt.Printf("%-20s %6.2fms %7s %4d %2dM %5s %3d/%-2d", filepath.Base(path), link.interval, packetsText, link.mtu, link.phy, lossText, failed, *runs)
+			if succeeded := *runs - failed; succeeded != 0 {
+				write := total[phaseErase] + total[phaseTransfer] + total[phaseFinish]
+				fmt.Printf(" %8.1f", float64(imageSize(ranges))/1000/write.Seconds()*float64(succeeded))
+				for _, t := range total {
+					fmt.Printf(" %8.1fms", t.Seconds()*1000/float64(succeeded))
+				}
+			}
+			fmt.Println()
+		}
+	}
+}
+
+// parseList parses a comma separated list of numbers.
+func parseList(s string) []float64 {
+	var values []float64
+	for _, field := range strings.Split(s, ",") {
+		value, err := strconv.ParseFloat(strings.TrimSpace(field), 64)
+		handleError("invalid list of values", err)
+		values = append(values, value)
+	}
+	return values
+}
+
+// benchUpdate starts the simulated bootloader with the given link model and
+// updates it. It returns how long each phase of the update took.
+func benchUpdate(server string, link benchLink, ranges []imageRange) ([numPhases]time.Duration, error) {
+	var phases [numPhases]time.Duration
+	dir, err := ioutil.TempDir("", "dfuclient-bench")
+	if err != nil {
+		return phases, err
+	}
+	defer os.RemoveAll(dir)
+	socket := filepath.Join(dir, "socket")
+	cmd := exec.Command(server, append(link.args(), "-socket", socket)...)
+	cmd.Stderr = os.Stderr
+	stdout, err := cmd.StdoutPipe()
+	if err != nil {
+		return phases, err
+	}
+	err = cmd.Start()
+	if err != nil {
+		return phases, err
+	}
+	defer cmd.Wait()
+	// Don't leave the server running if the update fails.
+	kill := time.AfterFunc(time.Hour, func() {
+		cmd.Process.Kill()
+	})
+	defer kill.Reset(0)
+
+	// The server prints a line once it is listening.
+	lines := bufio.NewScanner(stdout)
+	if !lines.Scan() {
+		return phases, fmt.Errorf("%s did not start", server)
+	}
+
+	// Hide the progress output of the update.
+	stdoutFile := os.Stdout
+	os.Stdout, err = os.OpenFile(os.DevNull, os.O_WRONLY, 0)
+	if err != nil {
+		return phases, err
+	}
+	conn := newDFUConn(&virtualTransport{path: socket})
+	err = conn.update(ranges)
+	os.Stdout.Close()
+	os.Stdout = stdoutFile
+	if err != nil {
+		return phases, err
+	}
+
+	// The server exits once the bootloader has reset, with the result of the
+	// update as the last line.
+	kill.Reset(responseTimeout)
+	result := "no result"
+	for lines.Scan() {
+		if line := lines.Text(); strings.HasPrefix(line, "result:") {
+			result = strings.TrimSpace(line[len("result:"):])
+		}
+	}
+	if result != "ok" {
+		return phases, fmt.Errorf("simulated bootloader: %s", result)
+	}
+	return conn.phaseTimes, nil
+}
@@ -0,0 +1,170 @@
+package main
+
+import (
+	"bytes"
+	"crypto/ed25519"
+	"encoding/binary"
+	"errors"
+	"flag"
+	"fmt"
+	"hash/crc32"
+	"net"
+	"os"
+	"strings"
+	"time"
+)
+
+// Broadcast updates, the same as in dfu.h. Every advertising packet carries a
+// chunk of the image as service data, after a header with the image it belongs
+// to and its offset.
+const (
+	broadcastChunkSize       = 208
+	broadcastOffsetSignature = 0xffffffff
+	adTypeServiceData128     = 0x21
+)
+
+// broadcastUUID is the UUID of the service data of a broadcast update, as it
+// appears in advertising data (little endian).
+var broadcastUUID = []byte{0xce, 0x14, 0x3f, 0x05, 0xf1, 0xa5, 0x07, 0xab, 0x66, 0x4e, 0x04, 0x24, 0x04, 0x00, 0x15, 0xcb}
+
+// broadcastCommand implements the broadcast command: it sends the image to
+// every device in range at once, in advertising packets that devices running
+// the bootloader built with BROADCAST=1 pick up while scanning. It sends the
+// whole image a few times, so that most devices receive every chunk. Devices
+// that missed some are then updated one by one with -delta, which only sends
+// the pages that are still incomplete.
+func broadcastCommand(args []string) {
+	flags := flag.NewFlagSet("broadcast", flag.ExitOnError)
+	// The flags for an update apply to the repairs.
+	flag.VisitAll(func(f *flag.Flag) {
+		flags.Var(f.Value, f.Name, f.Usage)
+	})
+	interval := flags.Duration("interval", 20*time.Millisecond, "time between advertising packets")
+	rounds := flags.Int("rounds", 3, "number of times the whole image is sent")
+	repair := flags.Bool("repair", true, "connect to the devices that didn't complete the update and send them what they missed")
+	target := flags.Uint("target", 52840, "BROADCAST_TARGET of the bootloaders to update, by default the chip they were built for (the chip of a package)")
+	flags.Usage = func() {
+		fmt.Printf("usage: %s broadcast [flags] <filename>\n", os.Args[0])
+		fmt.Println("Only the simulated bootloaders listening on the sockets given with -virtual (separated by commas) can be updated.")
+		flags.PrintDefaults()
+		os.Exit(0)
+	}
+	flags.Parse(args)
+	if flags.NArg() != 1 || *rounds < 1 {
+		flags.Usage()
+	}
+	if *flagVirtual == "" {
+		// The bluetooth package can't send extended advertising packets.
+		handleError("could not broadcast", errors.New("only -virtual is supported"))
+	}
+
+	ranges, err := readImage(flags.Arg(0))
+	handleError("could not read input file", err)
+	targetSet := false
+	flags.Visit(func(f *flag.Flag) {
+		targetSet = targetSet || f.Name == "target"
+	})
+	if !targetSet && imageChip != 0 {
+		// A package is only sent to the chip it was made for.
+		*target = uint(imageChip)
+	}
+	if len(ranges) != 1 {
+		handleError("could not broadcast", errors.New("the image has gaps, which a broadcast can't skip"))
+	}
+	if *flagKey != "" {
+		signingKey, err = loadPrivateKey(*flagKey)
+		handleError("could not read private key", err)
+	}
+	if *flagSig != "" {
+		imageSignature, err = readHexFile(*flagSig, ed25519.SignatureSize)
+		handleError("could not read signature", err)
+	}
+	packets := broadcastPackets(uint32(*target), ranges[0].addr, ranges[0].data, rangeSignature(ranges[0].addr, ranges[0].data))
+
+	var devices []fleetDevice
+	var conns []net.Conn
+	for _, path := range strings.Split(*flagVirtual, ",") {
+		conn, err := net.Dial("unixgram", path+".broadcast")
+		handleError("could not broadcast", err)
+		devices = append(devices, fleetDevice{path, &virtualTransport{path: path}})
+		conns = append(conns, conn)
+	}
+
+	fmt.Printf("Broadcasting %d bytes in %d packets, %d times...\n", len(ranges[0].data), len(packets), *rounds)
+	start := time.Now()
+	for round := 0; round < *rounds; round++ {
+		for i, packet := range packets {
+			for _, conn := range conns {
+				conn.Write(packet)
+			}
+			time.Sleep(*interval)
+			fmt.Printf("\033[2K\rRound %d of %d: %.1f%%", round+1, *rounds, float64(i+1)*100/float64(len(packets)))
+		}
+	}
+	fmt.Printf("\033[2K\rBroadcast completed in %s.\n", time.Since(start).Round(time.Millisecond))
+
+	// A device that received everything checks the image and resets. The
+	// others are still listening.
+	time.Sleep(time.Second)
+	var incomplete []fleetDevice
+	for i, conn := range conns {
+		if _, err := conn.Write(nil); err == nil {
+			incomplete = append(incomplete, devices[i])
+		}
+		conn.Close()
+	}
+	fmt.Printf("%d of %d devices received the whole image.\n", len(devices)-len(incomplete), len(devices))
+	if len(incomplete) == 0 {
+		return
+	}
+	if !*repair {
+		os.Exit(1)
+	}
+
+	*flagDelta = true
+	failed := 0
+	for _, device := range incomplete {
+		fmt.Printf("Repairing %s...\n", device.name)
+		result := updateFleetDevice(device, ranges)
+		if result.err != nil {
+			failed++
+			fmt.Printf("Could not repair %s: %s\n", device.name, result.err)
+		}
+	}
+	fmt.Printf("%d of %d devices updated.\n", len(devices)-failed, len(devices))
+	if failed != 0 {
+		os.Exit(1)
+	}
+}
+
+// broadcastPackets returns the advertising data of every packet of a broadcast
+// of the given image to the given target: the signature if there is one,
+// followed by each chunk of the image.
+func broadcastPackets(target uint32, startAddr uint64, data []byte, signature []byte) [][]byte {
+	imageCRC := crc32.ChecksumIEEE(data)
+	packet := func(offset uint32, chunk []byte) []byte {
+		buf := &bytes.Buffer{}
+		buf.WriteByte(byte(1 + len(broadcastUUID) + 20 + len(chunk))) // length of the AD structure
+		buf.WriteByte(adTypeServiceData128)
+		buf.Write(broadcastUUID)
+		binary.Write(buf, binary.LittleEndian, target)
+		binary.Write(buf, binary.LittleEndian, uint32(startAddr))
+		binary.Write(buf, binary.LittleEndian, uint32(len(data)))
+		binary.Write(buf, binary.LittleEndian, imageCRC)
+		binary.Write(buf, binary.LittleEndian, offset)
+		buf.Write(chunk)
+		return buf.Bytes()
+	}
+	var packets [][]byte
+	if signature != nil {
+		packets = append(packets, packet(broadcastOffsetSignature, signature))
+	}
+	for offset := 0; offset < len(data); offset += broadcastChunkSize {
+		end := offset + broadcastChunkSize
+		if end > len(data) {
+			end = len(data)
+		}
+		packets = append(packets, packet(uint32(offset), data[offset:end]))
+	}
+	return packets
+}
@@ -0,0 +1,109 @@
+package main
+
+// Parameters of the LZSS format, see START_FLAG_COMPRESSED in dfu.h.
+const (
+	lzMinMatch   = 3
+	lzMaxMatch   = lzMinMatch + 15
+	lzWindowSize = 4096
+	lzHashSize   = 1 << 14
+	lzMaxChain   = 256 // limit the number of candidates, for speed
+)
+
+// compress compresses the firmware image in the LZSS format understood by the
+// bootloader.
+func compress(data []byte) []byte {
+	// Positions of the most recent occurrences of each 3-byte hash, chained
+	// to the previous position with the same hash.
+	head := make([]int, lzHashSize)
+	for i := range head {
+		head[i] = -1
+	}
+	prev := make([]int, len(data))
+	hash := func(i int) int {
+		return int((uint32(data[i])<<16|uint32(data[i+1])<<8|uint32(data[i+2]))*2654435761>>18) % lzHashSize
+	}
+	insert := func(i int) {
+		if i+lzMinMatch <= len(data) {
+			h := hash(i)
+			prev[i] = head[h]
+			head[h] = i
+		}
+	}
+
+	var out []byte
+	flagsIndex := -1
+	items := 0
+	for i := 0; i < len(data); {
+		if items%8 == 0 {
+			flagsIndex = len(out)
+			out = append(out, 0)
+		}
+
+		// Find the longest match in the window.
+		bestLen, bestOffset := 0, 0
+		if i+lzMinMatch <= len(data) {
+			maxLen := len(data) - i
+			if maxLen > lzMaxMatch {
+				maxLen = lzMaxMatch
+			}
+			chain := 0
+			for j := head[hash(i)]; j >= 0 && i-j <= lzWindowSize && chain < lzMaxChain; j = prev[j] {
+				chain++
+				n := 0
+				for n < maxLen && data[j+n] == data[i+n] {
+					n++
+				}
+				if n > bestLen {
+					bestLen, bestOffset = n, i-j
+					if n == maxLen {
+						break
+					}
+				}
+			}
+		}
+
+		if bestLen >= lzMinMatch {
+			offset := bestOffset - 1
+			out[flagsIndex] |= 1 << uint(items%8)
+			out = append(out, byte(offset), byte(offset>>8<<4)|byte(bestLen-lzMinMatch))
+			for n := 0; n < bestLen; n++ {
+				insert(i + n)
+			}
+			i += bestLen
+		} else {
+			out = append(out, data[i])
+			insert(i)
+			i++
+		}
+		items++
+	}
+	return out
+}
+
+// lzOutputOffsets returns, for each length of a prefix of the compressed data,
+// how many bytes the bootloader can decompress from it.
+func lzOutputOffsets(payload []byte) []int {
+	offsets := make([]int, len(payload)+1)
+	out := 0
+	flags := uint(0)
+	for i := 0; i < len(payload); {
+		if flags <= 1 {
+			flags = uint(payload[i]) | 0x100
+			i++
+		} else if flags&1 == 0 {
+			out++
+			i++
+			flags >>= 1
+		} else if i+1 < len(payload) {
+			// The first byte of a match doesn't produce any output.
+			offsets[i+1] = out
+			out += int(payload[i+1]&0x0f) + lzMinMatch
+			i += 2
+			flags >>= 1
+		} else {
+			i++
+		}
+		offsets[i] = out
+	}
+	return offsets
+}
@@ -0,0 +1,119 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"hash/crc32"
+	"time"
+)
+
+// Size of a flash page on the nRF52. Only whole pages can be erased.
+const pageSize = 4096
+
+// imageRange is a part of the firmware image that should be written to flash.
+type imageRange struct {
+	addr uint64
+	data []byte
+}
+
+// changedRanges compares the firmware image with what is currently stored on
+// the device and returns the ranges of pages that differ.
+func (c *dfuConn) changedRanges(startAddr uint64, data []byte) ([]imageRange, error) {
+	if startAddr%pageSize != 0 {
+		return nil, fmt.Errorf("start address 0x%x is not page aligned", startAddr)
+	}
+	numPages := (len(data) + pageSize - 1) / pageSize
+	hashes, err := c.pageHashes(startAddr, numPages)
+	if err != nil {
+		return nil, err
+	}
+
+	localHashes := pageHashCache.get(startAddr, data, func() []byte {
+		return imagePageHashes(data)
+	})
+
+	var ranges []imageRange
+	changed := 0
+	for i := 0; i < numPages; i++ {
+		start := i * pageSize
+		end := start + pageSize
+		if end > len(data) {
+			end = len(data)
+		}
+		if binary.LittleEndian.Uint32(localHashes[i*4:]) == hashes[i] {
+			continue
+		}
+		changed++
+		if len(ranges) != 0 {
+			last := &ranges[len(ranges)-1]
+			if last.addr+uint64(len(last.data)) == startAddr+uint64(start) {
+				// Extend the previous range.
+				last.data = data[last.addr-startAddr : end]
+				continue
+			}
+		}
+		ranges = append(ranges, imageRange{startAddr + uint64(start), data[start:end]})
+	}
+	fmt.Printf("%d of %d pages changed.\n", changed, numPages)
+	return ranges, nil
+}
+
+// imagePageHashes returns the CRC-32 of each page of the given data, as the
+// bootloader would compute them once it has been written (see
+// COMMAND_PAGE_HASHES), in little endian.
+func imagePageHashes(data []byte) []byte {
+	buf := &bytes.Buffer{}
+	for start := 0; start < len(data); start += pageSize {
+		end := start + pageSize
+		if end > len(data) {
+			end = len(data)
+		}
+		// The rest of the last page will be left erased.
+		page := make([]byte, pageSize)
+		copy(page, data[start:end])
+		for j := end - start; j < pageSize; j++ {
+			page[j] = 0xff
+		}
+		binary.Write(buf, binary.LittleEndian, crc32.ChecksumIEEE(page))
+	}
+	return buf.Bytes()
+}
+
+// pageHashes returns the CRC-32 of each of the given number of pages on the
+// device, starting at the given address.
+func (c *dfuConn) pageHashes(startAddr uint64, numPages int) ([]uint32, error) {
+	var hashes []uint32
+	for len(hashes) < numPages {
+		count := numPages - len(hashes)
+		if count > 255 {
+			count = 255
+		}
+		buf := &bytes.Buffer{}
+		buf.Write([]byte{commandPageHashes, byte(count), 0, 0})
+		binary.Write(buf, binary.LittleEndian, uint32(startAddr)+uint32(len(hashes))*pageSize)
+		err := c.command(buf.Bytes())
+		if err != nil {
+			return nil, err
+		}
+
+		// Older bootloaders don't reply to this command.
+		var response []byte
+		select {
+		case response = <-c.responseChan:
+		case <-time.After(5 * time.Second):
+			return nil, fmt.Errorf("no reply, the bootloader may not support delta updates")
+		}
+		if response[0] != statusPageHashes {
+			return nil, fmt.Errorf("unexpected reply (code 0x%x)", response[0])
+		}
+		n := int(response[1])
+		if n == 0 || len(response) < 4+n*4 {
+			return nil, fmt.Errorf("invalid reply")
+		}
+		for i := 0; i < n; i++ {
+			hashes = append(hashes, binary.LittleEndian.Uint32(response[4+i*4:]))
+		}
+	}
+	return hashes, nil
+}
@@ -1,25 +1,72 @@
 package main
 
 import (
+	"bufio"
+	"bytes"
 	"debug/elf"
+	"encoding/binary"
+	"encoding/hex"
 	"fmt"
 	"io/ioutil"
 	"os"
 	"sort"
+	"strings"
 )
 
-type progSlice []*elf.Prog
+// segmentList collects the data of a firmware image, which may have gaps. The
+// gaps are not part of the image, so they are never sent to the device.
+type segmentList []imageRange
 
-func (s progSlice) Len() int           { return len(s) }
-func (s progSlice) Less(i, j int) bool { return s[i].Paddr < s[j].Paddr }
-func (s progSlice) Swap(i, j int)      { s[i], s[j] = s[j], s[i] }
+func (s segmentList) Len() int           { return len(s) }
+func (s segmentList) Less(i, j int) bool { return s[i].addr < s[j].addr }
+func (s segmentList) Swap(i, j int)      { s[i], s[j] = s[j], s[i] }
 
-// extractELF extracts a firmware image and the first load address from the
-// given ELF file. It tries to emulate the behavior of objcopy.
-func extractELF(fp *os.File) (uint64, []byte, error) {
+// add adds data at the given address. Data that directly follows the last
+// segment extends it, as is usual for HEX and UF2 files.
+func (s *segmentList) add(addr uint64, data []byte) {
+	if len(data) == 0 {
+		return
+	}
+	if n := len(*s); n != 0 {
+		last := &(*s)[n-1]
+		if last.addr+uint64(len(last.data)) == addr {
+			last.data = append(last.data, data...)
+			return
+		}
+	}
+	*s = append(*s, imageRange{addr, append([]byte(nil), data...)})
+}
+
+// sorted returns the segments sorted by address, with adjacent segments
+// merged. Overlapping segments are an error.
+func (s segmentList) sorted() ([]imageRange, error) {
+	if len(s) == 0 {
+		return nil, fmt.Errorf("file does not contain any data")
+	}
+	sort.Stable(s)
+	segments := []imageRange{s[0]}
+	for _, segment := range s[1:] {
+		last := &segments[len(segments)-1]
+		end := last.addr + uint64(len(last.data))
+		if segment.addr < end {
+			return nil, fmt.Errorf("data at 0x%x overlaps with data before it", segment.addr)
+		}
+		if segment.addr == end {
+			last.data = append(last.data, segment.data...)
+			continue
+		}
+		segments = append(segments, segment)
+	}
+	return segments, nil
+}
+
+// extractELF extracts the segments of a firmware image from the given ELF
+// file. It tries to emulate the behavior of objcopy, but leaves out the gaps
+// between segments.
+func extractELF(fp *os.File) ([]imageRange, error) {
 	f, err := elf.NewFile(fp)
 	if err != nil {
-		return 0, nil, fmt.Errorf("failed to open ELF file to extract text segment: %w", err)
+		return nil, fmt.Errorf("failed to open ELF file to extract text segment: %w", err)
 	}
 	defer f.Close()
 
@@ -41,60 +88,216 @@ func extractELF(fp *os.File) (uint64, []byte, error) {
 		}
 	}
 
-	progs := make(progSlice, 0, 2)
+	var segments segmentList
 	for _, prog := range f.Progs {
 		if prog.Type != elf.PT_LOAD || prog.Filesz == 0 {
 			continue
 		}
-		progs = append(progs, prog)
+		data, err := ioutil.ReadAll(prog.Open())
+		if err != nil {
+			return nil, fmt.Errorf("failed to extract segment from ELF file")
+		}
+		addr := prog.Paddr
+		if addr < startAddr {
+			// This segment starts before the first section. This means that
+			// there is some extra data loaded at the start of the image that
+			// should be discarded.
+			// Example: ELF files where .text doesn't start at address 0
+			// because there is a bootloader at the start.
+			if addr+uint64(len(data)) <= startAddr {
+				continue
+			}
+			data = data[startAddr-addr:]
+			addr = startAddr
+		}
+		segments = append(segments, imageRange{addr, data})
 	}
-	if len(progs) == 0 {
-		return 0, nil, fmt.Errorf("file does not contain ROM segments")
+	if len(segments) == 0 {
+		return nil, fmt.Errorf("file does not contain ROM segments")
 	}
-	sort.Sort(progs)
+	return segments.sorted()
+}
 
-	var rom []byte
-	for _, prog := range progs {
-		if prog.Paddr != progs[0].Paddr+uint64(len(rom)) {
-			return 0, nil, fmt.Errorf("ROM segments are non-contiguous")
+// extractHex extracts the segments of a firmware image from an Intel HEX file.
+func extractHex(fp *os.File) ([]imageRange, error) {
+	var segments segmentList
+	var base uint64 // from an extended segment or linear address record
+	scanner := bufio.NewScanner(fp)
+	for line := 1; scanner.Scan(); line++ {
+		text := strings.TrimSpace(scanner.Text())
+		if text == "" {
+			continue
 		}
-		data, err := ioutil.ReadAll(prog.Open())
-		if err != nil {
-			return 0, nil, fmt.Errorf("failed to extract segment from ELF file")
+		if text[0] != ':' {
+			return nil, fmt.Errorf("line %d: record doesn't start with ':'", line)
+		}
+		record, err := hex.DecodeString(text[1:])
+		if err != nil || len(record) < 5 || len(record) != 5+int(record[0]) {
+			return nil, fmt.Errorf("line %d: invalid record", line)
+		}
+		var sum byte
+		for _, b := range record {
+			sum += b
+		}
+		if sum != 0 {
+			return nil, fmt.Errorf("line %d: checksum mismatch", line)
+		}
+		data := record[4 : len(record)-1]
+		switch record[3] {
+		case 0x00: // data
+			segments.add(base+uint64(binary.BigEndian.Uint16(record[1:])), data)
+		case 0x01: // end of file
+			return segments.sorted()
+		case 0x02: // extended segment address
+			if len(data) != 2 {
+				return nil, fmt.Errorf("line %d: invalid extended segment address", line)
+			}
+			base = uint64(binary.BigEndian.Uint16(data)) << 4
+		case 0x04: // extended linear address
+			if len(data) != 2 {
+				return nil, fmt.Errorf("line %d: invalid extended linear address", line)
+			}
+			base = uint64(binary.BigEndian.Uint16(data)) << 16
+		case 0x03, 0x05: // start address, not needed for flash
+		default:
+			return nil, fmt.Errorf("line %d: unknown record type 0x%02x", line, record[3])
+		}
+	}
+	if err := scanner.Err(); err != nil {
+		return nil, err
+	}
+	return nil, fmt.Errorf("missing end of file record")
+}
+
+// Layout of a UF2 block, see https://github.com/microsoft/uf2.
+const (
+	uf2BlockSize      = 512
+	uf2MaxPayload     = 476
+	uf2MagicStart0    = 0x0a324655 // "UF2\n"
+	uf2MagicStart1    = 0x9e5d5157
+	uf2MagicEnd       = 0x0ab16f30
+	uf2FlagNotMain    = 0x00000001 // not to be written to main flash
+	uf2FlagContainer  = 0x00001000 // part of a file container, not flash contents
+	uf2HeaderSize     = 32
+	uf2MagicEndOffset = uf2BlockSize - 4
+)
+
+// extractUF2 extracts the segments of a firmware image from a UF2 file.
+func extractUF2(fp *os.File) ([]imageRange, error) {
+	file, err := ioutil.ReadAll(fp)
+	if err != nil {
+		return nil, err
+	}
+	if len(file)%uf2BlockSize != 0 {
+		return nil, fmt.Errorf("file size is not a multiple of %d bytes", uf2BlockSize)
+	}
+	var segments segmentList
+	for i := 0; i < len(file); i += uf2BlockSize {
+		block := file[i : i+uf2BlockSize]
+		if binary.LittleEndian.Uint32(block[0:]) != uf2MagicStart0 ||
+			binary.LittleEndian.Uint32(block[4:]) != uf2MagicStart1 ||
+			binary.LittleEndian.Uint32(block[uf2MagicEndOffset:]) != uf2MagicEnd {
+			return nil, fmt.Errorf("block %d: invalid magic", i/uf2BlockSize)
+		}
+		flags := binary.LittleEndian.Uint32(block[8:])
+		if flags&(uf2FlagNotMain|uf2FlagContainer) != 0 {
+			continue
 		}
-		rom = append(rom, data...)
+		addr := binary.LittleEndian.Uint32(block[12:])
+		size := binary.LittleEndian.Uint32(block[16:])
+		if size > uf2MaxPayload {
+			return nil, fmt.Errorf("block %d: invalid payload size %d", i/uf2BlockSize, size)
+		}
+		segments.add(uint64(addr), block[uf2HeaderSize:uf2HeaderSize+size])
+	}
+	return segments.sorted()
+}
+
+// extractBin returns the contents of a raw binary file, which is loaded at
+// the address given with -base-address.
+func extractBin(fp *os.File) ([]imageRange, error) {
+	if *flagBaseAddr == 0 {
+		return nil, fmt.Errorf("the load address of a raw binary must be given with -base-address")
 	}
-	if progs[0].Paddr < startAddr {
-		// The lowest memory address is before the first section. This means
-		// that there is some extra data loaded at the start of the image that
-		// should be discarded.
-		// Example: ELF files where .text doesn't start at address 0 because
-		// there is a bootloader at the start.
-		return startAddr, rom[startAddr-progs[0].Paddr:], nil
-	} else {
-		return progs[0].Paddr, rom, nil
+	data, err := ioutil.ReadAll(fp)
+	if err != nil {
+		return nil, err
 	}
+	var segments segmentList
+	segments.add(*flagBaseAddr, data)
+	return segments.sorted()
 }
 
-func readInput(filename string) (uint64, []byte, error) {
+// readInput reads the firmware image from an ELF, Intel HEX, UF2, raw binary
+// (.bin) file or DFU package (.dfu). It returns the data of the image sorted
+// by address, without the gaps in between.
+func readInput(filename string) ([]imageRange, error) {
 	f, err := os.Open(filename)
 	if err != nil {
-		return 0, nil, err
+		return nil, err
 	}
 	defer f.Close()
 
+	// A raw binary has no header, it is recognized by its extension.
+	if strings.HasSuffix(strings.ToLower(filename), ".bin") {
+		return extractBin(f)
+	}
+
 	// Read the magic (first 4 bytes) of the file.
 	magic := make([]byte, 4)
 	_, err = f.ReadAt(magic, 0)
 	if err != nil {
-		return 0, nil, err
+		return nil, err
 	}
 
 	// Determine file type, and extract content.
 	switch {
+	case string(magic) == packageMagic:
+		return extractPackage(f)
 	case string(magic) == "\x7fELF":
 		return extractELF(f)
+	case binary.LittleEndian.Uint32(magic) == uf2MagicStart0:
+		return extractUF2(f)
+	case magic[0] == ':':
+		return extractHex(f)
 	default:
-		return 0, nil, fmt.Errorf("could not determine file type (magic: %02x %02x %02x %02x)", magic[0], magic[1], magic[2], magic[3])
+		return nil, fmt.Errorf("could not determine file type (magic: %02x %02x %02x %02x)", magic[0], magic[1], magic[2], magic[3])
+	}
+}
+
+// pageRanges turns the segments of an image into the ranges that are written
+// with a COMMAND_START each. A range starts at a page boundary, as only whole
+// pages can be erased, and is padded to a multiple of 4 bytes. Segments are
+// only written as one range if the gap between them doesn't cover a whole
+// page: the gap is then filled with the value of erased flash. Segments that
+// already are such ranges, like those of a DFU package, are used as they are.
+func pageRanges(segments []imageRange) []imageRange {
+	var ranges []imageRange
+	for _, segment := range segments {
+		pageStart := segment.addr &^ (pageSize - 1)
+		if len(ranges) != 0 {
+			last := &ranges[len(ranges)-1]
+			lastEnd := last.addr + uint64(len(last.data))
+			if pageStart <= (lastEnd+pageSize-1)&^(pageSize-1) {
+				last.data = append(last.data, bytes.Repeat([]byte{0xff}, int(segment.addr-lastEnd))...)
+				last.data = append(last.data, segment.data...)
+				continue
+			}
+		}
+		if pageStart == segment.addr && len(segment.data)%4 == 0 {
+			ranges = append(ranges, segment)
+			continue
+		}
+		data := bytes.Repeat([]byte{0xff}, int(segment.addr-pageStart))
+		ranges = append(ranges, imageRange{pageStart, append(data, segment.data...)})
+	}
+
+	// The bootloader writes whole words, so pad the ranges to a multiple of 4
+	// bytes with the value of erased flash.
+	for i := range ranges {
+		for len(ranges[i].data)%4 != 0 {
+			ranges[i].data = append(ranges[i].data, 0xff)
+		}
 	}
+	return ranges
 }
@@ -0,0 +1,237 @@
+package main
+
+import (
+	"crypto/ed25519"
+	"errors"
+	"flag"
+	"fmt"
+	"os"
+	"strings"
+	"sync"
+	"time"
+
+	"github.com/tinygo-org/bluetooth"
+)
+
+// fleetDevice is a device found by the fleet command.
+type fleetDevice struct {
+	name      string
+	transport transport
+}
+
+// fleetResult is the outcome of the update of one device.
+type fleetResult struct {
+	device  fleetDevice
+	err     error
+	written int           // bytes written
+	write   time.Duration // time spent erasing and writing
+	total   time.Duration // time since the update of this device started
+}
+
+// rangeCache caches a value derived from a range of the image, such as its
+// signature or compressed data. All updates of a fleet share the image, so
+// this is done once instead of once per device. A DFU package (see
+// package.go) fills in what was derived when it was made.
+type rangeCache struct {
+	mutex  sync.Mutex
+	values map[rangeKey][]byte
+}
+
+// rangeKey identifies a range by its data, not its contents: a part of a
+// range (for example when resuming) is a different range.
+type rangeKey struct {
+	addr   uint64
+	data   *byte
+	length int
+}
+
+var (
+	signatureCache rangeCache
+	compressCache  rangeCache
+	pageHashCache  rangeCache
+)
+
+// get returns the value for the given range, deriving it if it isn't known
+// yet. Other updates wait until it has been derived.
+func (c *rangeCache) get(addr uint64, data []byte, derive func() []byte) []byte {
+	if len(data) == 0 {
+		return derive()
+	}
+	key := rangeKey{addr, &data[0], len(data)}
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	if value, ok := c.values[key]; ok {
+		return value
+	}
+	if c.values == nil {
+		c.values = make(map[rangeKey][]byte)
+	}
+	value := derive()
+	c.values[key] = value
+	return value
+}
+
+// put stores the value for the given range.
+func (c *rangeCache) put(addr uint64, data []byte, value []byte) {
+	c.get(addr, data, func() []byte {
+		return value
+	})
+}
+
+// fleetCommand implements the fleet command: it finds every device in range
+// with the DFU service and updates them, several at a time. The image is read
+// once for all of them.
+func fleetCommand(args []string) {
+	flags := flag.NewFlagSet("fleet", flag.ExitOnError)
+	// The flags for an update apply to every device.
+	flag.VisitAll(func(f *flag.Flag) {
+		flags.Var(f.Value, f.Name, f.Usage)
+	})
+	scanTime := flags.Duration("scan", 5*time.Second, "how long to look for devices")
+	name := flags.String("name", "", "only update devices whose name starts with this")
+	addressList := flags.String("addresses", "", "only update the devices with these addresses (separated by commas)")
+	parallel := flags.Int("parallel", 4, "number of devices to update at the same time, at most the number of connections the adapter supports")
+	flags.Usage = func() {
+		fmt.Printf("usage: %s fleet [flags] <filename>\n", os.Args[0])
+		fmt.Println("With -virtual, the simulated bootloaders listening on the given sockets (separated by commas) are updated.")
+		flags.PrintDefaults()
+		os.Exit(0)
+	}
+	flags.Parse(args)
+	if flags.NArg() != 1 || *parallel < 1 {
+		flags.Usage()
+	}
+
+	ranges, err := readImage(flags.Arg(0))
+	handleError("could not read input file", err)
+	if *flagKey != "" {
+		signingKey, err = loadPrivateKey(*flagKey)
+		handleError("could not read private key", err)
+	}
+	if *flagSig != "" {
+		if *flagDelta || len(ranges) != 1 {
+			handleError("could not read signature", errors.New("a signature of the whole image can't be used with -delta or for an image with gaps, use -key instead"))
+		}
+		imageSignature, err = readHexFile(*flagSig, ed25519.SignatureSize)
+		handleError("could not read signature", err)
+	}
+
+	var devices []fleetDevice
+	if *flagVirtual != "" {
+		for _, path := range strings.Split(*flagVirtual, ",") {
+			devices = append(devices, fleetDevice{path, &virtualTransport{path: path}})
+		}
+	} else {
+		addresses := make(map[string]bool)
+		if *addressList != "" {
+			for _, addr := range strings.Split(*addressList, ",") {
+				addresses[strings.ToUpper(strings.TrimSpace(addr))] = true
+			}
+		}
+		devices, err = findFleet(*scanTime, *name, addresses)
+		handleError("could not look for devices", err)
+	}
+	if len(devices) == 0 {
+		fmt.Println("No devices found.")
+		os.Exit(1)
+	}
+	fmt.Printf("Updating %d devices, %d at a time...\n", len(devices), *parallel)
+
+	// Hide the progress output of the updates, which would be mixed up.
+	stdoutFile := os.Stdout
+	os.Stdout, err = os.OpenFile(os.DevNull, os.O_WRONLY, 0)
+	handleError("could not open "+os.DevNull, err)
+
+	// Every worker updates one device at a time, so a slow or unreachable
+	// device only holds up its own worker.
+	queue := make(chan fleetDevice, len(devices))
+	for _, device := range devices {
+		queue <- device
+	}
+	close(queue)
+	results := make(chan fleetResult)
+	for i := 0; i < *parallel && i < len(devices); i++ {
+		go func() {
+			for device := range queue {
+				results <- updateFleetDevice(device, ranges)
+			}
+		}()
+	}
+
+	failed := 0
+	for range devices {
+		result := <-results
+		if result.err != nil {
+			failed++
+			fmt.Fprintf(stdoutFile, "%-32s failed after %.1fs: %s\n", result.device.name, result.total.Seconds(), result.err)
+			continue
+		}
+		fmt.Fprintf(stdoutFile, "%-32s ok in %.1fs", result.device.name, result.total.Seconds())
+		if result.written != 0 {
+			fmt.Fprintf(stdoutFile, ", wrote %d bytes (%.1f kB/s)", result.written, float64(result.written)/1000/result.write.Seconds())
+		}
+		fmt.Fprintln(stdoutFile)
+	}
+	os.Stdout.Close()
+	os.Stdout = stdoutFile
+	fmt.Printf("%d of %d devices updated.\n", len(devices)-failed, len(devices))
+	if failed != 0 {
+		os.Exit(1)
+	}
+}
+
+// updateFleetDevice updates a single device of the fleet.
+func updateFleetDevice(device fleetDevice, ranges []imageRange) fleetResult {
+	start := time.Now()
+	conn := newDFUConn(device.transport)
+	err := conn.update(ranges)
+	return fleetResult{
+		device:  device,
+		err:     err,
+		written: conn.written,
+		write:   conn.phaseTimes[phaseErase] + conn.phaseTimes[phaseTransfer] + conn.phaseTimes[phaseFinish],
+		total:   time.Since(start),
+	}
+}
+
+// findFleet scans for the given time and returns every device with the DFU
+// service that matches the given name prefix and addresses (if any).
+func findFleet(scanTime time.Duration, name string, addresses map[string]bool) ([]fleetDevice, error) {
+	err := adapter.Enable()
+	if err != nil {
+		return nil, fmt.Errorf("could not enable BLE adapter: %w", err)
+	}
+	fmt.Printf("Looking for devices for %s...\n", scanTime)
+	var devices []fleetDevice
+	found := make(map[string]bool)
+	scanMutex.Lock()
+	defer scanMutex.Unlock()
+	timer := time.AfterFunc(scanTime, func() {
+		adapter.StopScan()
+	})
+	defer timer.Stop()
+	err = adapter.Scan(func(adapter *bluetooth.Adapter, result bluetooth.ScanResult) {
+		if !result.AdvertisementPayload.HasServiceUUID(serviceUUID) {
+			return
+		}
+		addr := strings.ToUpper(result.Address.String())
+		if found[addr] || (name != "" && !strings.HasPrefix(result.LocalName(), name)) {
+			return
+		}
+		if len(addresses) != 0 && !addresses[addr] {
+			return
+		}
+		found[addr] = true
+		device := fleetDevice{deviceName(result), &bleTransport{address: result.Address}}
+		devices = append(devices, device)
+		fmt.Printf("Found %s.\n", device.name)
+		if len(addresses) != 0 && len(devices) == len(addresses) {
+			// All devices that were asked for have been found.
+			adapter.StopScan()
+		}
+	})
+	if err != nil {
+		return nil, fmt.Errorf("could not start a scan: %w", err)
+	}
+	return devices, nil
+}
@@ -2,17 +2,21 @@ package main
 
 import (
 	"bytes"
+	"crypto/ed25519"
 	"encoding/binary"
+	"encoding/hex"
+	"errors"
 	"flag"
 	"fmt"
+	"hash/crc32"
+	"io/ioutil"
+	"net"
 	"os"
 	"time"
 
 	"github.com/tinygo-org/bluetooth"
 )
 
-var adapter = bluetooth.DefaultAdapter
-
 var (
 	serviceUUID = bluetooth.NewUUID([16]byte{0xcb, 0x15, 0x00, 0x01, 0x24, 0x04, 0x4e, 0x66, 0xab, 0x07, 0xa5, 0xf1, 0x05, 0x3f, 0x14, 0xce})
 	commandUUID = bluetooth.NewUUID([16]byte{0xcb, 0x15, 0x00, 0x02, 0x24, 0x04, 0x4e, 0x66, 0xab, 0x07, 0xa5, 0xf1, 0x05, 0x3f, 0x14, 0xce})
@@ -24,6 +28,21 @@ const (
 	commandResetBootloader = 0x00
 	commandReset           = 0x01
 	commandStart           = 0x02 // start, will earse the necessary flash area
+	commandPageHashes      = 0x03 // return the CRC-32 of a number of flash pages
+	commandSignature       = 0x04 // part of the signature of the next update
+	commandStats           = 0x05 // return the performance counters
+	commandImageInfo       = 0x06 // chip and version of the image of the next update
+)
+
+// Flags for the start command.
+const (
+	startFlagStream     = 0x01 // erase pages just in time while data is coming in
+	startFlagCompressed = 0x02 // data is compressed
+	startFlagResume     = 0x04 // continue an interrupted update of the same image
+	startFlagOffsets    = 0x08 // data packets start with their offset
+	startFlagSigned     = 0x10 // in the reply: the bootloader only accepts signed updates
+	startFlagMore       = 0x20 // more ranges of the same image follow
+	startFlagStage      = 0x40 // to the application: store the update, the bootloader installs it at the next reset
 )
 
 // Statuses returned. They can be returned at any time, but are usually returned
@@ -33,147 +52,483 @@ const (
 	statusEraseStarted       = 0x02 // erase started
 	statusEraseFinished      = 0x03 // erase finished, client may start to stream data
 	statusWriteFinished      = 0x04 // write finished, firmware has been rewritten
+	statusPageHashes         = 0x05 // page hashes, in reply to commandPageHashes
+	statusCredit             = 0x06 // a page has been written, more data may be sent
+	statusDataMissing        = 0x07 // some data must be sent again
+	statusStats              = 0x08 // performance counters, in reply to commandStats
 	statusBusy               = 0x10 // another command is still running
-	statusInvalidEraseStart  = 0x20 // invalid start address for erase command (not at APP_CODE_BASE)
+	statusInvalidEraseStart  = 0x20 // invalid start address for erase command (before APP_CODE_BASE or not page aligned)
 	statusInvalidEraseLength = 0x21 // invalid length for erase command (would overwrite bootloader)
+	statusInvalidChip        = 0x22 // the image was made for another chip
 	statusEraseFailed        = 0x30 // could not erase flash page
 	statusWriteFailed        = 0x31 // could not write flash page
 	statusWriteTooFast       = 0x32 // could not write flash page: data came in faster than could be written
+	statusCRCMismatch        = 0x33 // all data was written, but the CRC-32 of the flash doesn't match
+	statusSignatureInvalid   = 0x34 // all data was written, but the signature is missing or invalid
 )
 
+// CPU frequency of the nRF52, to convert cycle counts to time.
+const cpuFrequency = 64e6
+
 func usage() {
-	fmt.Printf("usage: %s <filename>\n", os.Args[0])
+	fmt.Printf("usage: %s [flags] <filename>\n", os.Args[0])
+	flag.PrintDefaults()
 	os.Exit(0)
 }
 
+var (
+	flagStream   = flag.Bool("stream", true, "erase pages while sending data instead of all at once")
+	flagDelta    = flag.Bool("delta", false, "only send the pages that differ from the firmware on the device")
+	flagCompress = flag.Bool("compress", false, "compress data, if supported by the bootloader")
+	flagResume   = flag.Bool("resume", false, "continue an interrupted update of the same image")
+	flagRetries  = flag.Int("retries", 3, "number of times to reconnect and resume when the connection is lost")
+	flagGenKey   = flag.String("genkey", "", "generate a key pair for signed updates, write it to this file and exit")
+	flagKey      = flag.String("key", "", "sign updates with the private key in this file")
+	flagSig      = flag.String("signature", "", "attach the signature in this file (see -write-signature) to the update")
+	flagWriteSig = flag.String("write-signature", "", "write the signature of the image to this file and exit (needs -key)")
+	flagOffsets  = flag.Bool("offsets", false, "send the offset with each packet, so that lost packets can be sent again (not with -compress)")
+	flagBaseAddr = flag.Uint64("base-address", 0, "load address of a raw binary (.bin) file")
+	flagHostAddr = flag.String("host-address", "", "Bluetooth address of this computer, sent with the reset into DFU mode so that the bootloader advertises directly to it")
+	flagStage    = flag.Bool("stage", false, "send the update to the running application, which keeps running while it stores it (the bootloader installs it at the next reset)")
+	flagVirtual  = flag.String("virtual", "", "update the simulated bootloader listening on this socket (see build/sim/bootloader-server) instead of a device over BLE")
+	flagSerial   = flag.String("serial", "", "update the bootloader on this serial port (see TRANSPORT_SERIAL in the Makefile) instead of over BLE")
+)
+
+// How long to wait for a reply from the bootloader before assuming the
+// connection was lost. Erasing a large image at once can take a while.
+var responseTimeout = 30 * time.Second
+
+var errConnectionLost = errors.New("connection lost")
+
 func main() {
+	if len(os.Args) >= 2 && os.Args[1] == "bench" {
+		bench(os.Args[2:])
+		return
+	}
+	if len(os.Args) >= 2 && os.Args[1] == "fleet" {
+		fleetCommand(os.Args[2:])
+		return
+	}
+	if len(os.Args) >= 2 && os.Args[1] == "broadcast" {
+		broadcastCommand(os.Args[2:])
+		return
+	}
+	if len(os.Args) >= 2 && os.Args[1] == "pack" {
+		packCommand(os.Args[2:])
+		return
+	}
+	if len(os.Args) >= 2 && os.Args[1] == "trace" {
+		traceCommand(os.Args[2:])
+		return
+	}
 	flag.Parse()
+	if *flagGenKey != "" {
+		handleError("could not generate key", generateKey(*flagGenKey))
+		return
+	}
 	if flag.NArg() != 1 {
 		usage()
 	}
 
-	startAddr, data, err := readInput(flag.Arg(0))
+	ranges, err := readImage(flag.Arg(0))
 	handleError("could not read input file", err)
-	if startAddr+uint64(len(data)) > 0xffffffff {
-		fmt.Fprintf(os.Stderr, "file data does not fit (range: 0x%08x..0x%08x)\n", startAddr, startAddr+uint64(len(data)))
-	}
-
-	err = adapter.Enable()
-	handleError("could not enable BLE adapter", err)
 
-	var foundDevice bluetooth.ScanResult
-	fmt.Println("Looking for nearby device...")
-	err = adapter.Scan(func(adapter *bluetooth.Adapter, result bluetooth.ScanResult) {
-		if !result.AdvertisementPayload.HasServiceUUID(serviceUUID) {
-			return
+	if *flagKey != "" {
+		signingKey, err = loadPrivateKey(*flagKey)
+		handleError("could not read private key", err)
+	}
+	if *flagWriteSig != "" {
+		if signingKey == nil {
+			handleError("could not sign image", errors.New("no key given with -key"))
+		}
+		if len(ranges) != 1 {
+			handleError("could not sign image", errors.New("the image has gaps, so each range is signed separately: use -key instead"))
 		}
-		foundDevice = result
+		signature := rangeSignature(ranges[0].addr, ranges[0].data)
+		err = ioutil.WriteFile(*flagWriteSig, []byte(hex.EncodeToString(signature)+"\n"), 0644)
+		handleError("could not write signature", err)
+		return
+	}
+	if *flagSig != "" {
+		if *flagDelta {
+			handleError("could not read signature", errors.New("a signature of the whole image can't be used with -delta, use -key instead"))
+		}
+		if len(ranges) != 1 {
+			handleError("could not read signature", errors.New("a signature of the whole image can't be used for an image with gaps, use -key instead"))
+		}
+		imageSignature, err = readHexFile(*flagSig, ed25519.SignatureSize)
+		handleError("could not read signature", err)
+	}
 
-		// Stop the scan.
-		err := adapter.StopScan()
-		handleError("could not stop the scan", err)
-	})
-	handleError("could not start a scan", err)
+	var t transport = &bleTransport{}
+	if *flagVirtual != "" {
+		t = &virtualTransport{path: *flagVirtual}
+	} else if *flagSerial != "" {
+		t = &serialTransport{path: *flagSerial}
+	}
+	err = newDFUConn(t).update(ranges)
+	if err != nil {
+		fmt.Fprintln(os.Stderr, err)
+		os.Exit(1)
+	}
+}
 
-	// Print the device we've found.
-	if name := foundDevice.LocalName(); name == "" {
-		fmt.Printf("Connecting to %s...\n", foundDevice.Address)
-	} else {
-		fmt.Printf("Connecting to %s (%s)...\n", name, foundDevice.Address)
+// readImage reads the firmware image from the given file, as the ranges that
+// are written to flash.
+func readImage(path string) ([]imageRange, error) {
+	segments, err := readInput(path)
+	if err != nil {
+		return nil, err
+	}
+	last := segments[len(segments)-1]
+	if last.addr+uint64(len(last.data)) > 0xffffffff {
+		fmt.Fprintf(os.Stderr, "file data does not fit (range: 0x%08x..0x%08x)\n", segments[0].addr, last.addr+uint64(len(last.data)))
 	}
+	return pageRanges(segments), nil
+}
 
-	// Connect to it.
-	device, err := adapter.Connect(foundDevice.Address, bluetooth.ConnectionParams{})
-	handleError("failed to connect", err)
-
-	// Connected. Look up the DFU service.
-	fmt.Println("Looking up DFU service...")
-	services, err := device.DiscoverServices([]bluetooth.UUID{serviceUUID})
-	handleError("failed to discover the DFU service", err)
-	service := services[0]
-
-	// Get the two characteristics present in this service.
-	chars, err := service.DiscoverCharacteristics([]bluetooth.UUID{commandUUID, dataUUID})
-	handleError("failed to discover characteristics", err)
-	commandChar := chars[0]
-	dataChar := chars[1]
-
-	// Subscribe to status updates (command accepted, command rejected, command
-	// completed).
-	responseChan := make(chan uint8)
-	commandChar.EnableNotifications(func(buf []byte) {
-		responseChan <- buf[0]
-	})
+// imageSize returns the number of bytes in the given ranges.
+func imageSize(ranges []imageRange) int {
+	size := 0
+	for _, r := range ranges {
+		size += len(r.data)
+	}
+	return size
+}
+
+// update finds the device and writes the firmware image to it, then resets
+// it to start the new firmware.
+func (c *dfuConn) update(image []imageRange) error {
+	err := c.transport.find()
+	if err != nil {
+		return err
+	}
+	err = c.connect()
+	if err != nil {
+		return fmt.Errorf("failed to connect: %w", err)
+	}
 
 	// Send the "reset into bootloader" message. It is ignored by the bootloader
-	// but results in a reset in the stub DFU service.
+	// but results in a reset in the stub DFU service. With the address of this
+	// computer, the bootloader advertises directly to it after the reset.
 	// We normally don't get an error, but will get the error with the next
 	// command we'll send.
-	_, err = commandChar.WriteWithoutResponse([]byte{commandResetBootloader})
-	handleError("failed to send reset bootloader command", err)
+	// A staged update is sent to the application itself, so it isn't reset.
+	resetCommand := []byte{commandResetBootloader}
+	if *flagHostAddr != "" {
+		addr, err := net.ParseMAC(*flagHostAddr)
+		if err != nil || len(addr) != 6 {
+			return fmt.Errorf("invalid host address: %s", *flagHostAddr)
+		}
+		resetCommand = append(resetCommand, 0) // public address
+		for i := len(addr) - 1; i >= 0; i-- {
+			resetCommand = append(resetCommand, addr[i]) // little endian
+		}
+	}
+	if !*flagStage {
+		err = c.transport.writeCommand(resetCommand)
+		if err != nil {
+			return fmt.Errorf("failed to send reset bootloader command: %w", err)
+		}
+	}
 
-	// Start the write by erasing the flash.
-	buf := &bytes.Buffer{}
-	buf.Write([]byte{commandStart, 0, 0, 0})
-	binary.Write(buf, binary.LittleEndian, uint32(startAddr))
-	binary.Write(buf, binary.LittleEndian, uint32(len(data)))
+	// Determine which parts of the firmware need to be written.
+	ranges := image
+	if len(image) > 1 {
+		fmt.Printf("The image has %d ranges with %d bytes in total, gaps are skipped.\n", len(image), imageSize(image))
+	}
+	if *flagDelta {
+		ranges = nil
+		for _, r := range image {
+			changed, err := c.changedRanges(r.addr, r.data)
+			if err != nil {
+				fmt.Printf("Could not compare with the firmware on the device (%s), sending everything.\n", err)
+				ranges = image
+				break
+			}
+			ranges = append(ranges, changed...)
+		}
+	}
 
-	_, err = commandChar.WriteWithoutResponse(buf.Bytes())
-	if err != nil && err.Error() == "Not connected" {
+	if *flagStage && len(ranges) > 1 {
+		// The application stores a single range, the bootloader installs it
+		// at once.
+		return fmt.Errorf("an image with gaps can't be staged")
+	}
+
+	var writeDuration time.Duration
+	for i, r := range ranges {
+		start := time.Now()
+		resume := *flagResume
+		more := i < len(ranges)-1
+		for retry := 0; ; retry++ {
+			err = c.writeRange(r.addr, r.data, resume, more)
+			if err == nil || !errors.Is(err, errConnectionLost) || retry >= *flagRetries {
+				break
+			}
+			// The bootloader keeps track of which pages have been written,
+			// so we can continue where we left off.
+			fmt.Printf("\033[2K\rConnection lost (%s), reconnecting to resume the update...\n", err)
+			err = c.reconnect()
+			if err != nil {
+				break
+			}
+			resume = true
+		}
+		if err != nil {
+			return fmt.Errorf("failed to write new application: %w", err)
+		}
+		writeDuration += time.Since(start)
+		c.written += len(r.data)
+	}
+
+	// Completed.
+	if c.written != 0 && c.staged {
+		fmt.Printf("Update staged in %s (%.1f kB/s), it is installed at the next reset.\n", writeDuration.Round(time.Millisecond), float64(c.written)/1000/writeDuration.Seconds())
+	} else if c.written != 0 {
+		fmt.Printf("Write completed in %s (%.1f kB/s).\n", writeDuration.Round(time.Millisecond), float64(c.written)/1000/writeDuration.Seconds())
+
+		// Show what the bootloader measured during the update.
+		stats, err := c.readStats()
+		if err != nil {
+			fmt.Printf("Could not read the statistics of the bootloader (%s).\n", err)
+		} else {
+			stats.print()
+		}
+	}
+	fmt.Printf("Resetting device...\n")
+	c.transport.writeCommand([]byte{commandReset})
+	return nil
+}
+
+// dfuConn is a connection to a device running the bootloader (or an
+// application with the stub DFU service).
+type dfuConn struct {
+	transport    transport
+	responseChan chan []byte
+	reconnected  bool
+	pacer        pacer
+	written      int  // bytes written by update
+	staged       bool // the update was staged by the application, see startFlagStage
+
+	// Time spent in each phase of the update so far, see endPhase.
+	phaseTimes [numPhases]time.Duration
+	phaseStart time.Time
+}
+
+// Phases of an update, as reported by the bench command.
+const (
+	phaseConnect  = iota // finding the device and connecting to it, also after a lost connection
+	phaseErase           // from COMMAND_START until STATUS_ERASE_FINISHED
+	phaseTransfer        // sending the data, until everything was sent once
+	phaseFinish          // sending missing data and waiting for STATUS_WRITE_FINISHED
+	numPhases
+)
+
+var phaseNames = [numPhases]string{"connect", "erase", "transfer", "finish"}
+
+func newDFUConn(t transport) *dfuConn {
+	return &dfuConn{
+		transport:    t,
+		responseChan: make(chan []byte, 16),
+		phaseStart:   time.Now(),
+	}
+}
+
+// endPhase adds the time since the end of the previous phase to the given
+// phase.
+func (c *dfuConn) endPhase(phase int) {
+	now := time.Now()
+	c.phaseTimes[phase] += now.Sub(c.phaseStart)
+	c.phaseStart = now
+}
+
+// connect connects to the device and subscribes to the replies of the
+// bootloader.
+func (c *dfuConn) connect() error {
+	err := c.transport.connect(func(buf []byte) {
+		c.responseChan <- append([]byte(nil), buf...)
+	})
+	c.endPhase(phaseConnect)
+	return err
+}
+
+// command sends a command to the bootloader. If the device reset itself into
+// the bootloader after the "reset into bootloader" command, the connection is
+// re-established and the command is sent again.
+func (c *dfuConn) command(buf []byte) error {
+	err := c.transport.writeCommand(buf)
+	if err != nil && err.Error() == "Not connected" && !c.reconnected {
 		// The device reset itself, so the connection will have been broken.
 		// Re-establish the connection.
+		c.reconnected = true
 		fmt.Println("Lost connection. This probably means the device is resetting into DFU mode. Finding device again...")
-		err = adapter.Scan(func(adapter *bluetooth.Adapter, result bluetooth.ScanResult) {
-			if result.Address != foundDevice.Address {
-				return
-			}
-			foundDevice = result
+		err = c.reconnect()
+		if err != nil {
+			return err
+		}
 
-			// Stop the scan.
-			err := adapter.StopScan()
-			handleError("could not stop the scan", err)
-		})
-		handleError("could not start a scan", err)
+		// Try again to send the command.
+		err = c.transport.writeCommand(buf)
+	}
+	return err
+}
 
-		// Connect to it.
-		fmt.Printf("Reconnecting...\n")
-		device, err := adapter.Connect(foundDevice.Address, bluetooth.ConnectionParams{})
-		handleError("failed to connect", err)
+// reconnect finds the device again and connects to it.
+func (c *dfuConn) reconnect() error {
+	err := c.transport.find()
+	if err != nil {
+		return err
+	}
 
-		// Connected. Look up the DFU service.
-		fmt.Println("Looking up DFU service...")
-		services, err := device.DiscoverServices([]bluetooth.UUID{serviceUUID})
-		handleError("failed to discover the DFU service", err)
-		service := services[0]
+	// Discard replies left over from the previous connection.
+	for len(c.responseChan) != 0 {
+		<-c.responseChan
+	}
 
-		// Get the two characteristics present in this service.
-		chars, err := service.DiscoverCharacteristics([]bluetooth.UUID{commandUUID, dataUUID})
-		handleError("failed to discover characteristics", err)
-		commandChar = chars[0]
-		dataChar = chars[1]
+	// Connect to it.
+	fmt.Printf("Reconnecting...\n")
+	return c.connect()
+}
 
-		// Try again to erase the flash.
-		_, err = commandChar.WriteWithoutResponse(buf.Bytes())
+// response waits for the next reply from the bootloader.
+func (c *dfuConn) response() ([]byte, error) {
+	select {
+	case response := <-c.responseChan:
+		return response, nil
+	case <-time.After(responseTimeout):
+		return nil, fmt.Errorf("no reply from the bootloader: %w", errConnectionLost)
 	}
+}
 
+// writeRange erases the flash for the given range and writes the data to it.
+// The start address must be aligned to a flash page. With resume set, the
+// bootloader may continue an earlier interrupted update of the same data. With
+// more set, other ranges of the image follow, so the bootloader must not start
+// the application yet.
+func (c *dfuConn) writeRange(startAddr uint64, data []byte, resume, more bool) error {
+	// Start the write by erasing the flash.
+	var startFlags byte
+	if *flagStream {
+		// Only wait for the first page to be erased. Older bootloaders ignore
+		// this flag and erase everything before replying.
+		startFlags |= startFlagStream
+	}
+	if *flagCompress {
+		startFlags |= startFlagCompressed
+	}
+	if resume {
+		startFlags |= startFlagResume
+	}
+	if *flagOffsets {
+		startFlags |= startFlagOffsets
+	}
+	if more {
+		startFlags |= startFlagMore
+	}
+	if *flagStage {
+		startFlags |= startFlagStage
+	}
+	signature := signatureCache.get(startAddr, data, func() []byte {
+		return rangeSignature(startAddr, data)
+	})
+	if signature != nil {
+		err := c.sendSignature(signature)
+		if err != nil {
+			return fmt.Errorf("failed to send signature: %w: %s", errConnectionLost, err)
+		}
+	}
+	if imageChip != 0 {
+		// A separate command, so that commandStart still fits in a write at
+		// the default ATT MTU. Bootloaders that don't know it ignore it.
+		buf := &bytes.Buffer{}
+		buf.Write([]byte{commandImageInfo, 0, 0, 0})
+		binary.Write(buf, binary.LittleEndian, imageChip)
+		binary.Write(buf, binary.LittleEndian, imageVersion)
+		err := c.command(buf.Bytes())
+		if err != nil {
+			return fmt.Errorf("failed to send image info: %w: %s", errConnectionLost, err)
+		}
+	}
+	buf := &bytes.Buffer{}
+	buf.Write([]byte{commandStart, startFlags, 0, 0})
+	binary.Write(buf, binary.LittleEndian, uint32(startAddr))
+	binary.Write(buf, binary.LittleEndian, uint32(len(data)))
+	binary.Write(buf, binary.LittleEndian, crc32.ChecksumIEEE(data))
+
+	err := c.command(buf.Bytes())
 	fmt.Printf("Erasing flash (start 0x%x, length %d bytes or %.1fkB)...\n", startAddr, len(data), float64(len(data))/1024)
-	handleError("failed to send erase command", err)
+	if err != nil {
+		return fmt.Errorf("failed to send erase command: %w: %s", errConnectionLost, err)
+	}
 
 	// Wait until the command is accepted.
-	status := <-responseChan
+	response, err := c.response()
+	if err != nil {
+		return err
+	}
+	status := response[0]
 
+	maxDataLen := 20 // default ATT MTU (23) minus the ATT header
+	phy := "unknown"
+	var supportedFlags byte
+	creditLimit := -1 // no flow control
+	resumeOffset := 0
 	if status == statusEraseStarted {
+		if len(response) >= 5 {
+			supportedFlags = response[4]
+		}
+		if supportedFlags&startFlagSigned != 0 && signature == nil {
+			fmt.Println("The bootloader only accepts signed updates, but no -key or -signature was given.")
+		}
+		c.staged = supportedFlags&startFlagStage != 0
+		if *flagStage && !c.staged {
+			fmt.Println("The device does not support staged updates, the bootloader writes the update directly.")
+		}
+		if more && supportedFlags&startFlagMore == 0 {
+			fmt.Println("The bootloader does not support images with gaps, it may start the application before the last range has been written.")
+		}
+		if len(response) >= 12 && supportedFlags&startFlagResume != 0 {
+			// Pages before this offset were already written.
+			resumeOffset = int(binary.LittleEndian.Uint32(response[8:]))
+			if resumeOffset != 0 {
+				fmt.Printf("Resuming at 0x%x.\n", startAddr+uint64(resumeOffset))
+			}
+		}
+		if len(response) >= 4 {
+			// The bootloader tells us which PHY is in use and how large a
+			// data packet may be, which depends on the negotiated ATT MTU.
+			phy = phyName(response[1])
+			maxDataLen = int(binary.LittleEndian.Uint16(response[2:]))
+		}
+
 		// Wait until the command is completed.
-		status = <-responseChan
+		response, err = c.response()
+		if err != nil {
+			return err
+		}
+		status = response[0]
 	}
 	switch status {
 	case statusEraseFinished:
 		// Finished!
 		err = nil
+		if len(response) >= 6 {
+			erased := binary.LittleEndian.Uint16(response[2:])
+			skipped := binary.LittleEndian.Uint16(response[4:])
+			fmt.Printf("Erased %d pages (%d pages were already erased).\n", erased, skipped)
+		}
+		if len(response) >= 8 {
+			// The bootloader uses flow control: this is how much data may
+			// be sent until it sends a statusCredit.
+			creditLimit = resumeOffset + int(binary.LittleEndian.Uint16(response[6:]))*pageSize
+		}
 	case statusInvalidEraseStart:
 		err = fmt.Errorf("invalid start address: 0x%x", startAddr)
 	case statusInvalidEraseLength:
 		err = fmt.Errorf("invalid length: 0x%x", len(data))
+	case statusInvalidChip:
+		err = fmt.Errorf("the image is for the nRF%d, the device has another chip", imageChip)
 	case statusBusy:
 		err = fmt.Errorf("an operation is already in progress")
 	case statusEraseFailed:
@@ -181,34 +536,165 @@ func main() {
 	default:
 		err = fmt.Errorf("unknown error (0x%x)", status)
 	}
-	handleError("could not erase flash", err)
+	if err != nil {
+		return fmt.Errorf("could not erase flash: %w", err)
+	}
+	c.endPhase(phaseErase)
+
+	// The length in the start command is the uncompressed length, so if the
+	// bootloader doesn't support compression we can still send the data
+	// uncompressed.
+	// When resuming, only the rest of the data is sent.
+	data = data[resumeOffset:]
+	startAddr += uint64(resumeOffset)
+	payload := data
+	if startFlags&startFlagCompressed != 0 {
+		if supportedFlags&startFlagCompressed != 0 {
+			payload = compressCache.get(startAddr, data, func() []byte {
+				return compress(data)
+			})
+			fmt.Printf("Compressed %d bytes to %d bytes (%.1f%%).\n", len(data), len(payload), float64(len(payload))*100/float64(len(data)))
+		} else {
+			fmt.Println("The bootloader does not support compression, sending uncompressed data.")
+		}
+	}
+
+	// Flow control works on the decompressed data, so we need to know how far
+	// each packet gets in the decompressed data.
+	outputEnd := func(n int) int {
+		return resumeOffset + n
+	}
+	if len(payload) != len(data) {
+		offsets := lzOutputOffsets(payload)
+		outputEnd = func(n int) int {
+			return resumeOffset + offsets[n]
+		}
+	}
+
+	// Write application data, without sending more than the bootloader has
+	// room for.
+	fmt.Printf("Sending data in packets of %d bytes (PHY: %s)...\n", maxDataLen, phy)
+	c.pacer = pacer{}
+	s := newSender(c.transport, maxDataLen)
+	defer s.close()
+	var p progress
+	response = nil
+	if supportedFlags&startFlagOffsets != 0 {
+		response, err = c.sendWithOffsets(s, startAddr, data, resumeOffset, maxDataLen, creditLimit)
+		if err != nil {
+			return err
+		}
+	}
+	for i := 0; i < len(payload) && response == nil; i += maxDataLen {
+		end := i + maxDataLen
+		if end > len(payload) {
+			end = len(payload)
+		}
+		for response == nil {
+			var r []byte
+			if creditLimit < 0 || outputEnd(end) <= creditLimit {
+				// Process notifications that came in, but don't wait.
+				select {
+				case r = <-c.responseChan:
+				default:
+				}
+			} else {
+				// Wait until a page has been written.
+				r, err = c.response()
+				if err != nil {
+					return err
+				}
+			}
+			if r == nil {
+				break
+			}
+			if r[0] != statusCredit || len(r) < 12 {
+				// Something went wrong.
+				response = r
+				break
+			}
+			committed := binary.LittleEndian.Uint32(r[4:])
+			bufferSize := binary.LittleEndian.Uint32(r[8:])
+			creditLimit = int(committed + bufferSize)
+			c.pacer.credit(int(committed))
+		}
+		if response != nil {
+			break
+		}
+		if len(payload) == len(data) {
+			p.print("\rWriting 0x%x (%d%%)...", startAddr+uint64(i), i*100/len(payload))
+		} else {
+			p.print("\rWriting compressed data (%d%%)...", i*100/len(payload))
+		}
+		err = s.send(payload[i:end])
+		if err != nil {
+			return err
+		}
+	}
 
-	// Write application data.
-	startWrite := time.Now()
-	for i := 0; i < len(data); i += 20 {
-		fmt.Printf("\rWriting 0x%x (%d%%)...", startAddr+uint64(i), i*100/len(data))
-		dataChar.WriteWithoutResponse(data[i : i+20])
+	if supportedFlags&startFlagOffsets == 0 {
+		err = s.flush()
+		if err != nil {
+			return err
+		}
+		c.endPhase(phaseTransfer)
 	}
 
 	// Wait for confirmation everything has been written.
-	status = <-responseChan
-	writeDuration := time.Since(startWrite)
+	for response == nil || response[0] == statusCredit {
+		response, err = c.response()
+		if err != nil {
+			return err
+		}
+	}
+	c.endPhase(phaseFinish)
+	status = response[0]
 	fmt.Print("\033[2K\r")
 	if status == statusWriteFinished {
-		err = nil // write finished
+		if len(response) >= 8 {
+			// The bootloader reports how much time it spent processing the
+			// received data, which includes decompressing it.
+			cycles := binary.LittleEndian.Uint32(response[4:])
+			pages := (len(data) + pageSize - 1) / pageSize
+			fmt.Printf("Processing data took %.1fms on the device (%.2fms per page).\n", float64(cycles)/cpuFrequency*1000, float64(cycles)/cpuFrequency*1000/float64(pages))
+		}
+		if len(response) >= 16 {
+			// Hashing happens while the data is being transferred, checking
+			// the signature adds to the time after the last page.
+			hashCycles := binary.LittleEndian.Uint32(response[8:])
+			verifyCycles := binary.LittleEndian.Uint32(response[12:])
+			fmt.Printf("Hashing data took %.1fms, checking the signature took %.1fms.\n", float64(hashCycles)/cpuFrequency*1000, float64(verifyCycles)/cpuFrequency*1000)
+		}
+		c.pacer.print()
+		return nil // write finished
 	} else if status == statusWriteFailed {
-		err = fmt.Errorf("write failed")
+		return fmt.Errorf("write failed")
 	} else if status == statusWriteTooFast {
-		err = fmt.Errorf("write was too fast") // should not happen in practice
+		return fmt.Errorf("write was too fast") // only happens without flow control
+	} else if status == statusSignatureInvalid {
+		return fmt.Errorf("the signature is missing or invalid, the bootloader will not start the update")
+	} else if status == statusCRCMismatch {
+		return fmt.Errorf("the data in flash doesn't match the image (CRC-32 mismatch), the bootloader will not start it")
 	} else {
-		err = fmt.Errorf("unknown (code 0x%x)", status)
+		return fmt.Errorf("unknown (code 0x%x)", status)
 	}
-	handleError("failed to write new application", err)
+}
 
-	// Completed.
-	fmt.Printf("Write completed in %s (%.1f kB/s).\n", writeDuration.Round(time.Millisecond), float64(len(data))/1000/writeDuration.Seconds())
-	fmt.Printf("Resetting device...\n")
-	commandChar.WriteWithoutResponse([]byte{commandReset})
+// phyName returns a human readable name for the PHY as reported by the
+// bootloader.
+func phyName(phy uint8) string {
+	switch phy {
+	case 0:
+		return "serial"
+	case 1:
+		return "1M"
+	case 2:
+		return "2M"
+	case 4:
+		return "coded"
+	default:
+		return "unknown"
+	}
 }
 
 func handleError(msg string, err error) {
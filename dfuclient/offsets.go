@@ -0,0 +1,129 @@
+package main
+
+import (
+	"encoding/binary"
+	"fmt"
+	"time"
+)
+
+// Data packets sent with startFlagOffsets must start at a multiple of this
+// number of bytes.
+const dataBlockSize = 16
+
+// sendWithOffsets sends the data in packets that start with their offset in
+// the image, so that the bootloader can tell which packets got lost and ask
+// for them again. The data starts at the given offset in the image. It returns
+// the first reply that isn't about flow control or missing data.
+func (c *dfuConn) sendWithOffsets(s *sender, startAddr uint64, data []byte, offset, maxDataLen, creditLimit int) ([]byte, error) {
+	chunkSize := (maxDataLen - 4) / dataBlockSize * dataBlockSize
+	imageEnd := offset + len(data)
+	next := offset    // next data that hasn't been sent yet
+	var missing []int // start and end of each range that must be sent again
+	resent := 0       // number of bytes sent again
+	lastReply := time.Now()
+	pollNow := false // a missing range was sent again, ask for the next one
+	sentAll := false // all data was sent at least once
+	header := make([]byte, 4)
+	var p progress
+	for {
+		nextEnd := next + chunkSize
+		if nextEnd > imageEnd {
+			nextEnd = imageEnd
+		}
+		var r []byte
+		if len(missing) != 0 || (next < imageEnd && (creditLimit < 0 || nextEnd <= creditLimit)) {
+			// Process notifications that came in, but don't wait.
+			select {
+			case r = <-c.responseChan:
+			default:
+			}
+		} else {
+			// Wait until a page has been written. If that takes too long, a
+			// packet or reply may have been lost: send a packet without data
+			// to ask what is missing. The bootloader only reports the first
+			// gap by itself, so after a gap has been filled the client asks
+			// for the next one right away.
+			if !pollNow {
+				select {
+				case r = <-c.responseChan:
+				case <-time.After(c.pacer.pollTimeout()):
+					pollNow = true
+				}
+			}
+			if pollNow {
+				pollNow = false
+				if time.Since(lastReply) > responseTimeout {
+					return nil, fmt.Errorf("no reply from the bootloader: %w", errConnectionLost)
+				}
+				binary.LittleEndian.PutUint32(header, uint32(next))
+				err := s.send(header)
+				if err != nil {
+					return nil, err
+				}
+				c.pacer.poll()
+				continue
+			}
+		}
+		if r != nil {
+			lastReply = time.Now()
+			switch {
+			case r[0] == statusCredit && len(r) >= 12:
+				committed := binary.LittleEndian.Uint32(r[4:])
+				bufferSize := binary.LittleEndian.Uint32(r[8:])
+				creditLimit = int(committed + bufferSize)
+				c.pacer.credit(int(committed))
+			case r[0] == statusDataMissing && len(r) >= 12:
+				c.pacer.dataMissing()
+				start := int(binary.LittleEndian.Uint32(r[4:]))
+				end := start + int(binary.LittleEndian.Uint32(r[8:]))
+				if end > next {
+					// Data after this hasn't been sent yet.
+					end = next
+				}
+				if start >= offset && start < end {
+					missing = append(missing, start, end)
+				}
+			default:
+				if resent != 0 {
+					fmt.Printf("\033[2K\rSent %d bytes again.\n", resent)
+				}
+				return r, nil
+			}
+			continue
+		}
+
+		// Send the next packet, starting with the data that got lost.
+		var start, end int
+		if len(missing) != 0 {
+			start = missing[0]
+			end = start + chunkSize
+			if end >= missing[1] {
+				end = missing[1]
+				missing = missing[2:]
+				pollNow = len(missing) == 0
+			} else {
+				missing[0] = end
+			}
+			resent += end - start
+		} else {
+			start = next
+			end = nextEnd
+			next = end
+			p.print("\rWriting 0x%x (%d%%)...", startAddr+uint64(start-offset), (start-offset)*100/len(data))
+		}
+		binary.LittleEndian.PutUint32(header, uint32(start))
+		err := s.send(header, data[start-offset:end-offset])
+		if err != nil {
+			return nil, err
+		}
+		c.pacer.dataSent()
+		if next == imageEnd && !sentAll {
+			sentAll = true
+			err = s.flush()
+			if err != nil {
+				return nil, err
+			}
+			c.endPhase(phaseTransfer)
+		}
+	}
+}
@@ -0,0 +1,104 @@
+package main
+
+import (
+	"fmt"
+	"time"
+)
+
+// Weight of a new sample in the moving averages of the pacer. With 1/4, an
+// estimate is mostly settled after a few pages.
+const pacerWeight = 0.25
+
+// Bounds of the time to wait for a reply before polling for missing data.
+const (
+	minPollInterval = 20 * time.Millisecond
+	maxPollInterval = 200 * time.Millisecond
+)
+
+// pacer keeps track of how fast the device writes data to flash and how long
+// the bootloader takes to reply, as moving averages over the notifications of
+// an update. With START_FLAG_OFFSETS, the time the link is idle after a packet
+// got lost depends on how soon the client asks for missing data: the pacer
+// sets that to a few times the reply time, instead of a fixed interval that
+// has to work for the slowest link.
+type pacer struct {
+	commitRate float64       // bytes per second, 0 until there are two credits
+	replyTime  time.Duration // 0 until the first reply to a poll
+	polls      int
+
+	lastCommitted int
+	lastCredit    time.Time
+	pollSent      time.Time // poll that hasn't been answered yet, see dataMissing
+}
+
+// credit records a STATUS_CREDIT, which the bootloader sends once a page has
+// been written.
+func (p *pacer) credit(committed int) {
+	p.pollSent = time.Time{} // see dataSent
+	now := time.Now()
+	if !p.lastCredit.IsZero() && committed > p.lastCommitted {
+		rate := float64(committed-p.lastCommitted) / now.Sub(p.lastCredit).Seconds()
+		if p.commitRate == 0 {
+			p.commitRate = rate
+		} else {
+			p.commitRate += (rate - p.commitRate) * pacerWeight
+		}
+	}
+	p.lastCommitted = committed
+	p.lastCredit = now
+}
+
+// poll records that the client asked for missing data.
+func (p *pacer) poll() {
+	p.polls++
+	p.pollSent = time.Now()
+}
+
+// dataSent records that the client sent data. The bootloader doesn't reply to a
+// poll when nothing is missing, so a STATUS_DATA_MISSING after more data (or a
+// credit) reports a new gap instead of answering the poll, and its time says
+// nothing about the reply time.
+func (p *pacer) dataSent() {
+	p.pollSent = time.Time{}
+}
+
+// dataMissing records a STATUS_DATA_MISSING. If it answers a poll, it tells how
+// long the bootloader takes to reply.
+func (p *pacer) dataMissing() {
+	if p.pollSent.IsZero() {
+		return
+	}
+	sample := time.Since(p.pollSent)
+	p.pollSent = time.Time{}
+	if p.replyTime == 0 {
+		p.replyTime = sample
+	} else {
+		p.replyTime += time.Duration(float64(sample-p.replyTime) * pacerWeight)
+	}
+}
+
+// pollTimeout returns how long to wait for a reply before polling for missing
+// data.
+func (p *pacer) pollTimeout() time.Duration {
+	if p.replyTime == 0 {
+		return maxPollInterval
+	}
+	timeout := 4 * p.replyTime
+	if timeout < minPollInterval {
+		timeout = minPollInterval
+	}
+	if timeout > maxPollInterval {
+		timeout = maxPollInterval
+	}
+	return timeout
+}
+
+// print prints the estimates, for diagnostics.
+func (p *pacer) print() {
+	if p.commitRate != 0 {
+		fmt.Printf("The device wrote %.1f kB/s to flash.\n", p.commitRate/1000)
+	}
+	if p.polls != 0 {
+		fmt.Printf("Polled %d times for missing data, replies took %.1fms (poll timeout %.1fms).\n", p.polls, p.replyTime.Seconds()*1000, p.pollTimeout().Seconds()*1000)
+	}
+}
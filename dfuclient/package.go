@@ -0,0 +1,212 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"crypto/ed25519"
+	"encoding/binary"
+	"errors"
+	"flag"
+	"fmt"
+	"hash/crc32"
+	"io"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"strings"
+)
+
+// A DFU package (.dfu) holds a firmware image together with everything that
+// is derived from it for an update, so that this is done once per release
+// instead of every time a device is updated:
+//
+//	header          packageHeader
+//	for each range:
+//	  range header  packageRange
+//	  page hashes   CRC-32 of each page, as in STATUS_PAGE_HASHES
+//	  signature     packageRange.SignatureLength bytes (see -key)
+//	  data          packageRange.Length bytes
+//	  compressed    packageRange.CompressedLength bytes (see -compress)
+//
+// All values are little endian. The ranges are the ones written with a
+// COMMAND_START each: page aligned and padded to a multiple of 4 bytes.
+const (
+	packageMagic  = "\x89DFU"
+	packageFormat = 1
+)
+
+// Chips that a package can be made for, with the size of their flash.
+var packageChips = map[string]struct {
+	id        uint32
+	flashSize uint64
+}{
+	"nrf52832": {52832, 512 * 1024},
+	"nrf52840": {52840, 1024 * 1024},
+}
+
+// The chip and firmware version of the package that was read, 0 for other
+// images. They are sent in a COMMAND_IMAGE_INFO before every COMMAND_START, and
+// the bootloader refuses an image for another chip before it erases anything.
+var (
+	imageChip    uint32
+	imageVersion uint32
+)
+
+type packageHeader struct {
+	Magic   [4]byte
+	Format  uint32
+	Chip    uint32 // 52832 or 52840
+	Version uint32 // version of the firmware, see -version
+	Ranges  uint32
+}
+
+type packageRange struct {
+	Addr             uint32
+	Length           uint32
+	CRC              uint32   // CRC-32 of the data, as in COMMAND_START
+	SHA256           [32]byte // of the start address, length and data (see signedMessage)
+	SignatureLength  uint32
+	CompressedLength uint32
+}
+
+// packCommand implements the pack command: it reads a firmware image in any
+// of the supported formats and writes it as a DFU package.
+func packCommand(args []string) {
+	flags := flag.NewFlagSet("pack", flag.ExitOnError)
+	// -key, -signature and -compress add to the package, -base-address is
+	// needed for a raw binary.
+	flag.VisitAll(func(f *flag.Flag) {
+		flags.Var(f.Value, f.Name, f.Usage)
+	})
+	output := flags.String("o", "", "package to write (default: the input file with the extension .dfu)")
+	chip := flags.String("chip", "nrf52840", "chip the image is for (nrf52832 or nrf52840)")
+	version := flags.Uint("version", 0, "version of the firmware, stored in the package")
+	flags.Usage = func() {
+		fmt.Printf("usage: %s pack [flags] <filename>\n", os.Args[0])
+		flags.PrintDefaults()
+		os.Exit(0)
+	}
+	flags.Parse(args)
+	if flags.NArg() != 1 {
+		flags.Usage()
+	}
+	chipInfo, ok := packageChips[strings.ToLower(*chip)]
+	if !ok {
+		handleError("could not create package", fmt.Errorf("unknown chip: %s", *chip))
+	}
+	if *output == "" {
+		*output = strings.TrimSuffix(flags.Arg(0), filepath.Ext(flags.Arg(0))) + ".dfu"
+	}
+
+	ranges, err := readImage(flags.Arg(0))
+	handleError("could not read input file", err)
+	last := ranges[len(ranges)-1]
+	if last.addr+uint64(len(last.data)) > chipInfo.flashSize {
+		handleError("could not create package", fmt.Errorf("the image ends at 0x%x, after the end of flash", last.addr+uint64(len(last.data))))
+	}
+	if *flagKey != "" {
+		signingKey, err = loadPrivateKey(*flagKey)
+		handleError("could not read private key", err)
+	}
+	if *flagSig != "" {
+		if len(ranges) != 1 {
+			handleError("could not read signature", errors.New("a signature of the whole image can't be used for an image with gaps, use -key instead"))
+		}
+		imageSignature, err = readHexFile(*flagSig, ed25519.SignatureSize)
+		handleError("could not read signature", err)
+	}
+
+	buf := &bytes.Buffer{}
+	header := packageHeader{
+		Format:  packageFormat,
+		Chip:    chipInfo.id,
+		Version: uint32(*version),
+		Ranges:  uint32(len(ranges)),
+	}
+	copy(header.Magic[:], packageMagic)
+	binary.Write(buf, binary.LittleEndian, &header)
+	for _, r := range ranges {
+		signature := rangeSignature(r.addr, r.data)
+		var compressed []byte
+		if *flagCompress {
+			compressed = compress(r.data)
+		}
+		rangeHeader := packageRange{
+			Addr:             uint32(r.addr),
+			Length:           uint32(len(r.data)),
+			CRC:              crc32.ChecksumIEEE(r.data),
+			SignatureLength:  uint32(len(signature)),
+			CompressedLength: uint32(len(compressed)),
+		}
+		copy(rangeHeader.SHA256[:], signedMessage(r.addr, r.data))
+		binary.Write(buf, binary.LittleEndian, &rangeHeader)
+		buf.Write(imagePageHashes(r.data))
+		buf.Write(signature)
+		buf.Write(r.data)
+		buf.Write(compressed)
+	}
+	err = ioutil.WriteFile(*output, buf.Bytes(), 0644)
+	handleError("could not write package", err)
+	fmt.Printf("Wrote %s: %d ranges, %d bytes", *output, len(ranges), imageSize(ranges))
+	if signingKey != nil || imageSignature != nil {
+		fmt.Printf(", signed")
+	}
+	if *flagCompress {
+		fmt.Printf(", compressed")
+	}
+	fmt.Println(".")
+}
+
+// extractPackage reads the ranges of a DFU package. What was derived from
+// them when the package was made is stored in the caches, so that it isn't
+// derived again for an update.
+func extractPackage(fp *os.File) ([]imageRange, error) {
+	r := bufio.NewReader(fp)
+	var header packageHeader
+	if err := binary.Read(r, binary.LittleEndian, &header); err != nil {
+		return nil, fmt.Errorf("invalid package header: %w", err)
+	}
+	if header.Format != packageFormat {
+		return nil, fmt.Errorf("unsupported package format %d", header.Format)
+	}
+	fmt.Printf("Package for the nRF%d, firmware version %d.\n", header.Chip, header.Version)
+	imageChip = header.Chip
+	imageVersion = header.Version
+
+	var ranges []imageRange
+	for i := 0; i < int(header.Ranges); i++ {
+		var rangeHeader packageRange
+		if err := binary.Read(r, binary.LittleEndian, &rangeHeader); err != nil {
+			return nil, fmt.Errorf("range %d: %w", i, err)
+		}
+		if rangeHeader.Addr%pageSize != 0 || rangeHeader.Length == 0 || rangeHeader.Length%4 != 0 || uint64(rangeHeader.Addr)+uint64(rangeHeader.Length) > 0xffffffff {
+			return nil, fmt.Errorf("range %d: invalid start address or length", i)
+		}
+		if (rangeHeader.SignatureLength != 0 && rangeHeader.SignatureLength != ed25519.SignatureSize) || rangeHeader.CompressedLength > 2*rangeHeader.Length {
+			return nil, fmt.Errorf("range %d: invalid signature or compressed length", i)
+		}
+		numPages := (int(rangeHeader.Length) + pageSize - 1) / pageSize
+		pageHashes := make([]byte, numPages*4)
+		signature := make([]byte, rangeHeader.SignatureLength)
+		data := make([]byte, rangeHeader.Length)
+		compressed := make([]byte, rangeHeader.CompressedLength)
+		for _, field := range [][]byte{pageHashes, signature, data, compressed} {
+			if _, err := io.ReadFull(r, field); err != nil {
+				return nil, fmt.Errorf("range %d: %w", i, err)
+			}
+		}
+		addr := uint64(rangeHeader.Addr)
+		if !bytes.Equal(signedMessage(addr, data), rangeHeader.SHA256[:]) {
+			return nil, fmt.Errorf("range %d: the data doesn't match its SHA-256, the package is damaged", i)
+		}
+		pageHashCache.put(addr, data, pageHashes)
+		if len(signature) != 0 {
+			signatureCache.put(addr, data, signature)
+		}
+		if len(compressed) != 0 {
+			compressCache.put(addr, data, compressed)
+		}
+		ranges = append(ranges, imageRange{addr, data})
+	}
+	return ranges, nil
+}
@@ -0,0 +1,113 @@
+package main
+
+import (
+	"fmt"
+	"sync"
+	"time"
+)
+
+// Number of data packets that may be in flight: queued for the transport or
+// being written by it.
+const sendWindow = 8
+
+// How often the progress line is updated.
+const progressInterval = 100 * time.Millisecond
+
+// sender writes data packets to the data characteristic from a separate
+// goroutine, so that handling notifications and preparing the next packet
+// overlaps with writing the previous one. At most sendWindow packets are in
+// flight: send blocks when the window is full, which passes backpressure from
+// the transport (for example a full queue in the BLE stack) on to the update.
+type sender struct {
+	transport transport
+	queue     chan []byte // packets to write
+	free      chan []byte // packet buffers that aren't in flight
+
+	mutex sync.Mutex
+	err   error // first error of the transport
+}
+
+// newSender starts a sender for packets of up to maxLen bytes. It must be
+// stopped with close.
+func newSender(t transport, maxLen int) *sender {
+	s := &sender{
+		transport: t,
+		queue:     make(chan []byte, sendWindow),
+		free:      make(chan []byte, sendWindow),
+	}
+	for i := 0; i < sendWindow; i++ {
+		s.free <- make([]byte, 0, maxLen)
+	}
+	go s.run()
+	return s
+}
+
+func (s *sender) run() {
+	for packet := range s.queue {
+		// After an error, the remaining packets are dropped.
+		if s.error() == nil {
+			err := s.transport.writeData(packet)
+			if err != nil {
+				s.mutex.Lock()
+				s.err = fmt.Errorf("failed to send data: %w: %s", errConnectionLost, err)
+				s.mutex.Unlock()
+			}
+		}
+		s.free <- packet[:0]
+	}
+}
+
+// error returns the error of the last packet that failed to be written, if
+// any.
+func (s *sender) error() error {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+	return s.err
+}
+
+// send queues a packet made of the given parts, waiting until there is room
+// in the window. It returns the error of an earlier packet, if one failed.
+func (s *sender) send(parts ...[]byte) error {
+	packet := <-s.free
+	if err := s.error(); err != nil {
+		s.free <- packet
+		return err
+	}
+	for _, part := range parts {
+		packet = append(packet, part...)
+	}
+	s.queue <- packet
+	return nil
+}
+
+// flush waits until every queued packet has been written.
+func (s *sender) flush() error {
+	var buffers [sendWindow][]byte
+	for i := range buffers {
+		buffers[i] = <-s.free
+	}
+	for _, buf := range buffers {
+		s.free <- buf
+	}
+	return s.error()
+}
+
+// close stops the sender. Packets that are still queued are written first.
+func (s *sender) close() {
+	close(s.queue)
+}
+
+// progress prints a progress line at most every progressInterval, as printing
+// it for every packet slows down fast links.
+type progress struct {
+	next time.Time
+}
+
+func (p *progress) print(format string, args ...interface{}) {
+	now := time.Now()
+	if now.Before(p.next) {
+		return
+	}
+	p.next = now.Add(progressInterval)
+	fmt.Printf(format, args...)
+}
@@ -0,0 +1,114 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"errors"
+	"io"
+	"os"
+)
+
+// Framing of the serial transport, see SERIAL_MAGIC in dfu.h.
+const (
+	serialMagic     = 0xd5
+	serialSync      = 0x7e
+	serialFrameSize = 4 + 244
+	serialSyncLen   = 2*serialFrameSize + 8
+
+	serialFrameCommand = 'c'
+	serialFrameData    = 'd'
+	serialFrameReply   = 'n'
+)
+
+// serialTransport talks to a bootloader built with TRANSPORT_SERIAL=1 over a
+// serial port, or to the simulator over a pseudo terminal (bootloader-server
+// -serial). Commands and data are sent as frames of serialFrameSize bytes, and
+// the replies come back as frames too. A connection is a session: it starts
+// with SERIAL_SYNC bytes, so that the bootloader finds the start of the first
+// frame. The bootloader treats this like a lost connection, so an update can
+// be resumed the same way as over BLE.
+type serialTransport struct {
+	path string
+	port *os.File
+}
+
+func (t *serialTransport) find() error {
+	if t.port != nil {
+		// Start over with a new session.
+		t.port.Close()
+		t.port = nil
+	}
+	return nil
+}
+
+func (t *serialTransport) connect(notify func([]byte)) error {
+	port, err := os.OpenFile(t.path, os.O_RDWR, 0)
+	if err != nil {
+		return err
+	}
+	err = configureSerialPort(port)
+	if err != nil {
+		port.Close()
+		return err
+	}
+	_, err = port.Write(bytes.Repeat([]byte{serialSync}, serialSyncLen))
+	if err != nil {
+		port.Close()
+		return err
+	}
+	t.port = port
+	go func() {
+		r := bufio.NewReader(port)
+		header := make([]byte, 4)
+		for {
+			// Skip anything before the start of the next frame.
+			b, err := r.ReadByte()
+			if err != nil {
+				return
+			}
+			if b != serialMagic {
+				continue
+			}
+			header[0] = b
+			_, err = io.ReadFull(r, header[1:])
+			if err != nil {
+				return
+			}
+			reply := make([]byte, binary.LittleEndian.Uint16(header[2:]))
+			_, err = io.ReadFull(r, reply)
+			if err != nil {
+				return
+			}
+			if header[1] == serialFrameReply && len(reply) != 0 {
+				notify(reply)
+			}
+		}
+	}()
+	return nil
+}
+
+// write sends a frame, padded to serialFrameSize bytes.
+func (t *serialTransport) write(frameType byte, buf []byte) error {
+	if t.port == nil {
+		return errors.New("Not connected")
+	}
+	if len(buf) > serialFrameSize-4 {
+		return errors.New("packet too large for a serial frame")
+	}
+	frame := make([]byte, serialFrameSize)
+	frame[0] = serialMagic
+	frame[1] = frameType
+	binary.LittleEndian.PutUint16(frame[2:], uint16(len(buf)))
+	copy(frame[4:], buf)
+	_, err := t.port.Write(frame)
+	return err
+}
+
+func (t *serialTransport) writeCommand(buf []byte) error {
+	return t.write(serialFrameCommand, buf)
+}
+
+func (t *serialTransport) writeData(buf []byte) error {
+	return t.write(serialFrameData, buf)
+}
@@ -0,0 +1,41 @@
+package main
+
+import (
+	"os"
+	"syscall"
+	"unsafe"
+)
+
+// Not in the syscall package.
+const (
+	termiosCBAUD   = 0x100f
+	termiosCRTSCTS = 0x80000000
+)
+
+// configureSerialPort sets the serial port to raw mode at 1Mbaud, with
+// hardware flow control, as used by the bootloader.
+func configureSerialPort(port *os.File) error {
+	var tio syscall.Termios
+	err := ioctl(port, syscall.TCGETS, unsafe.Pointer(&tio))
+	if err != nil {
+		return err
+	}
+	tio.Iflag &^= syscall.IGNBRK | syscall.BRKINT | syscall.PARMRK | syscall.ISTRIP | syscall.INLCR | syscall.IGNCR | syscall.ICRNL | syscall.IXON | syscall.IXOFF
+	tio.Oflag &^= syscall.OPOST
+	tio.Lflag &^= syscall.ECHO | syscall.ECHONL | syscall.ICANON | syscall.ISIG | syscall.IEXTEN
+	tio.Cflag &^= syscall.CSIZE | syscall.PARENB | syscall.CSTOPB | termiosCBAUD
+	tio.Cflag |= syscall.CS8 | syscall.CLOCAL | syscall.CREAD | termiosCRTSCTS | syscall.B1000000
+	tio.Ispeed = syscall.B1000000
+	tio.Ospeed = syscall.B1000000
+	tio.Cc[syscall.VMIN] = 1
+	tio.Cc[syscall.VTIME] = 0
+	return ioctl(port, syscall.TCSETS, unsafe.Pointer(&tio))
+}
+
+func ioctl(port *os.File, request uintptr, arg unsafe.Pointer) error {
+	_, _, errno := syscall.Syscall(syscall.SYS_IOCTL, port.Fd(), request, uintptr(arg))
+	if errno != 0 {
+		return errno
+	}
+	return nil
+}
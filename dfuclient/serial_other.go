@@ -0,0 +1,13 @@
+//go:build !linux
+// +build !linux
+
+package main
+
+import (
+	"errors"
+	"os"
+)
+
+func configureSerialPort(port *os.File) error {
+	return errors.New("serial ports are only supported on Linux")
+}
@@ -0,0 +1,101 @@
+package main
+
+import (
+	"bytes"
+	"crypto/ed25519"
+	"crypto/rand"
+	"crypto/sha256"
+	"encoding/binary"
+	"encoding/hex"
+	"fmt"
+	"io/ioutil"
+	"strings"
+)
+
+// Size of each part of the signature in a commandSignature.
+const signaturePartSize = 16
+
+// Key and signature for signed updates, set with the -key and -signature
+// flags.
+var (
+	signingKey     ed25519.PrivateKey
+	imageSignature []byte
+)
+
+// signedMessage returns the message that is signed for an update of the given
+// range: the SHA-256 of the start address and length, followed by the data.
+func signedMessage(startAddr uint64, data []byte) []byte {
+	h := sha256.New()
+	binary.Write(h, binary.LittleEndian, uint32(startAddr))
+	binary.Write(h, binary.LittleEndian, uint32(len(data)))
+	h.Write(data)
+	return h.Sum(nil)
+}
+
+// rangeSignature returns the signature for an update of the given range, or
+// nil if updates aren't signed. A signature given with -signature is only
+// valid for the whole image.
+func rangeSignature(startAddr uint64, data []byte) []byte {
+	if signingKey != nil {
+		return ed25519.Sign(signingKey, signedMessage(startAddr, data))
+	}
+	return imageSignature
+}
+
+// readHexFile reads a file with a single hex encoded value of the given size.
+func readHexFile(path string, size int) ([]byte, error) {
+	text, err := ioutil.ReadFile(path)
+	if err != nil {
+		return nil, err
+	}
+	value, err := hex.DecodeString(strings.TrimSpace(string(text)))
+	if err != nil {
+		return nil, fmt.Errorf("%s: %w", path, err)
+	}
+	if len(value) != size {
+		return nil, fmt.Errorf("%s: expected %d bytes, got %d", path, size, len(value))
+	}
+	return value, nil
+}
+
+// loadPrivateKey reads a private key written by generateKey.
+func loadPrivateKey(path string) (ed25519.PrivateKey, error) {
+	seed, err := readHexFile(path, ed25519.SeedSize)
+	if err != nil {
+		return nil, err
+	}
+	return ed25519.NewKeyFromSeed(seed), nil
+}
+
+// generateKey creates a new key pair. The private key is written to path and
+// the public key, which is needed to build the bootloader, to path + ".pub".
+func generateKey(path string) error {
+	public, private, err := ed25519.GenerateKey(rand.Reader)
+	if err != nil {
+		return err
+	}
+	err = ioutil.WriteFile(path, []byte(hex.EncodeToString(private.Seed())+"\n"), 0600)
+	if err != nil {
+		return err
+	}
+	err = ioutil.WriteFile(path+".pub", []byte(hex.EncodeToString(public)+"\n"), 0644)
+	if err != nil {
+		return err
+	}
+	fmt.Printf("Build the bootloader with PUBLIC_KEY=%x to only accept updates signed with %s.\n", []byte(public), path)
+	return nil
+}
+
+// sendSignature sends the signature of the next update to the bootloader.
+func (c *dfuConn) sendSignature(signature []byte) error {
+	for offset := 0; offset < len(signature); offset += signaturePartSize {
+		buf := &bytes.Buffer{}
+		buf.Write([]byte{commandSignature, byte(offset), 0, 0})
+		buf.Write(signature[offset : offset+signaturePartSize])
+		err := c.command(buf.Bytes())
+		if err != nil {
+			return err
+		}
+	}
+	return nil
+}
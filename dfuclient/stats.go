@@ -0,0 +1,99 @@
+package main
+
+import (
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"time"
+)
+
+// Frequency of the RTC that the bootloader uses to time flash operations.
+const rtcFrequency = 32768
+
+// flashLatency is the time a kind of flash operation took, in RTC ticks.
+type flashLatency struct {
+	Min   uint16
+	Max   uint16
+	Total uint32
+}
+
+// deviceStats are the performance counters of the bootloader, as in
+// dfu_stats_t.
+type deviceStats struct {
+	BytesReceived uint32
+	Packets       uint32
+	Intervals     uint32 // connection intervals with data packets
+	Erase         flashLatency
+	Write         flashLatency
+	MaxPackets    uint16 // most packets in one connection interval
+	PagesErased   uint16
+	PagesWritten  uint16
+	TooFast       uint16
+	Busy          uint16
+	ConnInterval  uint16 // in 1.25ms units
+	SlaveLatency  uint16
+	SupTimeout    uint16 // in 10ms units
+	ATTMTU        uint16
+	PHY           uint8
+	_             uint8
+}
+
+// readStats reads the performance counters of the bootloader. They may not
+// fit in a single notification, so they are read in parts.
+func (c *dfuConn) readStats() (*deviceStats, error) {
+	var stats deviceStats
+	buf := make([]byte, 0, binary.Size(stats))
+	for len(buf) < cap(buf) {
+		err := c.command([]byte{commandStats, byte(len(buf))})
+		if err != nil {
+			return nil, err
+		}
+
+		// Older bootloaders don't reply to this command.
+		var response []byte
+		select {
+		case response = <-c.responseChan:
+		case <-time.After(2 * time.Second):
+			return nil, fmt.Errorf("no reply, the bootloader may not support statistics")
+		}
+		if response[0] != statusStats {
+			return nil, fmt.Errorf("unexpected reply (code 0x%x)", response[0])
+		}
+		if len(response) < 4 || int(response[1]) != len(buf) || response[2] == 0 || len(response) < 4+int(response[2]) {
+			return nil, fmt.Errorf("invalid reply")
+		}
+		buf = append(buf, response[4:4+int(response[2])]...)
+	}
+	err := binary.Read(bytes.NewReader(buf), binary.LittleEndian, &stats)
+	if err != nil {
+		return nil, err
+	}
+	return &stats, nil
+}
+
+// print prints the statistics of the last update.
+func (s *deviceStats) print() {
+	fmt.Printf("Received %d bytes in %d packets", s.BytesReceived, s.Packets)
+	if s.Intervals != 0 {
+		fmt.Printf(", %.1f packets per connection interval (at most %d)", float64(s.Packets)/float64(s.Intervals), s.MaxPackets)
+	}
+	fmt.Println(".")
+	if s.PHY == 0 {
+		fmt.Printf("Connection: serial, frames of up to %d bytes.\n", s.ATTMTU-3)
+	} else {
+		fmt.Printf("Connection: %.2fms interval, latency %d, timeout %dms, ATT MTU %d, PHY %s.\n", float64(s.ConnInterval)*1.25, s.SlaveLatency, int(s.SupTimeout)*10, s.ATTMTU, phyName(s.PHY))
+	}
+	fmt.Printf("Flash: erased %d pages (%s), wrote %d pages (%s), %d busy, %d too fast.\n", s.PagesErased, s.Erase.format(s.PagesErased), s.PagesWritten, s.Write.format(s.PagesWritten), s.Busy, s.TooFast)
+}
+
+// format returns the minimum, average and maximum latency of the given number
+// of operations.
+func (l flashLatency) format(count uint16) string {
+	if count == 0 {
+		return "-"
+	}
+	ms := func(ticks float64) float64 {
+		return ticks * 1000 / rtcFrequency
+	}
+	return fmt.Sprintf("%.1f/%.1f/%.1fms min/avg/max", ms(float64(l.Min)), ms(float64(l.Total)/float64(count)), ms(float64(l.Max)))
+}
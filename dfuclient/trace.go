@@ -0,0 +1,143 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"debug/elf"
+	"encoding/binary"
+	"flag"
+	"fmt"
+	"io"
+	"os"
+)
+
+// Types of trace records, the same as TRACE_* in dfu.h.
+const (
+	traceMsg     = 0xa5 // LOG
+	traceNum     = 0xa6 // LOG_NUM
+	traceDropped = 0xa7 // records were lost, the argument is how many
+)
+
+// Size of a trace record (trace_record_t in uart.c).
+const traceRecordSize = 12
+
+// traceDecoder turns the trace records of a debug build of the bootloader
+// back into text. The records refer to the messages by their address in the
+// bootloader ELF file.
+type traceDecoder struct {
+	file     *elf.File
+	time     uint64 // RTC ticks since the start, unwrapped
+	lastTick uint32
+}
+
+// message returns the string at the given address in the ELF file, or false
+// if there is none.
+func (d *traceDecoder) message(addr uint32) (string, bool) {
+	for _, section := range d.file.Sections {
+		if section.Type != elf.SHT_PROGBITS || section.Flags&elf.SHF_ALLOC == 0 {
+			continue
+		}
+		if uint64(addr) < section.Addr || uint64(addr) >= section.Addr+section.Size {
+			continue
+		}
+		data, err := section.Data()
+		if err != nil {
+			return "", false
+		}
+		data = data[uint64(addr)-section.Addr:]
+		end := bytes.IndexByte(data, 0)
+		if end < 0 {
+			return "", false
+		}
+		return string(data[:end]), true
+	}
+	return "", false
+}
+
+// decode returns the text of a trace record, or false if it isn't a valid
+// record (for example because the stream started in the middle of one).
+func (d *traceDecoder) decode(record []byte) (string, bool) {
+	time := binary.LittleEndian.Uint32(record[0:])
+	msg := binary.LittleEndian.Uint32(record[4:])
+	arg := binary.LittleEndian.Uint32(record[8:])
+	var text string
+	switch time >> 24 {
+	case traceMsg, traceNum:
+		s, ok := d.message(msg)
+		if !ok {
+			return "", false
+		}
+		text = s
+		if time>>24 == traceNum {
+			text += fmt.Sprintf(" 0x%08x", arg)
+		}
+	case traceDropped:
+		if msg != 0 {
+			return "", false
+		}
+		text = fmt.Sprintf("(%d records dropped)", arg)
+	default:
+		return "", false
+	}
+
+	// The RTC counter has 24 bits, it wraps around every 512 seconds.
+	tick := time & 0xffffff
+	d.time += uint64((tick - d.lastTick) & 0xffffff)
+	d.lastTick = tick
+	return fmt.Sprintf("%10.3fms  %s", float64(d.time)*1000/rtcFrequency, text), true
+}
+
+// traceCommand implements the trace command: it decodes the trace output of a
+// debug build of the bootloader, read from a file, a serial port or stdin.
+func traceCommand(args []string) {
+	flags := flag.NewFlagSet("trace", flag.ExitOnError)
+	elfPath := flags.String("elf", "build/nrf52840/bootloader.elf", "bootloader ELF file that the device runs")
+	flags.Usage = func() {
+		fmt.Printf("usage: %s trace [flags] [<filename>]\n", os.Args[0])
+		fmt.Println("Reads from stdin without a filename. Set the baud rate of a serial port with stty first.")
+		flags.PrintDefaults()
+		os.Exit(0)
+	}
+	flags.Parse(args)
+	if flags.NArg() > 1 {
+		flags.Usage()
+	}
+	file, err := elf.Open(*elfPath)
+	handleError("could not open bootloader ELF file", err)
+	var input io.Reader = os.Stdin
+	if flags.NArg() == 1 {
+		f, err := os.Open(flags.Arg(0))
+		handleError("could not open input", err)
+		defer f.Close()
+		input = f
+	}
+
+	decoder := &traceDecoder{file: file}
+	r := bufio.NewReader(input)
+	record := make([]byte, 0, traceRecordSize)
+	skipped := 0
+	for {
+		b, err := r.ReadByte()
+		if err == io.EOF {
+			break
+		}
+		handleError("could not read trace", err)
+		record = append(record, b)
+		if len(record) < traceRecordSize {
+			continue
+		}
+		text, ok := decoder.decode(record)
+		if !ok {
+			// Out of sync, try again one byte further.
+			record = append(record[:0], record[1:]...)
+			skipped++
+			continue
+		}
+		if skipped != 0 {
+			fmt.Printf("(%d bytes skipped)\n", skipped)
+			skipped = 0
+		}
+		fmt.Println(text)
+		record = record[:0]
+	}
+}
@@ -0,0 +1,154 @@
+package main
+
+import (
+	"fmt"
+	"sync"
+	"time"
+
+	"github.com/tinygo-org/bluetooth"
+)
+
+// transport is the link to the DFU service of a device: its command
+// characteristic, with notifications for the replies, and its data
+// characteristic.
+type transport interface {
+	// find looks for the device, or for the same device again after the
+	// connection was lost.
+	find() error
+
+	// connect connects to the device that was found and passes every
+	// notification of the command characteristic to notify.
+	connect(notify func([]byte)) error
+
+	// writeCommand and writeData write to the command and data
+	// characteristics, without waiting for a response.
+	writeCommand(buf []byte) error
+	writeData(buf []byte) error
+}
+
+var adapter = bluetooth.DefaultAdapter
+
+// The adapter runs one scan at a time, also when updating a fleet.
+var scanMutex sync.Mutex
+
+// bleTransport talks to a device over BLE, using the default adapter.
+type bleTransport struct {
+	address     bluetooth.Addresser
+	direct      bool // connect without looking for the device first
+	commandChar bluetooth.DeviceCharacteristic
+	dataChar    bluetooth.DeviceCharacteristic
+}
+
+func (t *bleTransport) find() error {
+	if t.address != nil {
+		// The device is known. The bootloader advertises fast after a reset
+		// into DFU mode or a lost connection, so connecting to it right away
+		// usually works. Otherwise connect falls back to a scan.
+		t.direct = true
+		return nil
+	}
+	err := adapter.Enable()
+	if err != nil {
+		return fmt.Errorf("could not enable BLE adapter: %w", err)
+	}
+	fmt.Println("Looking for nearby device...")
+	return t.scan()
+}
+
+// scan looks for a device with the DFU service, or for the known device again.
+// A known device that went away isn't looked for forever, as other updates of
+// a fleet may be waiting for the adapter.
+func (t *bleTransport) scan() error {
+	scanMutex.Lock()
+	defer scanMutex.Unlock()
+	if t.address != nil {
+		timer := time.AfterFunc(responseTimeout, func() {
+			adapter.StopScan()
+		})
+		defer timer.Stop()
+	}
+	var foundDevice bluetooth.ScanResult
+	found := false
+	err := adapter.Scan(func(adapter *bluetooth.Adapter, result bluetooth.ScanResult) {
+		if t.address == nil && !result.AdvertisementPayload.HasServiceUUID(serviceUUID) {
+			return
+		}
+		if t.address != nil && result.Address != t.address {
+			return
+		}
+		foundDevice = result
+		found = true
+
+		// Stop the scan.
+		err := adapter.StopScan()
+		handleError("could not stop the scan", err)
+	})
+	if err != nil {
+		return fmt.Errorf("could not start a scan: %w", err)
+	}
+	if !found {
+		return fmt.Errorf("device %s not found", t.address)
+	}
+
+	// Print the device we've found.
+	if t.address == nil {
+		fmt.Printf("Connecting to %s...\n", deviceName(foundDevice))
+	}
+	t.address = foundDevice.Address
+	return nil
+}
+
+// deviceName returns the name and address of a device that was found.
+func deviceName(result bluetooth.ScanResult) string {
+	if name := result.LocalName(); name != "" {
+		return fmt.Sprintf("%s (%s)", name, result.Address)
+	}
+	return result.Address.String()
+}
+
+// connect connects to the device and looks up the DFU characteristics.
+func (t *bleTransport) connect(notify func([]byte)) error {
+	device, err := adapter.Connect(t.address, bluetooth.ConnectionParams{})
+	if err != nil && t.direct {
+		t.direct = false
+		err = t.scan()
+		if err != nil {
+			return err
+		}
+		device, err = adapter.Connect(t.address, bluetooth.ConnectionParams{})
+	}
+	t.direct = false
+	if err != nil {
+		return err
+	}
+
+	// Connected. Look up the DFU service.
+	fmt.Println("Looking up DFU service...")
+	services, err := device.DiscoverServices([]bluetooth.UUID{serviceUUID})
+	if err != nil {
+		return fmt.Errorf("failed to discover the DFU service: %w", err)
+	}
+	service := services[0]
+
+	// Get the two characteristics present in this service.
+	chars, err := service.DiscoverCharacteristics([]bluetooth.UUID{commandUUID, dataUUID})
+	if err != nil {
+		return fmt.Errorf("failed to discover characteristics: %w", err)
+	}
+	t.commandChar = chars[0]
+	t.dataChar = chars[1]
+
+	// Subscribe to status updates (command accepted, command rejected, command
+	// completed).
+	return t.commandChar.EnableNotifications(notify)
+}
+
+func (t *bleTransport) writeCommand(buf []byte) error {
+	_, err := t.commandChar.WriteWithoutResponse(buf)
+	return err
+}
+
+func (t *bleTransport) writeData(buf []byte) error {
+	_, err := t.dataChar.WriteWithoutResponse(buf)
+	return err
+}
@@ -0,0 +1,69 @@
+package main
+
+import (
+	"errors"
+	"net"
+)
+
+// Message types of the virtual link, the same as in sim/server.c.
+const (
+	virtualCommand = 'c' // write to the command characteristic
+	virtualData    = 'd' // write to the data characteristic
+	virtualNotify  = 'n' // notification of the command characteristic
+)
+
+// virtualTransport talks to the simulated bootloader of the host simulator
+// (build/sim/bootloader-server) over a Unix socket instead of BLE. Every
+// message on the socket is a single ATT operation: the message type followed
+// by the value. The server models the link, so writes are passed on at the
+// speed the configured connection allows.
+type virtualTransport struct {
+	path string
+	conn net.Conn
+}
+
+func (t *virtualTransport) find() error {
+	if t.conn != nil {
+		// Start over with a new connection.
+		t.conn.Close()
+		t.conn = nil
+	}
+	return nil
+}
+
+func (t *virtualTransport) connect(notify func([]byte)) error {
+	conn, err := net.Dial("unixpacket", t.path)
+	if err != nil {
+		return err
+	}
+	t.conn = conn
+	go func() {
+		buf := make([]byte, 512)
+		for {
+			n, err := conn.Read(buf)
+			if err != nil {
+				return
+			}
+			if n > 1 && buf[0] == virtualNotify {
+				notify(buf[1:n])
+			}
+		}
+	}()
+	return nil
+}
+
+func (t *virtualTransport) write(msgType byte, buf []byte) error {
+	if t.conn == nil {
+		return errors.New("Not connected")
+	}
+	_, err := t.conn.Write(append([]byte{msgType}, buf...))
+	return err
+}
+
+func (t *virtualTransport) writeCommand(buf []byte) error {
+	return t.write(virtualCommand, buf)
+}
+
+func (t *virtualTransport) writeData(buf []byte) error {
+	return t.write(virtualData, buf)
+}
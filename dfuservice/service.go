@@ -1,11 +1,14 @@
 // Package dfuservice implements the DFU service for the TinyGo bootloader. It
 // presents a stub service that allows resetting a device to enter DFU mode in
-// the bootloader.
+// the bootloader, or receiving an update in the background that the
+// bootloader installs at the next reset (see stage.go).
 package dfuservice
 
 import (
 	"device/arm"
 	"device/nrf"
+	"runtime/volatile"
+	"unsafe"
 
 	"github.com/tinygo-org/bluetooth"
 )
@@ -19,6 +22,55 @@ var (
 	dataUUID    = bluetooth.NewUUID([16]byte{0xcb, 0x15, 0x00, 0x03, 0x24, 0x04, 0x4e, 0x66, 0xab, 0x07, 0xa5, 0xf1, 0x05, 0x3f, 0x14, 0xce})
 )
 
+// The bootloader looks for the address of the client at this address in RAM
+// after a reset into DFU mode. See dfu_peer_t in dfu.h.
+const (
+	peerAddress = 0x20007ff0
+	peerMagic   = 0x50554644
+)
+
+// The command characteristic, which sends the replies as notifications.
+var commandChar bluetooth.Characteristic
+
+// MTU is the ATT MTU of the connection with the client. The data packets of a
+// staged update are up to MTU-3 bytes long. The default is the smallest ATT
+// MTU, set it if the bluetooth stack negotiates a larger one.
+var MTU = 23
+
+// setPeer passes the address of the client to the bootloader, which then
+// advertises directly to it. The address is little endian.
+func setPeer(addrType byte, addr []byte) {
+	peer := (*[3]volatile.Register32)(unsafe.Pointer(uintptr(peerAddress)))
+	peer[1].Set(uint32(addrType) | uint32(addr[0])<<8 | uint32(addr[1])<<16 | uint32(addr[2])<<24)
+	peer[2].Set(uint32(addr[3]) | uint32(addr[4])<<8 | uint32(addr[5])<<16)
+	peer[0].Set(peerMagic)
+}
+
+// resetBootloader handles a commandResetBootloader: it resets into the
+// bootloader.
+func resetBootloader(value []byte) {
+	// Disable the SoftDevice before reset, otherwise GPREGRET is not available.
+	// The SVCall number 0x11 means SD_SOFTDEVICE_DISABLE in all SoftDevice
+	// versions I checked (s110v8, s132v6, s140v7), so is likely to remain
+	// constant.
+	arm.SVCall0(0x11) // SD_SOFTDEVICE_DISABLE
+
+	// The client may have sent its address type and address along. This
+	// overwrites application RAM, so it must happen just before the reset.
+	if len(value) == 8 {
+		setPeer(value[1], value[2:])
+	}
+
+	// Set the low bit of GPREGRET, so that the bootloader will enter DFU mode
+	// instead of starting the application as usual.
+	nrf.POWER.GPREGRET.Set(1)
+
+	// Reset the system.
+	arm.SystemReset()
+
+	// This should be unreachable.
+}
+
 // AddService adds the stub DFU service to the list of services. To make use of
 // this service, it also needs to be advertised in the BLE advertisement packet.
 // See the blink example for how you can do that, it only takes a few lines of
@@ -28,38 +80,28 @@ func AddService(adapter *bluetooth.Adapter) error {
 		UUID: ServiceUUID,
 		Characteristics: []bluetooth.CharacteristicConfig{
 			{
-				UUID:  commandUUID,
-				Flags: bluetooth.CharacteristicWritePermission | bluetooth.CharacteristicNotifyPermission,
+				Handle: &commandChar,
+				UUID:   commandUUID,
+				Flags:  bluetooth.CharacteristicWritePermission | bluetooth.CharacteristicNotifyPermission,
 				WriteEvent: func(client bluetooth.Connection, offset int, value []byte) {
-					if offset == 0 && len(value) == 1 && value[0] == 0 {
-						// This is a commandResetBootloader, so enter the the
-						// bootloader.
-
-						// Disable the SoftDevice before reset, otherwise GPREGRET is not available.
-						// The SVCall number 0x11 means SD_SOFTDEVICE_DISABLE in all SoftDevice
-						// versions I checked (s110v8, s132v6, s140v7), so is likely to remain
-						// constant.
-						arm.SVCall0(0x11) // SD_SOFTDEVICE_DISABLE
-
-						// Set the low bit of GPREGRET, so that the bootloader will enter DFU mode
-						// instead of starting the application as usual.
-						nrf.POWER.GPREGRET.Set(1)
-
-						// Reset the system.
-						arm.SystemReset()
-
-						// This should be unreachable.
+					if offset == 0 && len(value) != 0 {
+						handleCommand(value)
 					}
 				},
 			},
 			{
-				// The data characteristic. It is included here to work around
-				// caching issues in BlueZ. BlueZ doesn't always clear the
-				// discovered service cache, even after removing the device. I
-				// had to rm -rf /var/lib/bluetooth/ to get it to work again.
-				// Therefore, include it here to work around that.
+				// The data characteristic, for updates that are staged
+				// (see stage.go). Older versions only included it to work
+				// around caching issues in BlueZ, which doesn't always clear
+				// the discovered service cache, even after removing the
+				// device.
 				UUID:  dataUUID,
 				Flags: bluetooth.CharacteristicWriteWithoutResponsePermission,
+				WriteEvent: func(client bluetooth.Connection, offset int, value []byte) {
+					if offset == 0 {
+						stage.receive(value)
+					}
+				},
 			},
 		},
 	})
@@ -0,0 +1,330 @@
+package dfuservice
+
+import (
+	"device/arm"
+	"device/nrf"
+	"encoding/binary"
+	"hash/crc32"
+	"runtime/volatile"
+	"time"
+	"unsafe"
+)
+
+// Protocol constants, see dfu.h.
+const (
+	commandResetBootloader = 0x00
+	commandReset           = 0x01
+	commandStart           = 0x02
+	commandSignature       = 0x04
+	commandImageInfo       = 0x06
+
+	startFlagStage = 0x40
+
+	statusEraseStarted       = 0x02
+	statusEraseFinished      = 0x03
+	statusWriteFinished      = 0x04
+	statusCredit             = 0x06
+	statusBusy               = 0x10
+	statusInvalidEraseStart  = 0x20
+	statusInvalidEraseLength = 0x21
+	statusInvalidChip        = 0x22
+	statusEraseFailed        = 0x30
+	statusWriteFailed        = 0x31
+	statusCRCMismatch        = 0x33
+)
+
+const (
+	pageSize    = 4096
+	stagedMagic = 0x47545344 // DFU_STAGED_MAGIC
+
+	// The SoftDevice information structure holds the start of the
+	// application at this address.
+	appCodeBaseAddress = 0x3008
+
+	// The stager buffers this many pages: one that is being written while
+	// the next one is received.
+	stageBufferPages = 2
+
+	// Give up if the client doesn't send anything for this long.
+	stageTimeout = 30 * time.Second
+)
+
+// SVCall numbers, errors and SoC events of the SoftDevice, the same in s132v6
+// and s140v7.
+const (
+	svcFlashPageErase = 0x28 // SD_FLASH_PAGE_ERASE
+	svcFlashWrite     = 0x29 // SD_FLASH_WRITE
+	svcEvtGet         = 0x4b // SD_EVT_GET
+	errorBusy         = 0x11 // NRF_ERROR_BUSY
+
+	evtFlashOperationSuccess = 2 // NRF_EVT_FLASH_OPERATION_SUCCESS
+	evtFlashOperationError   = 3 // NRF_EVT_FLASH_OPERATION_ERROR
+)
+
+// The end of the running application in flash, from the TinyGo linker script:
+// .data is stored right after the code.
+//
+//go:extern _sidata
+var _sidata [0]byte
+
+//go:extern _sdata
+var _sdata [0]byte
+
+//go:extern _edata
+var _edata [0]byte
+
+// stager receives an update while the application keeps running
+// (START_FLAG_STAGE). It stores the image in the upper half of the application
+// area, the staging bank, and then describes it with a dfu_staged_t in the page
+// below the bootloader. The bootloader installs it at the next reset. The
+// running application must fit in the lower half.
+// The command and data characteristics only copy what they receive, the flash
+// is written by a goroutine.
+type stager struct {
+	running  volatile.Register8
+	start    uint32 // COMMAND_START parameters
+	length   uint32
+	crc      uint32
+	chip     uint32                            // from COMMAND_IMAGE_INFO, for the next COMMAND_START
+	bank     uint32                            // where the image is stored
+	received volatile.Register32               // bytes received
+	written  uint32                            // bytes written to the staging bank
+	buf      [stageBufferPages * pageSize]byte // ring buffer, indexed by offset
+	record   [21]uint32                        // dfu_staged_t, source of the flash writes
+}
+
+var stage stager
+
+// stagingBank returns the start and end of the staging bank.
+func stagingBank() (bank, end uint32) {
+	appStart := (*volatile.Register32)(unsafe.Pointer(uintptr(appCodeBaseAddress))).Get()
+	end = nrf.UICR.NRFFW[0].Get() - pageSize // progress record page
+	bank = appStart + (end-appStart)/2/pageSize*pageSize
+	return bank, end
+}
+
+// handleCommand handles a write to the command characteristic.
+func handleCommand(value []byte) {
+	switch value[0] {
+	case commandResetBootloader:
+		if len(value) == 1 || len(value) == 8 {
+			resetBootloader(value)
+		}
+	case commandReset:
+		// Start the new application, which the bootloader installs first if
+		// it was staged.
+		arm.SVCall0(0x11) // SD_SOFTDEVICE_DISABLE
+		arm.SystemReset()
+	case commandStart:
+		if len(value) >= 16 && value[1]&startFlagStage != 0 {
+			stage.begin(value)
+		}
+	case commandSignature:
+		if len(value) >= 20 && value[1] <= 48 && value[1]%16 == 0 {
+			// The signature follows the first five words of the record.
+			signature := (*[64]byte)(unsafe.Pointer(&stage.record[5]))
+			copy(signature[value[1]:value[1]+16], value[4:20])
+		}
+	case commandImageInfo:
+		if len(value) >= 12 {
+			stage.chip = binary.LittleEndian.Uint32(value[4:])
+		}
+	}
+}
+
+// begin handles a COMMAND_START with START_FLAG_STAGE.
+func (s *stager) begin(value []byte) {
+	chip := s.chip
+	s.chip = 0 // only for this update
+	if s.running.Get() != 0 {
+		notify(statusBusy)
+		return
+	}
+	start := binary.LittleEndian.Uint32(value[4:])
+	length := binary.LittleEndian.Uint32(value[8:])
+	bank, end := stagingBank()
+	appStart := (*volatile.Register32)(unsafe.Pointer(uintptr(appCodeBaseAddress))).Get()
+	if start < appStart || start%pageSize != 0 || start >= bank || appEnd() > bank {
+		// The running application must not reach into the staging bank,
+		// which is erased below.
+		notify(statusInvalidEraseStart)
+		return
+	}
+	if length == 0 || length%4 != 0 || length > bank-start || length > end-bank {
+		notify(statusInvalidEraseLength)
+		return
+	}
+	if chip != 0 && chip != chipNumber() {
+		notify(statusInvalidChip)
+		return
+	}
+	s.start = start
+	s.length = length
+	s.crc = binary.LittleEndian.Uint32(value[12:])
+	s.bank = bank
+	s.received.Set(0)
+	s.written = 0
+	s.running.Set(1)
+
+	// Only the staging flag is supported. The PHY isn't known to the
+	// application.
+	maxDataLen := MTU - 3
+	reply := []byte{statusEraseStarted, 0, byte(maxDataLen), byte(maxDataLen >> 8), startFlagStage, 0, 0, 0, 0, 0, 0, 0}
+	commandChar.Write(reply)
+	go s.run()
+}
+
+// receive handles a write to the data characteristic. The client doesn't send
+// more than fits in the buffer, see statusCredit. A packet that crosses the end
+// of the buffer continues at its start.
+func (s *stager) receive(value []byte) {
+	received := s.received.Get()
+	if s.running.Get() == 0 || received-s.written+uint32(len(value)) > uint32(len(s.buf)) || received+uint32(len(value)) > s.length {
+		return
+	}
+	n := copy(s.buf[received%uint32(len(s.buf)):], value)
+	copy(s.buf[:], value[n:])
+	s.received.Set(received + uint32(len(value)))
+}
+
+// run erases the staging bank, writes the data to it as it comes in and then
+// writes the record for the bootloader.
+func (s *stager) run() {
+	defer s.running.Set(0)
+	pages := (s.length + pageSize - 1) / pageSize
+	for i := uint32(0); i < pages; i++ {
+		if !erasePage(s.bank + i*pageSize) {
+			notify(statusEraseFailed)
+			return
+		}
+	}
+	commandChar.Write([]byte{statusEraseFinished, 0, byte(pages), byte(pages >> 8), 0, 0, stageBufferPages, 0})
+
+	lastData := time.Now()
+	for s.written < s.length {
+		n := s.length - s.written
+		if n > pageSize {
+			n = pageSize
+		}
+		if s.received.Get() < s.written+n {
+			if time.Since(lastData) > stageTimeout {
+				return
+			}
+			time.Sleep(time.Millisecond)
+			continue
+		}
+		lastData = time.Now()
+		offset := s.written % uint32(len(s.buf))
+		if !writeFlash(s.bank+s.written, s.buf[offset:offset+n]) {
+			notify(statusWriteFailed)
+			return
+		}
+		s.written += n
+		reply := make([]byte, 12)
+		reply[0] = statusCredit
+		binary.LittleEndian.PutUint32(reply[4:], s.written)
+		binary.LittleEndian.PutUint32(reply[8:], uint32(len(s.buf)))
+		commandChar.Write(reply)
+	}
+
+	staged := (*[1 << 20]byte)(unsafe.Pointer(uintptr(s.bank)))[:s.length:s.length]
+	if crc32.ChecksumIEEE(staged) != s.crc {
+		notify(statusCRCMismatch)
+		return
+	}
+
+	// Replace the progress record with the staged record. The magic is
+	// written last, so the bootloader ignores a record that is incomplete.
+	_, end := stagingBank()
+	s.record[0] = s.start
+	s.record[1] = s.length
+	s.record[2] = s.crc
+	s.record[3] = stagedMagic
+	s.record[4] = s.bank
+	record := (*[len(s.record) * 4]byte)(unsafe.Pointer(&s.record[0]))
+	if !erasePage(end) || !writeFlash(end, record[:12]) || !writeFlash(end+16, record[16:]) || !writeFlash(end+12, record[12:16]) {
+		notify(statusWriteFailed)
+		return
+	}
+	commandChar.Write([]byte{statusWriteFinished, 0, 0, 0, 0, 0, 0, 0})
+
+	// Forget the signature for the next update.
+	for i := 5; i < len(s.record); i++ {
+		s.record[i] = 0
+	}
+}
+
+// flashOp starts a flash operation of the SoftDevice and waits for its result,
+// the NRF_EVT_FLASH_OPERATION_SUCCESS or NRF_EVT_FLASH_OPERATION_ERROR SoC
+// event. The bluetooth package reads and drops SoC events in the SoftDevice
+// event interrupt, so that interrupt is disabled until the result has been read
+// here. The SoftDevice keeps BLE events queued in the mean time, they are
+// handled when the interrupt is enabled again.
+func flashOp(start func() uintptr) bool {
+	arm.DisableIRQ(nrf.IRQ_SWI2_EGU2)
+	defer arm.EnableIRQ(nrf.IRQ_SWI2_EGU2)
+
+	deadline := time.Now().Add(time.Second)
+	for {
+		err := start()
+		if err == 0 {
+			break
+		}
+		if err != errorBusy || time.Now().After(deadline) {
+			return false
+		}
+		time.Sleep(time.Millisecond)
+	}
+	for {
+		var evt uint32
+		if arm.SVCall1(svcEvtGet, unsafe.Pointer(&evt)) == 0 {
+			switch evt {
+			case evtFlashOperationSuccess:
+				return true
+			case evtFlashOperationError:
+				return false
+			}
+			continue // another SoC event, which the application doesn't use
+		}
+		if time.Now().After(deadline) {
+			return false
+		}
+		time.Sleep(time.Millisecond)
+	}
+}
+
+// erasePage erases the flash page at the given address.
+func erasePage(addr uint32) bool {
+	return flashOp(func() uintptr {
+		return arm.SVCall1(svcFlashPageErase, addr/pageSize)
+	})
+}
+
+// writeFlash writes data (a multiple of 4 bytes) to erased flash at the given
+// address.
+func writeFlash(addr uint32, data []byte) bool {
+	return flashOp(func() uintptr {
+		return arm.SVCall3(svcFlashWrite, addr, unsafe.Pointer(&data[0]), uint32(len(data)/4))
+	})
+}
+
+// chipNumber returns the number of the chip, as in COMMAND_START (52832 or
+// 52840). FICR.INFO.PART holds it as hexadecimal digits.
+func chipNumber() uint32 {
+	part := nrf.FICR.INFO.PART.Get()
+	number := uint32(0)
+	for shift := 28; shift >= 0; shift -= 4 {
+		number = number*10 + (part>>uint(shift))&0xf
+	}
+	return number
+}
+
+// appEnd returns the end of the running application in flash.
+func appEnd() uint32 {
+	return uint32(uintptr(unsafe.Pointer(&_sidata)) + uintptr(unsafe.Pointer(&_edata)) - uintptr(unsafe.Pointer(&_sdata)))
+}
+
+// notify sends a status without payload.
+func notify(status byte) {
+	commandChar.Write([]byte{status})
+}
@@ -1,8 +1,9 @@
 
-// This file is the main DFU. It calls into ble.c for BLE related
-// functionality, and ble.c calls back to functions defined here when it
-// receives BLE events.
+// This file is the main DFU. The transports (ble.c and serial.c) call back to
+// functions defined here when they receive something from a client, and the
+// replies go back through the transport the client used (see transport_t).
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,6 +15,7 @@
 #include "dfu.h"
 
 extern const uint32_t _stext[];
+extern const uint32_t _sprogress[];
 
 __attribute__((section(".bootloaderaddr"),used))
 const uint32_t *bootloaderaddr = _stext;
@@ -22,32 +24,174 @@ const uint32_t *bootloaderaddr = _stext;
 #define PAGE_SIZE        (4096)
 #define MBR_VECTOR_TABLE (0x20000000)
 
+// Received data is stored in a ring buffer of FLASH_BUF_PAGES pages (set in
+// the Makefile). The client may only fill pages that have been written to
+// flash, see STATUS_CREDIT.
+#define FLASH_BUF_SIZE   (PAGE_SIZE * FLASH_BUF_PAGES)
+#if FLASH_BUF_PAGES < 2
+#error FLASH_BUF_PAGES must be at least 2
+#endif
+
 // Read SoftDevice size from the SoftDevice information structure
 // https://infocenter.nordicsemi.com/index.jsp?topic=%2Fsds_s132%2FSDS%2Fs1xx%2Fsd_info_structure%2Fsd_info_structure.html
-#define APP_CODE_BASE (*(uint32_t*)(0x3008))
+#define APP_CODE_BASE (*(uint32_t*)FLASH_PTR(0x3008))
 
 // A number of reset reasons that might indicate something went wrong and the
 // chip should enter DFU mode.
 #define DFU_RESET_REASONS (POWER_RESETREAS_RESETPIN_Msk | POWER_RESETREAS_DOG_Msk | POWER_RESETREAS_LOCKUP_Msk)
 
+// Progress of the last update, stored in the page below the bootloader
+// (_sprogress). The header is written at the start of an update, and each
+// page is marked as committed once it has been written, without erasing the
+// page in between. This allows an interrupted update to be resumed.
+// Once the CRC-32 of the written data has been checked, the update is marked
+// as valid so that the image doesn't need to be checked at every boot.
+typedef struct {
+    uint32_t start;       // COMMAND_START parameters
+    uint32_t length;
+    uint32_t image_crc;
+    uint32_t magic;       // PROGRESS_MAGIC, written after the parameters
+    uint32_t valid;       // PROGRESS_MORE if more ranges follow, else 0 once the update has been finished and checked
+    uint32_t committed[]; // one word per page: 0 once the page has been written
+} progress_t;
+#define PROGRESS_HEADER_WORDS (5) // start..valid
+#define PROGRESS       ((const progress_t*)FLASH_PTR((uint32_t)_sprogress))
+#define PROGRESS_MAGIC (0x44465550) // "PUFD"
+#define PROGRESS_MORE  (0x45524f4d) // "MORE", see START_FLAG_MORE
+
+// The RTC counter has 24 bits.
+#define RTC_COUNTER_MASK (0xffffff)
+
 static volatile char phase = PHASE_READY;
 
+// Transport of the client that sent the last command. Replies go there.
+static transport_t *transport;
+
+// Flash operation that is currently in progress, if any. Only one flash
+// operation can be in progress at a time.
+enum {
+    FLASH_OP_NONE,
+    FLASH_OP_ERASE,
+    FLASH_OP_WRITE,
+    FLASH_OP_PROGRESS, // erasing or writing the progress record header
+    FLASH_OP_COMMIT,   // marking a page as committed in the progress record
+    FLASH_OP_CHUNK,    // writing a chunk of a broadcast update
+    FLASH_OP_BUSY,     // the SoftDevice was busy, retry later
+};
+static volatile char flash_op = FLASH_OP_NONE;
+
 // Globals for erase phase.
-static volatile uint32_t flash_erase_current_page;
+static volatile uint32_t flash_erase_current_page; // page that will be erased or is currently being erased
 static volatile uint32_t flash_erase_last_page;
+static          uint16_t flash_erase_erased;  // pages erased
+static          uint16_t flash_erase_skipped; // pages skipped as they were already erased
+static          uint8_t  flash_streaming;     // START_FLAG_STREAM was set
+static          uint8_t  flash_compressed;    // START_FLAG_COMPRESSED was set
+static          uint8_t  flash_offsets;       // START_FLAG_OFFSETS was set
 
 // Globals for write phase.
-static          uint8_t  flash_write_buf[PAGE_SIZE * 2];
+static          uint8_t  flash_write_buf[FLASH_BUF_SIZE] __attribute__((aligned(4)));
+static          uint32_t flash_write_start;    // must be aligned to PAGE_SIZE
+static          uint32_t flash_write_crc;      // CRC-32 of the pages written so far
+static          uint8_t  flash_check_crc;      // the client sent the CRC-32 of the image
 static          uint32_t flash_write_app_size; // must be aligned to 4
 static          uint32_t flash_write_index;
 static volatile uint32_t flash_write_current_page; // page that will be written or is currently being written
+static          uint32_t flash_data_cycles;        // CPU cycles spent in handle_data
+static          uint32_t flash_hash_cycles;        // CPU cycles spent hashing written data
+static          uint32_t flash_verify_cycles;      // CPU cycles spent checking the signature
+static          uint8_t  flash_credit_pending;     // STATUS_CREDIT couldn't be sent, retry when possible
+static          uint8_t  flash_commit_pending;     // the current write page must be marked as committed
+static          uint32_t image_chip;               // from COMMAND_IMAGE_INFO, for the next COMMAND_START
+
+#if SIGNED_UPDATES
+// Signed updates (see START_FLAG_SIGNED). The SHA-256 is calculated while
+// pages are written, so that only the signature needs to be checked once the
+// last page has been written.
+static const    uint8_t  public_key[32] = PUBLIC_KEY;
+static          uint8_t  signature[64];
+static          uint8_t  signature_parts;          // bitmap of the parts of signature that were received
+static          sha256_t flash_write_sha;          // SHA-256 of the update so far
+#endif
+
+// Blocks in the page buffer that have been received (see START_FLAG_OFFSETS).
+// Data is only written to flash up to the first missing block, which is at
+// flash_write_index.
+static          uint32_t flash_received[FLASH_BUF_SIZE / DATA_BLOCK_SIZE / 32];
+static          uint32_t flash_missing_sent; // offset of the last STATUS_DATA_MISSING
 
-static void resume_flash_erase(void);
+#if BROADCAST
+// Broadcast updates (see BROADCAST_CHUNK_SIZE). Once all pages of the image
+// have been erased, chunks are written to flash in the order they arrive.
+// Until then, and while the previous chunk is being written, they wait in the
+// page buffer. Chunks that don't fit are dropped: the sender sends them again
+// in the next round.
+#define BROADCAST_MAX_CHUNKS ((1024 * 1024) / BROADCAST_CHUNK_SIZE + 1) // enough for all of flash
+#define BROADCAST_QUEUE      (FLASH_BUF_SIZE / BROADCAST_CHUNK_SIZE)
+static          uint32_t broadcast_received[(BROADCAST_MAX_CHUNKS + 31) / 32]; // chunks that were written or queued
+static          uint32_t broadcast_missing;    // chunks that haven't been received yet
+static          uint32_t broadcast_queue_offset[BROADCAST_QUEUE];
+static          uint32_t broadcast_queue_head; // number of chunks queued
+static          uint32_t broadcast_queue_tail; // number of chunks written
+static          uint8_t  broadcast_started;    // only one broadcast is received per boot
+#endif
+
+// Globals for the progress record.
+enum {
+    PROGRESS_ERASE, // the old record must be erased
+    PROGRESS_WRITE, // the header must be written
+    PROGRESS_DONE,  // ready to commit pages
+    PROGRESS_VALID, // all pages have been checked, the record must be marked as valid
+    PROGRESS_FINISHED,
+};
+static          uint8_t    flash_progress_step;
+static          progress_t flash_progress_header; // source of the header write
+static          uint32_t   flash_progress_zero;   // source of commit writes
+
+// Performance counters (see COMMAND_STATS). Flash operations and connection
+// intervals are timed with RTC1, which runs from the low frequency clock that
+// the SoftDevice keeps running.
+dfu_stats_t dfu_stats;
+static          uint32_t stats_op_start;         // RTC counter when the current flash operation started
+static          uint32_t stats_interval_start;   // RTC counter at the first packet in this connection interval
+static          uint16_t stats_interval_packets; // packets received in this connection interval
+
+// Decompressor state (see START_FLAG_COMPRESSED).
+static          uint16_t lz_flags;    // remaining flag bits of a group, above a marker bit
+static          uint8_t  lz_match;    // first byte of a match
+static          uint8_t  lz_in_match; // the first byte of a match has been received
+
+static void resume_flash(void);
+static void flash_erase_page_done(void);
+static void erase_current_page(void);
 static void write_current_page(void);
+static void flash_op_started(char op, uint32_t err_code);
+static uint32_t progress_committed_pages(uint32_t start, uint32_t length, uint32_t image_crc);
+static int      app_image_valid(void);
+static uint32_t write_page_length(uint32_t page);
+static void     flash_hash_written(const uint8_t *data, uint32_t len);
+#if SIGNED_UPDATES
+static int      flash_signature_valid(void);
+#endif
+static void send_page_hashes(uint32_t start, uint32_t count);
+static void receive_byte(uint8_t b);
+static void decompress_byte(uint8_t b);
+static void receive_packet(uint16_t data_len, uint8_t *data);
+static void send_data_missing(void);
+static int  flash_block_received(uint32_t offset);
+static void send_credit(void);
+static void send_stats(uint32_t offset);
+static void stats_flash_op_done(dfu_latency_t *latency);
+static void send_reply(uint8_t code);
+#if BROADCAST
+static void broadcast_start(transport_t *t, const broadcast_chunk_t *chunk);
+static int  broadcast_write_chunk(void);
+#endif
 
 #if DEBUG
 void softdevice_assert_handler(uint32_t id, uint32_t pc, uint32_t info) {
     LOG("ERROR: SoftDevice assert!!!");
+    LOG_FLUSH();
     while (1);
 }
 #else // no debug
@@ -55,6 +199,7 @@ void Default_Handler(void);
 #define softdevice_assert_handler ((nrf_fault_handler_t)Default_Handler)
 #endif
 
+#if !SIMULATOR
 // Start running the application, by jumping to the SoftDevice. This function
 // does not return.
 static void jump_to_app() {
@@ -82,6 +227,90 @@ static void jump_to_app() {
     __builtin_unreachable();
 }
 
+// nvmc_erase_page and nvmc_write change the flash directly instead of through
+// the SoftDevice, which is only possible while the SoftDevice is disabled.
+static void nvmc_erase_page(uint32_t addr) {
+    NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Een;
+    NRF_NVMC->ERASEPAGE = addr;
+    while (NRF_NVMC->READY == NVMC_READY_READY_Busy) {}
+    NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Ren;
+}
+
+static void nvmc_write(uint32_t addr, const uint32_t *src, uint32_t words) {
+    NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Wen;
+    for (uint32_t i = 0; i < words; i++) {
+        ((volatile uint32_t*)addr)[i] = src[i];
+        while (NRF_NVMC->READY == NVMC_READY_READY_Busy) {}
+    }
+    NRF_NVMC->CONFIG = NVMC_CONFIG_WEN_Ren;
+}
+
+// install_staged_image copies an image that the application received in the
+// background (see dfu_staged_t) to where it belongs. It runs at reset, before
+// the SoftDevice is enabled. If the copy is interrupted, the staged image is
+// still there and the copy starts over at the next reset. Once it is done,
+// the staged record is replaced by a progress record for the new image, like
+// after an update over BLE.
+static void install_staged_image(void) {
+    const dfu_staged_t *staged = (const dfu_staged_t*)_sprogress;
+    if (staged->magic != DFU_STAGED_MAGIC) {
+        return;
+    }
+
+    // The staged copy must be above the image, and below the progress record.
+    uint32_t start = staged->start;
+    uint32_t source = staged->source;
+    uint32_t length = staged->length;
+    int valid = start >= APP_CODE_BASE && start % PAGE_SIZE == 0 && start < source &&
+            source % PAGE_SIZE == 0 && source < (uint32_t)_sprogress &&
+            length != 0 && length % 4 == 0 && length < (uint32_t)_sprogress &&
+            start + length <= source && source + length <= (uint32_t)_sprogress;
+    if (valid) {
+        valid = crc32_update(0, (const uint8_t*)source, length) == staged->image_crc;
+    }
+#if SIGNED_UPDATES
+    if (valid) {
+        sha256_t sha;
+        uint8_t hash[32];
+        sha256_init(&sha);
+        sha256_update(&sha, (const uint8_t*)&staged->start, 8); // start address and length
+        sha256_update(&sha, (const uint8_t*)source, length);
+        sha256_final(&sha, hash);
+        valid = ed25519_verify(staged->signature, hash, sizeof(hash), public_key);
+    }
+#endif
+
+    progress_t header = {
+        .start     = start,
+        .length    = length,
+        .image_crc = staged->image_crc,
+        .magic     = PROGRESS_MAGIC,
+        .valid     = 0,
+    };
+    if (valid) {
+        LOG("installing staged image");
+        for (uint32_t offset = 0; offset < length; offset += PAGE_SIZE) {
+            uint32_t words = (length - offset < PAGE_SIZE ? length - offset : PAGE_SIZE) / 4;
+            nvmc_erase_page(start + offset);
+            nvmc_write(start + offset, (const uint32_t*)(source + offset), words);
+        }
+        if (crc32_update(0, (const uint8_t*)start, length) != header.image_crc) {
+            // Leave it to app_image_valid, which won't start it.
+            LOG("copy of staged image differs");
+            header.valid = 0xffffffff;
+        }
+    } else {
+        LOG("staged image invalid");
+    }
+
+    // Only install the image once. An invalid image leaves no record, so the
+    // application that staged it keeps running.
+    nvmc_erase_page((uint32_t)_sprogress);
+    if (valid) {
+        nvmc_write((uint32_t)_sprogress, (const uint32_t*)&header, PROGRESS_HEADER_WORDS);
+    }
+}
+
 // Entrypoint for the DFU. Called unconditionally at reset. It will determine
 // whether to start the DFU or jump to the application.
 void _start(void) {
@@ -95,15 +324,20 @@ void _start(void) {
     LOG("init MBR vector table");
     *(uint32_t*)MBR_VECTOR_TABLE = SD_CODE_BASE;
 
+    // An update that the application received in the background is
+    // installed first.
+    install_staged_image();
+
     // Check whether there is something that looks like a reset handler at
     // the app ISR vector. If the page has been cleared, it will be
     // 0xffffffff.
     // Also check for other reasons DFU may be triggered:
     //   * GPREGRET is set, which means DFU mode was requested
     //   * The reset reason is suspicious.
+    //   * The last update didn't finish or wrote the wrong data.
     uint32_t *app_isr = (uint32_t*)APP_CODE_BASE;
     uint32_t reset_handler = app_isr[1];
-    if (reset_handler != 0xffffffff && NRF_POWER->GPREGRET == 0 && (NRF_POWER->RESETREAS & DFU_RESET_REASONS) == 0) {
+    if (reset_handler != 0xffffffff && NRF_POWER->GPREGRET == 0 && (NRF_POWER->RESETREAS & DFU_RESET_REASONS) == 0 && app_image_valid()) {
         // There is a valid application and the application hasn't
         // requested for DFU mode.
         LOG("jump to application");
@@ -137,22 +371,104 @@ void _start(void) {
         LOG_NUM("cannot enable SoftDevice:", err_code);
     }
 
+#if TRANSPORT_BLE
     ble_init();
+#endif
+#if TRANSPORT_SERIAL
+    serial_init();
+#endif
 
     LOG("waiting...");
-    ble_run();
+    dfu_run();
+}
+#endif
+
+// dfu_run is the main loop. It waits for events of the SoftDevice and the
+// transports, using the 'thread model' (instead of the IRQ model): everything
+// runs in thread mode, so nothing needs to be protected from interrupts.
+// This function will not return.
+void dfu_run(void) {
+    while (1) {
+        __WFE();
+        sd_app_evt_wait();
+        uint32_t evt_id;
+        while (sd_evt_get(&evt_id) != NRF_ERROR_NOT_FOUND) {
+            sd_evt_handler(evt_id);
+        }
+#if TRANSPORT_BLE
+        ble_poll();
+#endif
+#if TRANSPORT_SERIAL
+        serial_poll();
+#endif
+#if DEBUG
+        trace_flush();
+#endif
+    }
+}
+
+// send_reply sends a status code without payload to the client.
+static void send_reply(uint8_t code) {
+    transport->send_reply(sizeof(code), &code);
 }
 
 // handle_command is called when the command characteristic is written by the
 // client.
-void handle_command(uint16_t data_len, ble_command_t *cmd) {
-    // Format: command (1 byte), payload (any length, up to 19 bytes with
-    // default MTU).
+void handle_command(transport_t *t, uint16_t data_len, ble_command_t *cmd) {
+    // Format: command (1 byte), payload (any length, up to ATT MTU - 4
+    // bytes).
     if (data_len == 0) return;
 
+#if BROADCAST
+    if (phase == PHASE_BROADCAST) {
+        if (cmd->any.command == COMMAND_START || cmd->any.command == COMMAND_SIGNATURE ||
+                cmd->any.command == COMMAND_IMAGE_INFO || cmd->any.command == COMMAND_RESET) {
+            // A client takes over from a broadcast to start an update, for
+            // example to write the chunks that this device missed. The
+            // broadcast isn't resumed.
+            LOG("broadcast: stopped by client");
+            phase = PHASE_READY;
+        } else {
+            // Other commands only read (or do nothing, like
+            // COMMAND_RESET_BOOTLOADER), so they are answered while the
+            // broadcast goes on. A repair with -delta starts with the page
+            // hashes.
+            transport_t *broadcast_transport = transport;
+            transport = t;
+            if (cmd->any.command == COMMAND_STATS && data_len >= sizeof(cmd->stats)) {
+                LOG("command: stats");
+                send_stats(cmd->stats.offset);
+            } else if (cmd->any.command == COMMAND_PAGE_HASHES && data_len >= sizeof(cmd->page_hashes)) {
+                LOG("command: page hashes");
+                send_page_hashes(cmd->page_hashes.startAddr, cmd->page_hashes.count);
+            }
+            transport = broadcast_transport;
+            return;
+        }
+    }
+#endif
+
+    // A client on another transport has to wait until the update is done.
+    if (phase != PHASE_READY && t != transport) {
+        uint8_t status = STATUS_BUSY;
+        t->send_reply(sizeof(status), &status);
+        return;
+    }
+    transport = t;
+
+    // The performance counters can be read at any time, also during an
+    // update.
+    if (cmd->any.command == COMMAND_STATS) {
+        if (data_len >= sizeof(cmd->stats)) {
+            LOG("command: stats");
+            send_stats(cmd->stats.offset);
+        }
+        return;
+    }
+
     // Cannot run more than one command at a time.
     if (phase != PHASE_READY) {
-      ble_send_reply(STATUS_BUSY);
+      send_reply(STATUS_BUSY);
       return;
     }
 
@@ -161,44 +477,146 @@ void handle_command(uint16_t data_len, ble_command_t *cmd) {
         LOG("command: reset");
         // The reset will happen in the disconnect event.
         phase = PHASE_RESETTING;
-        ble_disconnect();
+        transport->disconnect();
     } else if (cmd->any.command == COMMAND_START) {
-        if (data_len < sizeof(cmd->start)) {
+        if (data_len < sizeof(cmd->start) - sizeof(cmd->start.image_crc)) {
             return;
         }
         LOG("command: start");
-        if (cmd->start.startAddr != APP_CODE_BASE) {
-          ble_send_reply(STATUS_INVALID_ERASE_START);
+        uint32_t image_crc = 0;
+        flash_check_crc = data_len >= sizeof(cmd->start);
+        if (flash_check_crc) {
+            image_crc = cmd->start.image_crc;
+        }
+        uint32_t chip = image_chip;
+        image_chip = 0; // only for this update
+        if (chip != 0 && chip != DFU_CHIP) {
+          // The image was made for another chip, see dfuclient pack -chip.
+          LOG_NUM("image for chip:", chip);
+          send_reply(STATUS_INVALID_CHIP);
+          return;
+        }
+        if (cmd->start.startAddr < APP_CODE_BASE || cmd->start.startAddr % PAGE_SIZE != 0) {
+          // Only whole pages can be rewritten, for example to only update
+          // the pages that changed.
+          send_reply(STATUS_INVALID_ERASE_START);
           return;
         }
-        if (cmd->start.startAddr + cmd->start.length > (uint32_t)_stext) {
+        if (cmd->start.length == 0 || cmd->start.startAddr + cmd->start.length > (uint32_t)_sprogress) {
           // Note: using > instead of >= because if the entire application
           // flash area is filled, the next address (start + length) will be
-          // the bootloader.
-          ble_send_reply(STATUS_INVALID_ERASE_LENGTH);
+          // the progress record.
+          send_reply(STATUS_INVALID_ERASE_LENGTH);
           return;
         }
-        if (cmd->start.startAddr % 4 != 0) {
+        if (cmd->start.length % 4 != 0) {
           // The app size must be aligned to 4 bytes.
-          ble_send_reply(STATUS_INVALID_ERASE_LENGTH);
+          send_reply(STATUS_INVALID_ERASE_LENGTH);
           return;
         }
+        flash_streaming = cmd->start.flags & START_FLAG_STREAM;
+        flash_compressed = cmd->start.flags & START_FLAG_COMPRESSED;
+        flash_offsets = (cmd->start.flags & (START_FLAG_OFFSETS | START_FLAG_COMPRESSED)) == START_FLAG_OFFSETS;
+        for (uint32_t i = 0; i < sizeof(flash_received) / 4; i++) {
+            flash_received[i] = 0;
+        }
+        flash_missing_sent = ~0;
+        lz_flags = 0;
+        lz_in_match = 0;
+
+        // Continue where the previous update of this image stopped, or start
+        // a new progress record.
+        uint32_t committed_pages = 0;
+        if (cmd->start.flags & START_FLAG_RESUME) {
+            committed_pages = progress_committed_pages(cmd->start.startAddr, cmd->start.length, image_crc);
+        }
+        flash_progress_step = committed_pages ? PROGRESS_DONE : PROGRESS_ERASE;
+        flash_progress_header.start = cmd->start.startAddr;
+        flash_progress_header.length = cmd->start.length;
+        flash_progress_header.image_crc = image_crc;
+        flash_progress_header.magic = PROGRESS_MAGIC;
+        flash_progress_header.valid = (cmd->start.flags & START_FLAG_MORE) ? PROGRESS_MORE : 0xffffffff;
+        flash_commit_pending = 0;
+
+        flash_write_start = cmd->start.startAddr;
         flash_write_app_size = cmd->start.length;
-        flash_write_index = 0;
-        flash_write_current_page = APP_CODE_BASE / PAGE_SIZE;
-        ble_send_reply(STATUS_ERASE_STARTED);
+        flash_write_index = committed_pages * PAGE_SIZE;
+        flash_write_current_page = flash_write_start / PAGE_SIZE + committed_pages;
+        ble_reply_t reply = {
+            .erase_started = {
+                .status        = STATUS_ERASE_STARTED,
+                .phy           = transport->phy,
+                .max_data_len  = transport->mtu - 3,
+                .flags         = (cmd->start.flags & (START_FLAG_STREAM | START_FLAG_COMPRESSED | START_FLAG_RESUME | START_FLAG_MORE)) |
+                                 (flash_offsets ? START_FLAG_OFFSETS : 0) |
+                                 (SIGNED_UPDATES ? START_FLAG_SIGNED : 0),
+                .resume_offset = flash_write_index,
+            },
+        };
+        transport->send_reply(sizeof(reply.erase_started), &reply);
+
+        // A flash operation of an interrupted update may still be running.
+        // Wait for it to finish before starting a new one.
+        if (flash_op != FLASH_OP_NONE) {
+            flash_op = FLASH_OP_BUSY;
+        }
 
         // Start erasing the flash.
         phase = PHASE_ERASING;
-        flash_erase_current_page = cmd->start.startAddr / PAGE_SIZE;
-        flash_erase_last_page = (cmd->start.startAddr + cmd->start.length) / PAGE_SIZE;
-        resume_flash_erase();
+        flash_erase_current_page = flash_write_current_page;
+        flash_erase_last_page = (cmd->start.startAddr + cmd->start.length - 1) / PAGE_SIZE;
+        flash_erase_erased = 0;
+        flash_erase_skipped = 0;
+        flash_credit_pending = 0;
+
+        // Count the CPU cycles spent on received data and hashing, to see
+        // how much decompressing and checking the update costs.
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+        flash_data_cycles = 0;
+        flash_hash_cycles = 0;
+        flash_verify_cycles = 0;
+        NRF_RTC1->TASKS_START = 1;
+        memset(&dfu_stats, 0, offsetof(dfu_stats_t, conn_interval));
+
+        // When resuming, the pages that were already written are part of the
+        // hashes too.
+        flash_write_crc = 0;
+#if SIGNED_UPDATES
+        sha256_init(&flash_write_sha);
+        sha256_update(&flash_write_sha, (const uint8_t*)&cmd->start.startAddr, 8); // start address and length
+#endif
+        flash_hash_written(FLASH_PTR(flash_write_start), flash_write_index);
+
+        resume_flash();
+    } else if (cmd->any.command == COMMAND_PAGE_HASHES) {
+        if (data_len < sizeof(cmd->page_hashes)) {
+            return;
+        }
+        LOG("command: page hashes");
+        send_page_hashes(cmd->page_hashes.startAddr, cmd->page_hashes.count);
 #if DEBUG
     } else if (cmd->any.command == COMMAND_PING) {
         // Only for debugging
         LOG("command: ping");
-        ble_send_reply(STATUS_PONG);
+        send_reply(STATUS_PONG);
 #endif
+#if SIGNED_UPDATES
+    } else if (cmd->any.command == COMMAND_SIGNATURE) {
+        if (data_len < sizeof(cmd->signature) || cmd->signature.offset >= sizeof(signature) ||
+                cmd->signature.offset % SIGNATURE_PART_SIZE != 0) {
+            return;
+        }
+        LOG("command: signature");
+        memcpy(&signature[cmd->signature.offset], cmd->signature.data, SIGNATURE_PART_SIZE);
+        signature_parts |= 1 << (cmd->signature.offset / SIGNATURE_PART_SIZE);
+#endif
+    } else if (cmd->any.command == COMMAND_IMAGE_INFO) {
+        if (data_len < sizeof(cmd->image_info)) {
+            return;
+        }
+        LOG_NUM("command: image info, version", cmd->image_info.version);
+        image_chip = cmd->image_info.chip;
     } else if (cmd->any.command == COMMAND_RESET_BOOTLOADER) {
         LOG("command: reset bootloader");
         // Nothing to do here, we're already in the bootloader.
@@ -209,83 +627,516 @@ void handle_command(uint16_t data_len, ble_command_t *cmd) {
 
 // handle_data is called when a new value is written by the client to the data
 // characteristic.
-void handle_data(uint16_t data_len, uint8_t *data) {
-    if (phase != PHASE_WRITING) {
+void handle_data(transport_t *t, uint16_t data_len, uint8_t *data) {
+    if (t != transport || (phase != PHASE_WRITING && phase != PHASE_STREAMING)) {
         LOG("got data while not in writing state");
         return;
     }
-    for (int i=0; i<data_len; i++) {
-        if (flash_write_index >= flash_write_app_size) continue;
-        flash_write_buf[flash_write_index % (PAGE_SIZE * 2)] = data[i];
-        flash_write_index++;
-        if (flash_write_index == flash_write_app_size) {
-            // Last byte of the app has been received. Start writing this page
-            // to flash, even if it isn't a full page.
-            LOG("received everything");
-            phase = PHASE_WRITING_LAST_PAGE;
-            write_current_page();
-        } else if (flash_write_index % PAGE_SIZE == 0) {
-            // All data in this flash page has been received, so start writing
-            // this page to flash.
-            LOG("next page");
-            write_current_page();
+    uint32_t start_cycles = DWT->CYCCNT;
+
+    // Count the packets in each connection interval. The bootloader doesn't
+    // see connection events, so an interval starts with the first packet
+    // after the previous interval ended. It is taken to be a bit shorter
+    // than the connection interval (40 instead of 40.96 ticks per 1.25ms),
+    // to allow for jitter. The serial transport has no connection intervals.
+    uint32_t now = NRF_RTC1->COUNTER;
+    dfu_stats.bytes_received += data_len;
+    dfu_stats.packets++;
+    if (transport->phy != 0) {
+        if (dfu_stats.intervals == 0 || ((now - stats_interval_start) & RTC_COUNTER_MASK) >= dfu_stats.conn_interval * 40u) {
+            dfu_stats.intervals++;
+            stats_interval_start = now;
+            stats_interval_packets = 0;
+        }
+        stats_interval_packets++;
+        if (stats_interval_packets > dfu_stats.max_packets) {
+            dfu_stats.max_packets = stats_interval_packets;
+        }
+    }
+
+    if (flash_offsets) {
+        receive_packet(data_len, data);
+    } else {
+        for (int i=0; i<data_len && phase != PHASE_READY; i++) {
+            if (flash_compressed) {
+                decompress_byte(data[i]);
+            } else {
+                receive_byte(data[i]);
+            }
+        }
+    }
+    flash_data_cycles += DWT->CYCCNT - start_cycles;
+
+    if (flash_op == FLASH_OP_BUSY) {
+        resume_flash();
+    }
+}
+
+// receive_byte stores the next byte of the application in the page buffer, and
+// starts writing a page once it is complete.
+static void receive_byte(uint8_t b) {
+    if (flash_write_index >= flash_write_app_size) return;
+    if (flash_write_index % PAGE_SIZE == 0 &&
+            flash_write_index / PAGE_SIZE >= flash_write_current_page - flash_write_start / PAGE_SIZE + FLASH_BUF_PAGES) {
+        // This data would overwrite a page in the buffer that hasn't been
+        // written to flash yet. The client sent more than it was credited.
+        LOG("previous page was not completely written");
+        dfu_stats.too_fast++;
+        send_reply(STATUS_WRITE_TOO_FAST);
+        phase = PHASE_READY;
+        return;
+    }
+    flash_write_buf[flash_write_index % FLASH_BUF_SIZE] = b;
+    flash_write_index++;
+    if (flash_write_index == flash_write_app_size) {
+        // Last byte of the app has been received. Start writing this page
+        // to flash (if possible), even if it isn't a full page.
+        LOG("received everything");
+        phase = PHASE_WRITING_LAST_PAGE;
+        resume_flash();
+    } else if (flash_write_index % PAGE_SIZE == 0) {
+        // All data in this flash page has been received, so start writing
+        // this page to flash (if possible).
+        LOG("next page");
+        resume_flash();
+    }
+}
+
+// decompress_byte processes the next byte of compressed data. Matches are
+// copied from the page buffer, which always contains at least the last
+// LZ_WINDOW_SIZE bytes.
+static void decompress_byte(uint8_t b) {
+    if (lz_flags <= 1) {
+        // Start of a new group: the marker bit shows when all 8 flags have
+        // been used.
+        lz_flags = b | 0x100;
+        return;
+    }
+    if ((lz_flags & 1) == 0) {
+        receive_byte(b);
+    } else if (!lz_in_match) {
+        lz_match = b;
+        lz_in_match = 1;
+        return;
+    } else {
+        uint32_t offset = (lz_match | (b & 0xf0) << 4) + 1;
+        uint32_t length = (b & 0x0f) + LZ_MIN_MATCH;
+        lz_in_match = 0;
+        while (length-- && phase != PHASE_READY) {
+            receive_byte(flash_write_buf[(flash_write_index - offset) % FLASH_BUF_SIZE]);
+        }
+    }
+    lz_flags >>= 1;
+}
+
+// receive_packet stores a data packet that starts with its offset (see
+// START_FLAG_OFFSETS). Data that has already been written to flash is ignored,
+// so packets can safely be sent more than once.
+static void receive_packet(uint16_t data_len, uint8_t *data) {
+    if (data_len < 4) return;
+    uint32_t offset = data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24;
+    data += 4;
+    data_len -= 4;
+    if (data_len == 0) {
+        // The client wants to know whether anything is missing.
+        send_data_missing();
+        return;
+    }
+    uint32_t committed = flash_write_current_page * PAGE_SIZE - flash_write_start;
+    if (offset % DATA_BLOCK_SIZE != 0 || offset + data_len > flash_write_app_size ||
+            (data_len % DATA_BLOCK_SIZE != 0 && offset + data_len != flash_write_app_size)) {
+        LOG("invalid data packet");
+        return;
+    }
+    if (offset + data_len > committed + FLASH_BUF_SIZE) {
+        // The client sent more than it was credited.
+        LOG("data packet outside of buffer");
+        dfu_stats.too_fast++;
+        send_reply(STATUS_WRITE_TOO_FAST);
+        phase = PHASE_READY;
+        return;
+    }
+
+    // Store all blocks that haven't been written to flash yet.
+    for (uint32_t i = 0; i < data_len; i += DATA_BLOCK_SIZE) {
+        if (offset + i < committed) continue;
+        uint32_t index = (offset + i) % FLASH_BUF_SIZE;
+        memcpy(&flash_write_buf[index], &data[i], data_len - i < DATA_BLOCK_SIZE ? data_len - i : DATA_BLOCK_SIZE);
+        flash_received[index / DATA_BLOCK_SIZE / 32] |= 1u << (index / DATA_BLOCK_SIZE % 32);
+    }
+
+    // Move past all data that has been received without gaps. The blocks after
+    // the end of the buffer still belong to the page that is being written.
+    uint32_t old_index = flash_write_index;
+    uint32_t limit = committed + FLASH_BUF_SIZE;
+    while (flash_write_index < flash_write_app_size && flash_write_index < limit && flash_block_received(flash_write_index)) {
+        flash_write_index += DATA_BLOCK_SIZE;
+        if (flash_write_index > flash_write_app_size) {
+            flash_write_index = flash_write_app_size;
+        }
+    }
+    if (offset > flash_write_index && flash_missing_sent != flash_write_index) {
+        // A packet got lost. Report it once, the client can poll for it if
+        // the report gets lost as well.
+        send_data_missing();
+    }
+    if (flash_write_index == flash_write_app_size) {
+        LOG("received everything");
+        phase = PHASE_WRITING_LAST_PAGE;
+        resume_flash();
+    } else if (flash_write_index / PAGE_SIZE != old_index / PAGE_SIZE) {
+        LOG("next page");
+        resume_flash();
+    }
+}
+
+// flash_block_received returns whether the block at the given offset in the
+// image is in the page buffer.
+static int flash_block_received(uint32_t offset) {
+    uint32_t block = offset % FLASH_BUF_SIZE / DATA_BLOCK_SIZE;
+    return (flash_received[block / 32] >> (block % 32)) & 1;
+}
+
+// send_data_missing tells the client which data is missing at the start of the
+// page buffer, if any.
+static void send_data_missing(void) {
+    uint32_t end = flash_write_index;
+    uint32_t limit = flash_write_current_page * PAGE_SIZE - flash_write_start + FLASH_BUF_SIZE;
+    if (limit > flash_write_app_size) {
+        limit = flash_write_app_size;
+    }
+    while (end < limit && !flash_block_received(end)) {
+        end += DATA_BLOCK_SIZE;
+    }
+    if (end == flash_write_index) {
+        return; // nothing is missing
+    }
+    if (end > limit) {
+        end = limit;
+    }
+    LOG_NUM("data missing:", flash_write_index);
+    flash_missing_sent = flash_write_index;
+    ble_reply_t reply = {
+        .data_missing = {
+            .status = STATUS_DATA_MISSING,
+            .offset = flash_write_index,
+            .length = end - flash_write_index,
+        },
+    };
+    transport->send_reply(sizeof(reply.data_missing), &reply);
+}
+
+#if BROADCAST
+// handle_broadcast is called for every chunk of a broadcast update that is
+// received. The first one for this BROADCAST_TARGET starts the update, unless
+// a client is updating the device or a broadcast was already received since
+// the last reset.
+void handle_broadcast(transport_t *t, uint16_t data_len, const broadcast_chunk_t *chunk) {
+    if (data_len < offsetof(broadcast_chunk_t, data) || chunk->target != BROADCAST_TARGET) {
+        return;
+    }
+    if (phase == PHASE_READY && !broadcast_started) {
+        broadcast_start(t, chunk);
+    }
+    if (phase != PHASE_BROADCAST || chunk->start != flash_progress_header.start ||
+            chunk->length != flash_progress_header.length || chunk->image_crc != flash_progress_header.image_crc) {
+        return; // not the image that is being received
+    }
+    uint32_t length = data_len - offsetof(broadcast_chunk_t, data);
+    dfu_stats.bytes_received += length;
+    dfu_stats.packets++;
+#if SIGNED_UPDATES
+    if (chunk->offset == BROADCAST_OFFSET_SIGNATURE && length >= sizeof(signature)) {
+        memcpy(signature, chunk->data, sizeof(signature));
+        signature_parts = (1 << (sizeof(signature) / SIGNATURE_PART_SIZE)) - 1;
+        resume_flash(); // the image may be complete already
+        return;
+    }
+#endif
+    uint32_t index = chunk->offset / BROADCAST_CHUNK_SIZE;
+    if (chunk->offset % BROADCAST_CHUNK_SIZE != 0 || chunk->offset >= flash_write_app_size) {
+        LOG("broadcast: invalid chunk");
+        return;
+    }
+    if (length > flash_write_app_size - chunk->offset) {
+        length = flash_write_app_size - chunk->offset;
+    }
+    if (length < BROADCAST_CHUNK_SIZE && chunk->offset + length != flash_write_app_size) {
+        LOG("broadcast: invalid chunk");
+        return;
+    }
+    if ((broadcast_received[index / 32] >> (index % 32)) & 1) {
+        return; // received in an earlier round
+    }
+    if (broadcast_queue_head - broadcast_queue_tail == BROADCAST_QUEUE) {
+        LOG("broadcast: queue full");
+        return;
+    }
+    uint32_t slot = broadcast_queue_head % BROADCAST_QUEUE;
+    memcpy(&flash_write_buf[slot * BROADCAST_CHUNK_SIZE], chunk->data, length);
+    broadcast_queue_offset[slot] = chunk->offset;
+    broadcast_queue_head++;
+    broadcast_received[index / 32] |= 1u << (index % 32);
+    broadcast_missing--;
+    resume_flash();
+}
+
+// broadcast_start starts receiving the broadcast update that the given chunk
+// belongs to. Like COMMAND_START, it first erases the pages of the image. If
+// the device was already receiving the same image before a reset, the chunks
+// that were written then are kept instead: a chunk that isn't erased anymore
+// has been received. A chunk that was interrupted by the reset shows up as a
+// CRC mismatch in the end, which a client can repair.
+static void broadcast_start(transport_t *t, const broadcast_chunk_t *chunk) {
+    uint32_t chunks = (chunk->length + BROADCAST_CHUNK_SIZE - 1) / BROADCAST_CHUNK_SIZE;
+    if (chunk->start < APP_CODE_BASE || chunk->start % PAGE_SIZE != 0 || chunk->length == 0 ||
+            chunk->length % 4 != 0 || chunk->start + chunk->length > (uint32_t)_sprogress || chunks > BROADCAST_MAX_CHUNKS) {
+        LOG("broadcast: invalid image");
+        return;
+    }
+    LOG("broadcast: start");
+    broadcast_started = 1;
+    transport = t;
+    phase = PHASE_BROADCAST;
+
+    flash_progress_header.start = chunk->start;
+    flash_progress_header.length = chunk->length;
+    flash_progress_header.image_crc = chunk->image_crc;
+    flash_progress_header.magic = PROGRESS_MAGIC;
+    flash_progress_header.valid = 0xffffffff;
+    flash_progress_step = PROGRESS_ERASE;
+    flash_commit_pending = 0;
+    flash_credit_pending = 0;
+    flash_write_start = chunk->start;
+    flash_write_app_size = chunk->length;
+    flash_write_index = 0;
+    flash_write_current_page = chunk->start / PAGE_SIZE;
+    flash_erase_current_page = flash_write_current_page;
+    flash_erase_last_page = (chunk->start + chunk->length - 1) / PAGE_SIZE;
+    flash_erase_erased = 0;
+    flash_erase_skipped = 0;
+    broadcast_queue_head = 0;
+    broadcast_queue_tail = 0;
+    broadcast_missing = chunks;
+    for (uint32_t i = 0; i < sizeof(broadcast_received) / 4; i++) {
+        broadcast_received[i] = 0;
+    }
+#if SIGNED_UPDATES
+    signature_parts = 0;
+#endif
+    NRF_RTC1->TASKS_START = 1;
+    memset(&dfu_stats, 0, offsetof(dfu_stats_t, conn_interval));
+
+    const progress_t *progress = PROGRESS;
+    if (progress->magic == PROGRESS_MAGIC && progress->start == chunk->start && progress->length == chunk->length &&
+            progress->image_crc == chunk->image_crc && progress->valid == 0xffffffff) {
+        LOG("broadcast: resuming");
+        flash_progress_step = PROGRESS_DONE;
+        flash_erase_current_page = flash_erase_last_page + 1;
+        for (uint32_t i = 0; i < chunks; i++) {
+            const uint32_t *p = FLASH_PTR(chunk->start + i * BROADCAST_CHUNK_SIZE);
+            for (uint32_t j = 0; j < BROADCAST_CHUNK_SIZE / 4 && i * BROADCAST_CHUNK_SIZE + j * 4 < chunk->length; j++) {
+                if (p[j] != 0xffffffff) {
+                    broadcast_received[i / 32] |= 1u << (i % 32);
+                    broadcast_missing--;
+                    break;
+                }
+            }
         }
     }
+
+    // A flash operation of an interrupted update may still be running.
+    if (flash_op != FLASH_OP_NONE) {
+        flash_op = FLASH_OP_BUSY;
+    }
+    resume_flash();
+}
+
+// broadcast_write_chunk writes the next chunk in the queue to flash. Once all
+// chunks have been written, it checks the image like the last page of an
+// update. It returns 0 if there is nothing to do until more chunks arrive.
+static int broadcast_write_chunk(void) {
+    if (broadcast_queue_head != broadcast_queue_tail) {
+        uint32_t slot = broadcast_queue_tail % BROADCAST_QUEUE;
+        uint32_t offset = broadcast_queue_offset[slot];
+        uint32_t length = flash_write_app_size - offset;
+        if (length > BROADCAST_CHUNK_SIZE) {
+            length = BROADCAST_CHUNK_SIZE;
+        }
+        LOG_NUM("broadcast: write chunk", offset);
+        flash_op_started(FLASH_OP_CHUNK, sd_flash_write(FLASH_PTR(flash_write_start + offset), (uint32_t*)&flash_write_buf[slot * BROADCAST_CHUNK_SIZE], length / 4));
+        return 1;
+    }
+    if (broadcast_missing != 0) {
+        return 0;
+    }
+#if SIGNED_UPDATES
+    if (signature_parts != (1 << (sizeof(signature) / SIGNATURE_PART_SIZE)) - 1) {
+        return 0; // wait for the next round
+    }
+#endif
+
+    // Everything has been written.
+    flash_write_crc = 0;
+#if SIGNED_UPDATES
+    sha256_init(&flash_write_sha);
+    sha256_update(&flash_write_sha, (const uint8_t*)&flash_progress_header.start, 8); // start address and length
+#endif
+    flash_hash_written(FLASH_PTR(flash_write_start), flash_write_app_size);
+    if (flash_write_crc != flash_progress_header.image_crc) {
+        LOG("broadcast: CRC mismatch");
+        phase = PHASE_READY;
+        return 1;
+    }
+#if SIGNED_UPDATES
+    if (!flash_signature_valid()) {
+        LOG("broadcast: invalid signature");
+        phase = PHASE_READY;
+        return 1;
+    }
+#endif
+    flash_progress_step = PROGRESS_VALID;
+    return 1;
+}
+#endif
+
+// handle_notification_sent is called when a notification has been sent, so
+// that there is room to queue a new one.
+void handle_notification_sent(void) {
+    if (flash_credit_pending && phase != PHASE_READY) {
+        send_credit();
+    }
 }
 
 // handle_disconnect is called when the client disconnects.
-void handle_disconnect(void) {
-    if (phase == PHASE_RESETTING) {
+void handle_disconnect(transport_t *t) {
+    if (t != transport) {
+        // Not the client of the update, if there is one.
+        return;
+    } else if (phase == PHASE_RESETTING) {
         // The client requested a reset, which we do after disconnecting.
+        LOG_FLUSH();
         sd_nvic_SystemReset();
         __builtin_unreachable();
+    } else if (phase != PHASE_READY) {
+        // The update was interrupted. Go back to the start so that a new
+        // client can resume it, using the progress record.
+        LOG("update interrupted");
+        phase = PHASE_READY;
     }
 }
 
 // sd_evt_handler is called for non-BLE events. In particular, it is called for
 // all flash related events.
 void sd_evt_handler(uint32_t evt_id) {
+    char op = flash_op;
+    if (op == FLASH_OP_BUSY) {
+        // This event is for a flash operation that was still running when
+        // we tried to start a new one. Try again now.
+        LOG("sd evt: retry flash operation");
+        resume_flash();
+        return;
+    }
     switch (evt_id) {
     case NRF_EVT_FLASH_OPERATION_SUCCESS:
-        switch (phase) {
-        case PHASE_ERASING:
-            LOG("sd evt: flash operation finished");
-            if (flash_erase_current_page == flash_erase_last_page) {
-              phase = PHASE_WRITING;
-              ble_send_reply(STATUS_ERASE_FINISHED);
-              return;
-            }
-            flash_erase_current_page++;
-            resume_flash_erase();
+        flash_op = FLASH_OP_NONE;
+        if (phase == PHASE_READY) {
+            // Operation was still running when the DFU process was stopped.
+            LOG("sd evt: flash operation finished (ignored)");
             break;
-        case PHASE_WRITING:
-            // Page was successfully written.
+        }
+        if (op == FLASH_OP_PROGRESS) {
+            LOG("sd evt: progress record updated");
+            flash_progress_step++;
+            if (flash_progress_step == PROGRESS_FINISHED) {
+#if BROADCAST
+                if (phase == PHASE_BROADCAST) {
+                    // Nobody will send COMMAND_RESET, so start the new
+                    // application right away.
+                    LOG("broadcast: finished");
+                    LOG_FLUSH();
+                    sd_nvic_SystemReset();
+                }
+#endif
+                // Everything is finished!
+                phase = PHASE_READY;
+                ble_reply_t reply = {
+                    .write_finished = {
+                        .status      = STATUS_WRITE_FINISHED,
+                        .data_cycles   = flash_data_cycles,
+                        .hash_cycles   = flash_hash_cycles,
+                        .verify_cycles = flash_verify_cycles,
+                    },
+                };
+                transport->send_reply(sizeof(reply.write_finished), &reply);
+                break;
+            }
+        } else if (op == FLASH_OP_ERASE) {
+            LOG("sd evt: page erased");
+            stats_flash_op_done(&dfu_stats.erase);
+            dfu_stats.pages_erased++;
+            flash_erase_erased++;
+            flash_erase_page_done();
+#if BROADCAST
+        } else if (op == FLASH_OP_CHUNK) {
+            LOG("sd evt: chunk written");
+            broadcast_queue_tail++;
+#endif
+        } else if (op == FLASH_OP_WRITE) {
+            LOG("sd evt: page written");
+            stats_flash_op_done(&dfu_stats.write);
+            dfu_stats.pages_written++;
+            flash_commit_pending = 1;
+
+            // Check what has actually been written, not what was received.
+            uint32_t page = flash_write_current_page;
+            flash_hash_written(FLASH_PTR(page * PAGE_SIZE), write_page_length(page));
+        } else {
+            LOG("sd evt: page committed");
+            flash_commit_pending = 0;
+
+            // The page buffer can be reused for the next data.
+            uint32_t block = (flash_write_current_page * PAGE_SIZE - flash_write_start) % FLASH_BUF_SIZE / DATA_BLOCK_SIZE;
+            for (uint32_t i = 0; i < PAGE_SIZE / DATA_BLOCK_SIZE / 32; i++) {
+                flash_received[block / 32 + i] = 0;
+            }
+
             flash_write_current_page++;
-            break;
-        case PHASE_WRITING_LAST_PAGE:
-            // Everything is finished!
-            phase = PHASE_READY;
-            ble_send_reply(STATUS_WRITE_FINISHED);
-            break;
-        default:
-            LOG_NUM("NRF_EVT_FLASH_OPERATION_SUCCESS: unknown state", phase);
-            break;
+            if (flash_write_current_page > flash_erase_last_page) {
+                // All pages have been written. Without a CRC from the client
+                // the image is trusted, like it was before CRCs were sent.
+                if (flash_check_crc && flash_write_crc != flash_progress_header.image_crc) {
+                    LOG("sd evt: CRC mismatch");
+                    send_reply(STATUS_CRC_MISMATCH);
+                    phase = PHASE_READY;
+                    break;
+                }
+#if SIGNED_UPDATES
+                if (!flash_signature_valid()) {
+                    LOG("sd evt: invalid signature");
+                    send_reply(STATUS_SIGNATURE_INVALID);
+                    phase = PHASE_READY;
+                    break;
+                }
+#endif
+                flash_progress_step = PROGRESS_VALID;
+            } else {
+                // There is room for another page in the buffer.
+                send_credit();
+            }
         }
+        resume_flash();
         break;
     case NRF_EVT_FLASH_OPERATION_ERROR:
-        switch (phase) {
-        case PHASE_ERASING:
+        flash_op = FLASH_OP_NONE;
+        if (phase == PHASE_READY) {
+            LOG("sd evt: flash operation failed (ignored)");
+        } else if (op == FLASH_OP_ERASE) {
             LOG("sd evt: erase failed");
-            ble_send_reply(STATUS_ERASE_FAILED);
-            break;
-        case PHASE_WRITING:
-        case PHASE_WRITING_LAST_PAGE:
+            send_reply(STATUS_ERASE_FAILED);
+        } else {
             LOG("sd evt: write failed");
-            ble_send_reply(STATUS_WRITE_FAILED);
-            break;
-        default:
-            LOG("sd evt: unknown flash operation");
-            break;
+            send_reply(STATUS_WRITE_FAILED);
         }
         // Reset back to the start, so that a new attempt can be made.
         phase = PHASE_READY;
@@ -296,55 +1147,322 @@ void sd_evt_handler(uint32_t evt_id) {
     }
 }
 
-// resume_flash_erase is called either right after a COMMAND_START is received
-// or after the previous flash page erase was finished. It will continue to
-// erase the next page that should be erased.
-static void resume_flash_erase(void) {
-    LOG_NUM("erasing:", flash_erase_current_page);
-    uint32_t err_code = sd_flash_page_erase(flash_erase_current_page);
-    if (err_code != 0) {
-        LOG("  error: cannot schedule page erase");
-        // Error: the erase command wasn't scheduled.
-        ble_send_reply(STATUS_ERASE_FAILED);
+// flash_page_is_blank returns whether the given flash page is already erased
+// (all bits set), in which case it doesn't need to be erased again.
+static int flash_page_is_blank(uint32_t page) {
+    uint32_t *p = FLASH_PTR(page * PAGE_SIZE);
+    for (uint32_t i = 0; i < PAGE_SIZE / 4; i++) {
+        if (p[i] != 0xffffffff) {
+            return 0;
+        }
     }
-    if (err_code == NRF_ERROR_INTERNAL) {
-        LOG("! internal error");
-    } else if (err_code == NRF_ERROR_BUSY) {
-        LOG("! busy");
-    } else if (err_code != 0) {
-        LOG("! could not start erase of page");
+    return 1;
+}
+
+// flash_page_received returns whether all data for the given page has been
+// received, so that it can be written to flash.
+static int flash_page_received(uint32_t page) {
+    uint32_t end = (page + 1) * PAGE_SIZE - flash_write_start;
+    return flash_write_index >= end || flash_write_index == flash_write_app_size;
+}
+
+// resume_flash starts the next flash operation, if no flash operation is in
+// progress. It is called after a COMMAND_START is received, when a page has
+// been received and when the previous flash operation has finished. It also
+// retries an operation that couldn't be started because the SoftDevice was
+// busy.
+// The progress record is prepared first. After that, writing a received page
+// takes priority over erasing the next page, so that the page buffer is freed
+// up as soon as possible. Pages that are already erased are skipped, as
+// erasing a page takes a long time (around 85ms).
+static void resume_flash(void) {
+    if (flash_op == FLASH_OP_BUSY) {
+        flash_op = FLASH_OP_NONE;
+    }
+    while (flash_op == FLASH_OP_NONE && phase != PHASE_READY) {
+        if (flash_progress_step == PROGRESS_ERASE) {
+            if (flash_page_is_blank((uint32_t)_sprogress / PAGE_SIZE)) {
+                flash_progress_step = PROGRESS_WRITE;
+            } else {
+                LOG("erasing progress record");
+                flash_op_started(FLASH_OP_PROGRESS, sd_flash_page_erase((uint32_t)_sprogress / PAGE_SIZE));
+            }
+        } else if (flash_progress_step == PROGRESS_WRITE) {
+            LOG("writing progress record");
+            flash_op_started(FLASH_OP_PROGRESS, sd_flash_write((uint32_t*)PROGRESS, (uint32_t*)&flash_progress_header, PROGRESS_HEADER_WORDS));
+        } else if (flash_progress_step == PROGRESS_VALID) {
+            // A range with START_FLAG_MORE keeps its mark: the image is only
+            // complete after the last range. Writing the same value again
+            // keeps the code path the same.
+            LOG("marking update as valid");
+            const uint32_t *valid = flash_progress_header.valid == PROGRESS_MORE ? &flash_progress_header.valid : &flash_progress_zero;
+            flash_op_started(FLASH_OP_PROGRESS, sd_flash_write((uint32_t*)&PROGRESS->valid, (uint32_t*)valid, 1));
+        } else if (flash_commit_pending) {
+            uint32_t index = flash_write_current_page - flash_write_start / PAGE_SIZE;
+            LOG_NUM("commit page:", flash_write_current_page);
+            flash_op_started(FLASH_OP_COMMIT, sd_flash_write((uint32_t*)&PROGRESS->committed[index], &flash_progress_zero, 1));
+#if BROADCAST
+        } else if (phase == PHASE_BROADCAST && flash_erase_current_page > flash_erase_last_page) {
+            // All pages have been erased, so chunks can be written.
+            if (!broadcast_write_chunk()) {
+                return;
+            }
+#endif
+        } else if (flash_write_current_page < flash_erase_current_page &&
+                flash_page_received(flash_write_current_page)) {
+            write_current_page();
+        } else if (flash_erase_current_page > flash_erase_last_page) {
+            // Nothing to do until more data has been received.
+            return;
+        } else if (!flash_page_is_blank(flash_erase_current_page)) {
+            erase_current_page();
+        } else {
+            LOG_NUM("already erased:", flash_erase_current_page);
+            flash_erase_skipped++;
+            flash_erase_page_done();
+        }
     }
 }
 
-// write_current_page writes the last received code page to flash. No write may
-// be in progress or an error will be sent to the client.
-static void write_current_page(void) {
-    // Determine the flash page number, which is useful for later calculations.
-    uint32_t page = (flash_write_index - 1 + APP_CODE_BASE) / PAGE_SIZE;
-    if (page != flash_write_current_page) {
-        // Previous page was not fully written.
-        // Maybe the SoftDevice couldn't schedule the page write in time?
-        LOG("previous page was not completely written");
-        ble_send_reply(STATUS_WRITE_TOO_FAST);
+// flash_erase_page_done is called when the current erase page has been erased
+// or didn't need to be erased. Once all pages have been erased, the client may
+// start sending data. In streaming mode, the client may start sending data
+// right after the first page has been erased: the other pages are erased
+// while data is being received.
+static void flash_erase_page_done(void) {
+    flash_erase_current_page++;
+    if (phase != PHASE_ERASING) {
         return;
     }
-
-    // Determine the length of the packet. Modulo would not be entirely correct
-    // here, as the length would never reach PAGE_SIZE (being zero at that
-    // point). Hence the check for zero.
-    uint32_t length = flash_write_index % PAGE_SIZE;
-    if (length == 0) {
-        length = PAGE_SIZE;
+    if (flash_streaming) {
+        phase = PHASE_STREAMING;
+    } else if (flash_erase_current_page > flash_erase_last_page) {
+        phase = PHASE_WRITING;
+    } else {
+        return;
     }
+    ble_reply_t reply = {
+        .erase_finished = {
+            .status  = STATUS_ERASE_FINISHED,
+            .erased  = flash_erase_erased,
+            .skipped = flash_erase_skipped,
+            .buffer_pages = FLASH_BUF_PAGES,
+        },
+    };
+    transport->send_reply(sizeof(reply.erase_finished), &reply);
+}
+
+// erase_current_page starts erasing the current erase page.
+static void erase_current_page(void) {
+    LOG_NUM("erasing:", flash_erase_current_page);
+    flash_op_started(FLASH_OP_ERASE, sd_flash_page_erase(flash_erase_current_page));
+}
+
+// write_current_page writes the current write page from the page buffer to
+// flash. It must have been received and erased.
+static void write_current_page(void) {
+    uint32_t page = flash_write_current_page;
+    uint32_t offset = page * PAGE_SIZE - flash_write_start;
+    uint32_t length = write_page_length(page);
 
     LOG_NUM("write page:", page);
     LOG_NUM("  length:  ", length);
-    uint32_t *p_dst = (uint32_t*)(page * PAGE_SIZE);
-    uint32_t *p_src = (uint32_t*)(flash_write_buf + (flash_write_index - 1) / PAGE_SIZE * PAGE_SIZE);
-    uint32_t err_code = sd_flash_write(p_dst, p_src, length / 4);
+    uint32_t *p_dst = FLASH_PTR(page * PAGE_SIZE);
+    uint32_t *p_src = (uint32_t*)(flash_write_buf + offset % FLASH_BUF_SIZE);
+    flash_op_started(FLASH_OP_WRITE, sd_flash_write(p_dst, p_src, length / 4));
+}
+
+// write_page_length returns how much data is written to the given page, which
+// is only less than PAGE_SIZE for the last page.
+static uint32_t write_page_length(uint32_t page) {
+    uint32_t length = flash_write_app_size - (page * PAGE_SIZE - flash_write_start);
+    if (length > PAGE_SIZE) {
+        length = PAGE_SIZE;
+    }
+    return length;
+}
+
+// flash_hash_written adds data that has been written to flash to the CRC-32
+// and, for signed updates, the SHA-256 of the update.
+static void flash_hash_written(const uint8_t *data, uint32_t len) {
+    uint32_t start_cycles = DWT->CYCCNT;
+    flash_write_crc = crc32_update(flash_write_crc, data, len);
+#if SIGNED_UPDATES
+    sha256_update(&flash_write_sha, data, len);
+#endif
+    flash_hash_cycles += DWT->CYCCNT - start_cycles;
+}
+
+#if SIGNED_UPDATES
+// flash_signature_valid returns whether the update was signed with the private
+// key that belongs to public_key.
+static int flash_signature_valid(void) {
+    if (signature_parts != (1 << (sizeof(signature) / SIGNATURE_PART_SIZE)) - 1) {
+        return 0;
+    }
+    uint32_t start_cycles = DWT->CYCCNT;
+    uint8_t hash[32];
+    sha256_final(&flash_write_sha, hash);
+    int valid = ed25519_verify(signature, hash, sizeof(hash), public_key);
+    flash_verify_cycles = DWT->CYCCNT - start_cycles;
+    return valid;
+}
+#endif
+
+// flash_op_started checks whether a flash operation was started. If the
+// SoftDevice is busy, the operation is retried later. Other errors stop the
+// update.
+static void flash_op_started(char op, uint32_t err_code) {
+    if (err_code == NRF_ERROR_BUSY) {
+        LOG("  busy, retrying later");
+        dfu_stats.busy++;
+        flash_op = FLASH_OP_BUSY;
+        return;
+    }
     if (err_code != 0) {
-        LOG_NUM("  error: could not start page write", err_code);
-        ble_send_reply(STATUS_WRITE_FAILED);
+        LOG_NUM("  error: could not start flash operation", err_code);
+        send_reply(op == FLASH_OP_ERASE ? STATUS_ERASE_FAILED : STATUS_WRITE_FAILED);
+        phase = PHASE_READY;
+        return;
+    }
+    flash_op = op;
+    stats_op_start = NRF_RTC1->COUNTER;
+}
+
+// stats_flash_op_done adds the time the flash operation that just finished
+// took to the given latency counters.
+static void stats_flash_op_done(dfu_latency_t *latency) {
+    uint32_t ticks = (NRF_RTC1->COUNTER - stats_op_start) & RTC_COUNTER_MASK;
+    if (ticks > 0xffff) {
+        ticks = 0xffff;
+    }
+    if (latency->min == 0 || ticks < latency->min) {
+        latency->min = ticks;
+    }
+    if (ticks > latency->max) {
+        latency->max = ticks;
+    }
+    latency->total += ticks;
+}
+
+// progress_committed_pages returns how many pages of the given update have
+// already been written, according to the progress record. It returns 0 if the
+// record is for a different update. The last page is never reported as
+// committed, so that the client always has something to send.
+static uint32_t progress_committed_pages(uint32_t start, uint32_t length, uint32_t image_crc) {
+    const progress_t *progress = PROGRESS;
+    if (progress->magic != PROGRESS_MAGIC || progress->start != start ||
+            progress->length != length || progress->image_crc != image_crc) {
+        return 0;
+    }
+    uint32_t pages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t committed = 0;
+    while (committed < pages - 1 && progress->committed[committed] == 0) {
+        committed++;
+    }
+    LOG_NUM("resume at page:", committed);
+    return committed;
+}
+
+// app_image_valid returns whether the last update was finished and its CRC-32
+// was checked. Normally this is cached in the progress record, so booting
+// stays fast. If the record isn't marked as valid (for example when the
+// update was interrupted), the CRC-32 of the update is checked instead. An
+// application that wasn't installed by the bootloader has no progress record
+// and is assumed to be valid. Bootloaders that only accept signed updates don't
+// fall back to the CRC-32. If the last range that was written had
+// START_FLAG_MORE, the rest of the image is missing.
+static int app_image_valid(void) {
+    const progress_t *progress = PROGRESS;
+    if (progress->magic != PROGRESS_MAGIC || progress->valid == 0) {
+        return 1;
+    }
+    if (progress->valid == PROGRESS_MORE) {
+        LOG("update has more ranges");
+        return 0;
+    }
+#if SIGNED_UPDATES
+    // Only a valid signature can mark an update as valid.
+    return 0;
+#else
+    LOG("checking image CRC");
+    return crc32_update(0, FLASH_PTR(progress->start), progress->length) == progress->image_crc;
+#endif
+}
+
+#if SIMULATOR
+// sim_app_image_valid lets the simulator check whether the updated
+// application would be started.
+int sim_app_image_valid(void) {
+    return app_image_valid();
+}
+#endif
+
+// send_credit tells the client how much data has been written to flash, and
+// thus how much more data it may send. If the notification can't be sent now,
+// it is sent again once there is room in the notification queue.
+static void send_credit(void) {
+    ble_reply_t reply = {
+        .credit = {
+            .status      = STATUS_CREDIT,
+            .committed   = flash_write_current_page * PAGE_SIZE - flash_write_start,
+            .buffer_size = FLASH_BUF_SIZE,
+        },
+    };
+    flash_credit_pending = transport->send_reply(sizeof(reply.credit), &reply) != 0;
+}
+
+// send_page_hashes replies with the CRC-32 of the given number of pages,
+// starting at the given address. The client can compare these to the pages of
+// the new firmware, and only send the pages that changed.
+// Fewer hashes are sent if they don't fit in a single notification or if the
+// range would include the progress record or bootloader.
+static void send_page_hashes(uint32_t start, uint32_t count) {
+    if (start < APP_CODE_BASE || start % PAGE_SIZE != 0 || start >= (uint32_t)_sprogress) {
+        send_reply(STATUS_INVALID_ERASE_START);
         return;
     }
+    // The page buffer may hold chunks of a broadcast that is still going on,
+    // so the reply is built on the stack.
+    uint8_t buf[SERIAL_FRAME_SIZE - 4] __attribute__((aligned(4))); // the largest reply of any transport
+    ble_reply_t *reply = (ble_reply_t*)buf;
+    uint32_t max_count = (transport->mtu - 3 - 4) / 4;
+    if (max_count > (sizeof(buf) - sizeof(reply->page_hashes)) / 4) {
+        max_count = (sizeof(buf) - sizeof(reply->page_hashes)) / 4;
+    }
+    if (count > max_count) {
+        count = max_count;
+    }
+    if (count > ((uint32_t)_sprogress - start) / PAGE_SIZE) {
+        count = ((uint32_t)_sprogress - start) / PAGE_SIZE;
+    }
+
+    reply->page_hashes.status = STATUS_PAGE_HASHES;
+    reply->page_hashes.count = count;
+    for (uint32_t i = 0; i < count; i++) {
+        reply->page_hashes.crc[i] = crc32_update(0, FLASH_PTR(start + i * PAGE_SIZE), PAGE_SIZE);
+    }
+    transport->send_reply(sizeof(reply->page_hashes) + count * 4, reply);
+}
+
+// send_stats sends the performance counters, starting at the given offset in
+// dfu_stats_t. The client must ask for the rest if they don't fit in a single
+// notification.
+static void send_stats(uint32_t offset) {
+    uint8_t buf[sizeof(ble_reply_t) + sizeof(dfu_stats_t)] __attribute__((aligned(4)));
+    ble_reply_t *reply = (ble_reply_t*)buf;
+    dfu_stats.att_mtu = transport->mtu;
+    dfu_stats.phy = transport->phy;
+    if (offset > sizeof(dfu_stats)) {
+        offset = sizeof(dfu_stats);
+    }
+    uint32_t length = sizeof(dfu_stats) - offset;
+    if (length > transport->mtu - 3u - sizeof(reply->stats)) {
+        length = transport->mtu - 3u - sizeof(reply->stats);
+    }
+    reply->stats.status = STATUS_STATS;
+    reply->stats.offset = offset;
+    reply->stats.length = length;
+    memcpy(reply->stats.data, (const uint8_t*)&dfu_stats + offset, length);
+    transport->send_reply(sizeof(reply->stats) + length, reply);
 }
@@ -0,0 +1,207 @@
+// This file implements the serial transport: the commands, data and replies
+// of the BLE service as frames (see SERIAL_MAGIC in dfu.h) over the UART at
+// 1Mbaud with hardware flow control, for example on a factory fixture.
+// Frames from the client are received with UARTE EasyDMA, into two buffers:
+// the next frame is received into one while the other is handled. Between two
+// frames, the UARTE keeps the incoming bytes in its FIFO and flow control
+// holds up the client, so nothing is lost while the next transfer is started.
+// Replies are queued and sent with EasyDMA as well.
+// UARTE events are handled in dfu_run, like those of the SoftDevice. The
+// interrupts are only enabled in the peripheral, not in the NVIC: with
+// SEVONPEND, becoming pending is enough to wake up sd_app_evt_wait.
+
+#include <string.h>
+#include "nrf_soc.h"
+#include "nrf_nvic.h"
+#include "dfu.h"
+
+#if DEBUG
+#error The serial transport uses the UART of the debug trace, build it with DEBUG=0
+#endif
+
+// Pins of the UART. On the development kits, this is the UART of the
+// interface MCU, which is available over USB.
+#if defined(PCA10040) || defined(PCA10056)
+#define SERIAL_PIN_TXD (6) // P0.06
+#define SERIAL_PIN_RXD (8) // P0.08
+#define SERIAL_PIN_RTS (5) // P0.05
+#define SERIAL_PIN_CTS (7) // P0.07
+#else
+#error Setup UART pins for the serial transport
+#endif
+
+#define SERIAL_TX_QUEUE (4) // replies that can be queued, like BLE_HVN_QUEUE_SIZE
+
+static uint32_t serial_send_reply(uint16_t data_len, const void *data);
+static void serial_disconnect(void);
+
+transport_t serial_transport = {
+    .send_reply = serial_send_reply,
+    .disconnect = serial_disconnect,
+    .mtu        = SERIAL_FRAME_SIZE - 4 + 3, // see transport_t
+    .phy        = 0,
+};
+
+// States of the receiver.
+enum {
+    SERIAL_RX_SYNC,  // looking for SERIAL_SYNC, one byte at a time
+    SERIAL_RX_MAGIC, // SERIAL_SYNC was seen, looking for SERIAL_MAGIC
+    SERIAL_RX_FRAME, // receiving whole frames
+};
+
+static uint8_t  serial_rx_buf[2][SERIAL_FRAME_SIZE] __attribute__((aligned(4)));
+static uint8_t  serial_rx_state;
+static uint8_t  serial_rx_index; // buffer that the DMA writes to
+static uint8_t  serial_tx_buf[SERIAL_TX_QUEUE][SERIAL_FRAME_SIZE] __attribute__((aligned(4)));
+static uint16_t serial_tx_len[SERIAL_TX_QUEUE];
+static uint32_t serial_tx_head;  // number of replies queued
+static uint32_t serial_tx_tail;  // number of replies sent
+static uint8_t  serial_tx_busy;  // the reply at serial_tx_tail is being sent
+static uint8_t  serial_closing;  // end the session once all replies have been sent
+
+// serial_start_rx starts receiving length bytes into buf.
+static void serial_start_rx(uint8_t *buf, uint32_t length) {
+    NRF_UARTE0->RXD.PTR    = (uint32_t)buf;
+    NRF_UARTE0->RXD.MAXCNT = length;
+    NRF_UARTE0->TASKS_STARTRX = 1;
+}
+
+// serial_start_tx sends the next reply in the queue, if there is one and the
+// previous one has been sent.
+static void serial_start_tx(void) {
+    if (serial_tx_busy || serial_tx_head == serial_tx_tail) {
+        return;
+    }
+    NRF_UARTE0->TXD.PTR    = (uint32_t)serial_tx_buf[serial_tx_tail % SERIAL_TX_QUEUE];
+    NRF_UARTE0->TXD.MAXCNT = serial_tx_len[serial_tx_tail % SERIAL_TX_QUEUE];
+    NRF_UARTE0->TASKS_STARTTX = 1;
+    serial_tx_busy = 1;
+}
+
+void serial_init(void) {
+    NRF_UARTE0->PSEL.TXD = SERIAL_PIN_TXD;
+    NRF_UARTE0->PSEL.RXD = SERIAL_PIN_RXD;
+    NRF_UARTE0->PSEL.RTS = SERIAL_PIN_RTS;
+    NRF_UARTE0->PSEL.CTS = SERIAL_PIN_CTS;
+    NRF_UARTE0->BAUDRATE = UARTE_BAUDRATE_BAUDRATE_Baud1M;
+    NRF_UARTE0->CONFIG   = UARTE_CONFIG_HWFC_Enabled << UARTE_CONFIG_HWFC_Pos;
+    NRF_UARTE0->ENABLE   = UARTE_ENABLE_ENABLE_Enabled;
+    NRF_UARTE0->INTENSET = UARTE_INTENSET_ENDRX_Msk | UARTE_INTENSET_ENDTX_Msk | UARTE_INTENSET_ERROR_Msk;
+    SCB->SCR |= SCB_SCR_SEVONPEND_Msk;
+
+    serial_rx_state = SERIAL_RX_SYNC;
+    serial_start_rx(serial_rx_buf[0], 1);
+}
+
+// serial_resync ends the session, as the start of the next frame isn't known
+// anymore. The receiver looks for SERIAL_SYNC again, which the client sends
+// when it starts a new session.
+static void serial_resync(void) {
+    NRF_UARTE0->TASKS_STOPRX = 1;
+    while (!NRF_UARTE0->EVENTS_RXTO) {}
+    NRF_UARTE0->EVENTS_RXTO = 0;
+    NRF_UARTE0->EVENTS_ENDRX = 0;
+    serial_rx_state = SERIAL_RX_SYNC;
+    serial_rx_index = 0;
+    serial_start_rx(serial_rx_buf[0], 1);
+    handle_disconnect(&serial_transport);
+}
+
+// serial_handle_frame passes a frame from the client on to main.c.
+static void serial_handle_frame(uint8_t *frame) {
+    uint16_t length = frame[2] | (frame[3] << 8);
+    if (frame[0] != SERIAL_MAGIC || length > SERIAL_FRAME_SIZE - 4) {
+        serial_resync();
+        return;
+    }
+    if (frame[1] == SERIAL_FRAME_COMMAND) {
+        handle_command(&serial_transport, length, (ble_command_t*)&frame[4]);
+    } else if (frame[1] == SERIAL_FRAME_DATA) {
+        handle_data(&serial_transport, length, &frame[4]);
+    }
+}
+
+// serial_received handles the end of a receive transfer.
+static void serial_received(void) {
+    uint8_t *buf = serial_rx_buf[serial_rx_index];
+    switch (serial_rx_state) {
+    case SERIAL_RX_SYNC:
+        if (buf[0] == SERIAL_SYNC) {
+            serial_rx_state = SERIAL_RX_MAGIC;
+        }
+        serial_start_rx(buf, 1);
+        break;
+    case SERIAL_RX_MAGIC:
+        if (buf[0] == SERIAL_MAGIC) {
+            // The first frame of a session, receive the rest of it.
+            serial_rx_state = SERIAL_RX_FRAME;
+            serial_start_rx(buf + 1, SERIAL_FRAME_SIZE - 1);
+        } else {
+            if (buf[0] != SERIAL_SYNC) {
+                serial_rx_state = SERIAL_RX_SYNC;
+            }
+            serial_start_rx(buf, 1);
+        }
+        break;
+    case SERIAL_RX_FRAME:
+        // Receive the next frame while this one is handled.
+        serial_rx_index ^= 1;
+        serial_start_rx(serial_rx_buf[serial_rx_index], SERIAL_FRAME_SIZE);
+        serial_handle_frame(buf);
+        break;
+    }
+}
+
+// serial_poll handles the UARTE events that came in, see dfu_run.
+void serial_poll(void) {
+    // Clear the interrupt first, so that an event that happens while the
+    // others are handled wakes up sd_app_evt_wait again.
+    sd_nvic_ClearPendingIRQ(UARTE0_UART0_IRQn);
+
+    if (NRF_UARTE0->EVENTS_ERROR) {
+        // A break, framing error or overrun: the data can't be trusted.
+        NRF_UARTE0->EVENTS_ERROR = 0;
+        NRF_UARTE0->ERRORSRC = NRF_UARTE0->ERRORSRC; // write 1 to clear
+        serial_resync();
+    } else if (NRF_UARTE0->EVENTS_ENDRX) {
+        NRF_UARTE0->EVENTS_ENDRX = 0;
+        serial_received();
+    }
+
+    if (NRF_UARTE0->EVENTS_ENDTX) {
+        NRF_UARTE0->EVENTS_ENDTX = 0;
+        serial_tx_busy = 0;
+        serial_tx_tail++;
+        serial_start_tx();
+        handle_notification_sent();
+    }
+
+    if (serial_closing && serial_tx_head == serial_tx_tail) {
+        // Everything has been sent, for example the reply to COMMAND_RESET.
+        serial_closing = 0;
+        serial_resync();
+    }
+}
+
+// serial_send_reply queues a reply frame. It returns an error code when the
+// queue is full.
+static uint32_t serial_send_reply(uint16_t data_len, const void *data) {
+    if (serial_tx_head - serial_tx_tail == SERIAL_TX_QUEUE || data_len > SERIAL_FRAME_SIZE - 4) {
+        return NRF_ERROR_RESOURCES;
+    }
+    uint8_t *frame = serial_tx_buf[serial_tx_head % SERIAL_TX_QUEUE];
+    frame[0] = SERIAL_MAGIC;
+    frame[1] = SERIAL_FRAME_REPLY;
+    frame[2] = data_len;
+    frame[3] = data_len >> 8;
+    memcpy(&frame[4], data, data_len);
+    serial_tx_len[serial_tx_head % SERIAL_TX_QUEUE] = 4 + data_len;
+    serial_tx_head++;
+    serial_start_tx();
+    return NRF_SUCCESS;
+}
+
+// serial_disconnect ends the session once the queued replies have been sent.
+static void serial_disconnect(void) {
+    serial_closing = 1;
+}
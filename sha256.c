@@ -0,0 +1,91 @@
+// This file implements SHA-256 (FIPS 180-4), optimized for size. It is used to
+// hash signed updates while they are being written to flash.
+
+#include "dfu.h"
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t ror(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+// sha256_block processes the 64 byte block in ctx->buf. The message schedule
+// is kept in a 16 word ring to save stack space.
+static void sha256_block(sha256_t *ctx) {
+    uint32_t w[16];
+    uint32_t s[8];
+    for (int i = 0; i < 8; i++) {
+        s[i] = ctx->state[i];
+    }
+    for (int i = 0; i < 64; i++) {
+        if (i < 16) {
+            const uint8_t *p = &ctx->buf[i * 4];
+            w[i] = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+        } else {
+            uint32_t w15 = w[(i - 15) % 16];
+            uint32_t w2 = w[(i - 2) % 16];
+            w[i % 16] += (ror(w15, 7) ^ ror(w15, 18) ^ (w15 >> 3)) + w[(i - 7) % 16] +
+                         (ror(w2, 17) ^ ror(w2, 19) ^ (w2 >> 10));
+        }
+        uint32_t t1 = s[7] + (ror(s[4], 6) ^ ror(s[4], 11) ^ ror(s[4], 25)) +
+                      ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i % 16];
+        uint32_t t2 = (ror(s[0], 2) ^ ror(s[0], 13) ^ ror(s[0], 22)) +
+                      ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+        for (int j = 7; j > 0; j--) {
+            s[j] = s[j - 1];
+        }
+        s[4] += t1;
+        s[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; i++) {
+        ctx->state[i] += s[i];
+    }
+}
+
+// sha256_init starts a new hash.
+void sha256_init(sha256_t *ctx) {
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    for (int i = 0; i < 8; i++) {
+        ctx->state[i] = initial[i];
+    }
+    ctx->length = 0;
+}
+
+// sha256_update adds data to the hash.
+void sha256_update(sha256_t *ctx, const uint8_t *data, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        ctx->buf[ctx->length % 64] = data[i];
+        ctx->length++;
+        if (ctx->length % 64 == 0) {
+            sha256_block(ctx);
+        }
+    }
+}
+
+// sha256_final finishes the hash and stores it in hash.
+void sha256_final(sha256_t *ctx, uint8_t hash[32]) {
+    uint64_t bits = (uint64_t)ctx->length * 8;
+    uint8_t pad = 0x80;
+    do {
+        sha256_update(ctx, &pad, 1);
+        pad = 0;
+    } while (ctx->length % 64 != 56);
+    for (int i = 0; i < 8; i++) {
+        uint8_t b = bits >> (56 - i * 8);
+        sha256_update(ctx, &b, 1);
+    }
+    for (int i = 0; i < 32; i++) {
+        hash[i] = ctx->state[i / 4] >> (24 - i % 4 * 8);
+    }
+}
@@ -0,0 +1,460 @@
+
+// This file implements the scripted DFU client of the host simulator, and its
+// main function. The client does what dfuclient does: it starts an update,
+// sends the image as fast as the credits and the radio allow, and resets the
+// bootloader once the update has been written. It then checks the flash
+// contents and prints how much simulated time each phase of the session took.
+// Everything is deterministic, so the same options always give the same
+// result.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ble_gap.h"
+
+#include "dfu.h"
+#include "sim.h"
+
+#define MIN_POLL_INTERVAL (20 * 1000)    // see the pacer in dfuclient
+#define MAX_POLL_INTERVAL (200 * 1000)
+#define SESSION_LIMIT  (600 * 1000 * 1000) // give up after 10 simulated minutes
+#define MAX_MISSING    (32)
+
+// Phases of a session. The time spent in each is reported at the end.
+enum {
+    SESSION_CONNECTING, // connecting (again) and starting the update
+    SESSION_ERASING,    // waiting for STATUS_ERASE_FINISHED
+    SESSION_SENDING,    // sending the image
+    SESSION_FINISHING,  // everything was sent, waiting for STATUS_WRITE_FINISHED
+    SESSION_RESETTING,
+    SESSION_PHASES,
+};
+static const char *session_phase_names[SESSION_PHASES] = {"connect", "erase", "transfer", "finish", "reset"};
+
+// Options.
+static uint8_t *image;
+static uint32_t image_len;
+static uint32_t start_addr = SIM_APP_CODE_BASE;
+static uint8_t  start_flags = START_FLAG_STREAM;
+static uint16_t client_mtu = 247;
+static uint8_t  client_phys = BLE_GAP_PHY_1MBPS | BLE_GAP_PHY_2MBPS;
+static uint32_t drop_at;               // lose the connection once this much has been sent (0: never)
+static uint32_t reconnect_time = 300 * 1000;
+static uint8_t  signature[64];
+static uint8_t  has_signature;
+static uint8_t  verbose;
+
+// Session state.
+static uint8_t  session_phase;
+static uint64_t phase_start;
+static uint64_t phase_time[SESSION_PHASES];
+static uint8_t  started;               // COMMAND_START was sent on this connection
+static uint8_t  offsets;               // the bootloader accepted START_FLAG_OFFSETS
+static uint16_t max_data_len;
+static uint32_t sent;                  // image data sent so far
+static uint32_t credit_limit;          // how far the client may send
+static uint32_t missing[MAX_MISSING][2]; // ranges reported by STATUS_DATA_MISSING
+static uint32_t missing_count;
+static uint32_t resent;                // bytes sent again
+static uint32_t credits;
+static uint32_t erased;
+static uint32_t skipped;
+static uint32_t reconnects;
+static uint64_t reconnect_at;
+static uint64_t last_activity;         // last notification or poll
+static uint8_t  poll_now;              // a missing range was sent again, ask for the next one
+static uint64_t poll_sent;             // poll that hasn't been answered yet (0: none)
+static uint64_t reply_time;            // moving average of the time until a poll is answered
+
+static void set_phase(uint8_t phase) {
+    phase_time[session_phase] += sim_now - phase_start;
+    session_phase = phase;
+    phase_start = sim_now;
+}
+
+// report prints what happened during the session and exits. The exit status
+// is 0 if the update was written correctly and the bootloader would start it.
+static void report(const char *error) __attribute__((noreturn));
+static void report(const char *error) {
+    set_phase(session_phase);
+    printf("image:      %u bytes at 0x%05x%s%s%s%s\n", image_len, start_addr,
+           start_flags & START_FLAG_STREAM ? ", stream" : "",
+           offsets ? ", offsets" : "",
+           has_signature ? ", signed" : "",
+           start_flags & START_FLAG_MORE ? ", more ranges" : "");
+    printf("link:       %uM PHY, ATT MTU %u, %.2fms interval, %u packets/event\n",
+           sim_phy(), max_data_len + 3, sim_config.conn_interval / 1000.0, sim_packets_per_event());
+    for (int i = 0; i < SESSION_PHASES; i++) {
+        printf("%-10s %10.3fms", session_phase_names[i], phase_time[i] / 1000.0);
+        if (i == SESSION_CONNECTING && reconnects) {
+            printf("  %u reconnects", reconnects);
+        } else if (i == SESSION_ERASING) {
+            printf("  %u pages erased, %u skipped", erased, skipped);
+        } else if (i == SESSION_SENDING) {
+            printf("  %u packets, %u lost, %u bytes sent again, %u credits", sim_stats.packets, sim_stats.lost, resent, credits);
+        }
+        printf("\n");
+    }
+    printf("total:      %10.3fms  %.1f kB/s\n", sim_now / 1000.0, sim_now ? image_len * 1000.0 / sim_now : 0);
+    printf("flash:      %u erases (%.1fms), %u writes (%.1fms), %u busy\n",
+           sim_stats.erases, sim_stats.erase_time / 1000.0, sim_stats.writes, sim_stats.write_time / 1000.0, sim_stats.busy);
+    printf("notify:     %u sent, %u refused (queue full)\n", sim_stats.notifications, sim_stats.hvn_full);
+    if (error) {
+        printf("result:     %s\n", error);
+        exit(1);
+    }
+    if (memcmp(&sim_flash[start_addr], image, image_len) != 0) {
+        printf("result:     flash contents differ from the image\n");
+        exit(1);
+    }
+    if (start_flags & START_FLAG_MORE) {
+        // The rest of the image is missing, so it must not be started.
+        if (sim_app_image_valid()) {
+            printf("result:     range written, but the bootloader would start the incomplete image\n");
+            exit(1);
+        }
+    } else if (!sim_app_image_valid()) {
+        printf("result:     image written, but the bootloader would not start it\n");
+        exit(1);
+    }
+    printf("result:     ok\n");
+    exit(0);
+}
+
+// send_start starts (or resumes) the update.
+static void send_start(void) {
+    if (has_signature) {
+        for (uint8_t offset = 0; offset < sizeof(signature); offset += SIGNATURE_PART_SIZE) {
+            ble_command_t cmd = {
+                .signature = {
+                    .command = COMMAND_SIGNATURE,
+                    .offset  = offset,
+                },
+            };
+            memcpy(cmd.signature.data, &signature[offset], SIGNATURE_PART_SIZE);
+            sim_write_command(&cmd, sizeof(cmd.signature));
+        }
+    }
+    ble_command_t cmd = {
+        .start = {
+            .command   = COMMAND_START,
+            .flags     = start_flags | (reconnects ? START_FLAG_RESUME : 0),
+            .startAddr = start_addr,
+            .length    = image_len,
+            .image_crc = crc32_update(0, image, image_len),
+        },
+    };
+    if (!sim_write_command(&cmd, sizeof(cmd.start))) {
+        report("could not send COMMAND_START");
+    }
+    started = 1;
+    set_phase(SESSION_ERASING);
+}
+
+// poll_timeout returns how long to wait for a reply before polling for
+// missing data, like pacer.pollTimeout in dfuclient.
+static uint64_t poll_timeout(void) {
+    if (reply_time == 0) {
+        return MAX_POLL_INTERVAL;
+    }
+    uint64_t timeout = 4 * reply_time;
+    if (timeout < MIN_POLL_INTERVAL) {
+        return MIN_POLL_INTERVAL;
+    }
+    if (timeout > MAX_POLL_INTERVAL) {
+        return MAX_POLL_INTERVAL;
+    }
+    return timeout;
+}
+
+// send_data sends as much data as the credits and the connection event allow.
+// With START_FLAG_OFFSETS, missing data is sent first.
+static void send_data(void) {
+    uint8_t packet[256];
+    while (1) {
+        if (drop_at && sent >= drop_at) {
+            if (verbose) {
+                fprintf(stderr, "%10.3fms  connection lost at %u\n", sim_now / 1000.0, sent);
+            }
+            drop_at = 0;
+            sim_disconnect();
+            started = 0;
+            reconnects++;
+            reconnect_at = sim_now + reconnect_time;
+            set_phase(SESSION_CONNECTING);
+            return;
+        }
+        if (!offsets) {
+            uint32_t end = credit_limit < image_len ? credit_limit : image_len;
+            if (sent >= end) {
+                break;
+            }
+            uint32_t len = max_data_len;
+            if (len > end - sent) {
+                len = end - sent;
+            }
+            if (!sim_write_data(&image[sent], len)) {
+                return;
+            }
+            sent += len;
+            continue;
+        }
+
+        uint32_t chunk = (max_data_len - 4) / DATA_BLOCK_SIZE * DATA_BLOCK_SIZE;
+        uint32_t offset, end;
+        if (missing_count) {
+            offset = missing[0][0];
+            end = missing[0][1];
+        } else if (sent < image_len && sent < credit_limit) {
+            offset = sent;
+            end = credit_limit < image_len ? credit_limit : image_len;
+        } else {
+            break;
+        }
+        if (end - offset > chunk) {
+            end = offset + chunk;
+        }
+        memcpy(packet, &offset, 4);
+        memcpy(&packet[4], &image[offset], end - offset);
+        if (!sim_write_data(packet, 4 + end - offset)) {
+            return;
+        }
+        if (missing_count) {
+            resent += end - offset;
+            missing[0][0] = end;
+            if (missing[0][0] == missing[0][1]) {
+                missing_count--;
+                memmove(&missing[0], &missing[1], missing_count * sizeof(missing[0]));
+                poll_now = missing_count == 0;
+            }
+        } else {
+            sent = end;
+        }
+    }
+
+    if (sent == image_len && session_phase == SESSION_SENDING && !missing_count) {
+        set_phase(SESSION_FINISHING);
+    }
+    if (offsets && (poll_now || sim_now - last_activity >= poll_timeout())) {
+        // Nothing happened for a while, maybe a packet at the end got lost.
+        // After a gap has been filled, ask for the next one right away.
+        uint32_t offset = sent;
+        if (sim_write_data(&offset, 4)) {
+            last_activity = sim_now;
+            poll_sent = sim_now;
+            poll_now = 0;
+        }
+    }
+}
+
+// sim_client_tick is called at every connection interval.
+void sim_client_tick(void) {
+    if (sim_now > SESSION_LIMIT) {
+        report("timeout");
+    }
+    if (!sim_connected()) {
+        if (sim_now >= reconnect_at && sim_connect(client_mtu, client_phys) && verbose) {
+            fprintf(stderr, "%10.3fms  connected\n", sim_now / 1000.0);
+        }
+        return;
+    }
+    if (!started) {
+        // Start in the connection event after connecting, once the ATT MTU
+        // and PHY have been negotiated.
+        send_start();
+    } else if (session_phase == SESSION_SENDING || session_phase == SESSION_FINISHING) {
+        send_data();
+    }
+}
+
+// sim_client_notify handles a notification from the bootloader.
+void sim_client_notify(const uint8_t *data, uint16_t len) {
+    ble_reply_t reply;
+    memset(&reply, 0, sizeof(reply));
+    memcpy(&reply, data, len < sizeof(reply) ? len : sizeof(reply));
+    if (verbose) {
+        fprintf(stderr, "%10.3fms  status 0x%02x (%u bytes)\n", sim_now / 1000.0, reply.any.status, len);
+    }
+    last_activity = sim_now;
+    switch (reply.any.status) {
+    case STATUS_ERASE_STARTED:
+        max_data_len = reply.erase_started.max_data_len;
+        offsets = (reply.erase_started.flags & START_FLAG_OFFSETS) != 0;
+        sent = reply.erase_started.resume_offset;
+        missing_count = 0;
+        if ((reply.erase_started.flags & START_FLAG_SIGNED) && !has_signature) {
+            printf("warning: the bootloader only accepts signed updates\n");
+        }
+        break;
+    case STATUS_ERASE_FINISHED:
+        erased += reply.erase_finished.erased;
+        skipped += reply.erase_finished.skipped;
+        credit_limit = sent + reply.erase_finished.buffer_pages * SIM_PAGE_SIZE;
+        set_phase(SESSION_SENDING);
+        break;
+    case STATUS_CREDIT:
+        credits++;
+        credit_limit = reply.credit.committed + reply.credit.buffer_size;
+        break;
+    case STATUS_DATA_MISSING: {
+        if (poll_sent) {
+            uint64_t sample = sim_now - poll_sent;
+            reply_time = reply_time ? reply_time + ((int64_t)sample - (int64_t)reply_time) / 4 : sample;
+            poll_sent = 0;
+        }
+        uint32_t end = reply.data_missing.offset + reply.data_missing.length;
+        if (end > sent) {
+            end = sent;
+        }
+        if (reply.data_missing.offset < end && missing_count < MAX_MISSING) {
+            missing[missing_count][0] = reply.data_missing.offset;
+            missing[missing_count][1] = end;
+            missing_count++;
+            if (session_phase == SESSION_FINISHING) {
+                set_phase(SESSION_SENDING);
+            }
+        }
+        break;
+    }
+    case STATUS_WRITE_FINISHED: {
+        set_phase(SESSION_RESETTING);
+        ble_command_t cmd = {
+            .any = {
+                .command = COMMAND_RESET,
+            },
+        };
+        sim_write_command(&cmd, sizeof(cmd.any));
+        break;
+    }
+    default: {
+        char error[32];
+        snprintf(error, sizeof(error), "status 0x%02x", reply.any.status);
+        report(error);
+    }
+    }
+}
+
+// sim_client_reset is called when the bootloader resets, which ends the
+// session.
+void sim_client_reset(void) {
+    if (session_phase != SESSION_RESETTING) {
+        report("unexpected reset");
+    }
+    report(NULL);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [options]\n", name);
+    fprintf(stderr, "  -size n          send a generated image of n bytes (default 102400)\n");
+    fprintf(stderr, "  -image file      send this binary image instead\n");
+    fprintf(stderr, "  -addr a          start address (default 0x%x)\n", SIM_APP_CODE_BASE);
+    fprintf(stderr, "  -erased          start with erased flash instead of an old image\n");
+    fprintf(stderr, "  -no-stream       wait for the whole range to be erased\n");
+    fprintf(stderr, "  -offsets         send data packets with their offset\n");
+    fprintf(stderr, "  -more            send the image as a range that more ranges follow\n");
+    fprintf(stderr, "  -signature hex   send this signature before starting\n");
+    fprintf(stderr, "  -mtu n           ATT MTU of the client (default 247)\n");
+    fprintf(stderr, "  -phy n           1 if the client only supports the 1M PHY (default 2)\n");
+    fprintf(stderr, "  -drop n          lose the connection after sending n bytes, then resume\n");
+    fprintf(stderr, "  -v               print notifications as they arrive\n");
+    sim_config_usage();
+    exit(2);
+}
+
+static void read_image(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        exit(2);
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    // The length must be a multiple of 4, pad like an erased flash.
+    image_len = (size + 3) / 4 * 4;
+    image = malloc(image_len);
+    memset(image, 0xff, image_len);
+    if (fread(image, 1, size, f) != (size_t)size) {
+        perror(path);
+        exit(2);
+    }
+    fclose(f);
+}
+
+int main(int argc, char **argv) {
+    const char *image_path = NULL;
+    uint32_t size = 102400;
+    uint8_t erased_flash = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (!strcmp(arg, "-erased")) {
+            erased_flash = 1;
+        } else if (!strcmp(arg, "-no-stream")) {
+            start_flags &= ~START_FLAG_STREAM;
+        } else if (!strcmp(arg, "-offsets")) {
+            start_flags |= START_FLAG_OFFSETS;
+        } else if (!strcmp(arg, "-more")) {
+            start_flags |= START_FLAG_MORE;
+        } else if (!strcmp(arg, "-v")) {
+            verbose = 1;
+        } else if (i + 1 == argc) {
+            usage(argv[0]);
+        } else if (!strcmp(arg, "-image")) {
+            image_path = argv[++i];
+        } else if (!strcmp(arg, "-signature")) {
+            const char *hex = argv[++i];
+            if (strlen(hex) != sizeof(signature) * 2) {
+                usage(argv[0]);
+            }
+            for (uint32_t j = 0; j < sizeof(signature); j++) {
+                sscanf(&hex[j * 2], "%2hhx", &signature[j]);
+            }
+            has_signature = 1;
+        } else {
+            uint32_t value = strtoul(argv[++i], NULL, 0);
+            if (!strcmp(arg, "-size")) {
+                size = value;
+            } else if (!strcmp(arg, "-addr")) {
+                start_addr = value;
+            } else if (!strcmp(arg, "-mtu")) {
+                client_mtu = value;
+            } else if (!strcmp(arg, "-phy")) {
+                client_phys = value == 1 ? BLE_GAP_PHY_1MBPS : BLE_GAP_PHY_1MBPS | BLE_GAP_PHY_2MBPS;
+            } else if (!strcmp(arg, "-drop")) {
+                drop_at = value;
+            } else if (!sim_config_option(arg, value)) {
+                usage(argv[0]);
+            }
+        }
+    }
+
+    if (image_path) {
+        read_image(image_path);
+    } else {
+        image_len = size;
+        image = malloc(image_len);
+        for (uint32_t i = 0; i < image_len; i++) {
+            image[i] = sim_prng();
+        }
+    }
+    if (start_addr + image_len > SIM_FLASH_SIZE) {
+        fprintf(stderr, "image doesn't fit in flash\n");
+        return 2;
+    }
+
+    // Erased flash with the SoftDevice information structure, which tells
+    // the bootloader where the application starts, and unless -erased an
+    // old application.
+    memset(sim_flash, 0xff, sizeof(sim_flash));
+    uint32_t app_code_base = SIM_APP_CODE_BASE;
+    memcpy(&sim_flash[0x3008], &app_code_base, 4);
+    if (!erased_flash) {
+        for (uint32_t i = start_addr; i < start_addr + image_len; i++) {
+            sim_flash[i] = sim_prng();
+        }
+    }
+
+    ble_init();
+    dfu_run();
+}
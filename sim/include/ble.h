@@ -0,0 +1,73 @@
+// Stand-in for the SoftDevice ble.h, used by the simulator (see sim/).
+
+#pragma once
+
+#include <stdint.h>
+#include "nrf_svc.h"
+#include "nrf_error.h"
+#include "ble_types.h"
+#include "ble_hci.h"
+#include "ble_gap.h"
+#include "ble_gatt.h"
+#include "ble_gatts.h"
+
+#define BLE_CONN_CFG_TAG_DEFAULT 0
+
+#define BLE_CONN_CFG_BASE 0x20
+enum BLE_CONN_CFGS {
+    BLE_CONN_CFG_GAP = BLE_CONN_CFG_BASE,
+    BLE_CONN_CFG_GATTC,
+    BLE_CONN_CFG_GATTS,
+    BLE_CONN_CFG_GATT,
+    BLE_CONN_CFG_L2CAP,
+};
+
+#define BLE_COMMON_OPT_BASE 0x01
+enum BLE_COMMON_OPTS {
+    BLE_COMMON_OPT_PA_LNA = BLE_COMMON_OPT_BASE,
+    BLE_COMMON_OPT_CONN_EVT_EXT,
+};
+
+typedef struct {
+    uint16_t evt_id;
+    uint16_t evt_len;
+} ble_evt_hdr_t;
+
+typedef struct {
+    ble_evt_hdr_t header;
+    union {
+        ble_gap_evt_t   gap_evt;
+        ble_gatts_evt_t gatts_evt;
+    } evt;
+} ble_evt_t;
+
+typedef struct {
+    uint8_t conn_cfg_tag;
+    union {
+        ble_gap_conn_cfg_t   gap_conn_cfg;
+        ble_gatts_conn_cfg_t gatts_conn_cfg;
+        ble_gatt_conn_cfg_t  gatt_conn_cfg;
+    } params;
+} ble_conn_cfg_t;
+
+typedef union {
+    ble_conn_cfg_t conn_cfg;
+} ble_cfg_t;
+
+typedef struct {
+    uint8_t enable : 1;
+} ble_common_opt_conn_evt_ext_t;
+
+typedef struct {
+    ble_common_opt_conn_evt_ext_t conn_evt_ext;
+} ble_common_opt_t;
+
+typedef union {
+    ble_common_opt_t common_opt;
+} ble_opt_t;
+
+SVCALL(SD_BLE_ENABLE, uint32_t, sd_ble_enable(uint32_t *p_app_ram_base));
+SVCALL(SD_BLE_CFG_SET, uint32_t, sd_ble_cfg_set(uint32_t cfg_id, ble_cfg_t const *p_cfg, uint32_t app_ram_base));
+SVCALL(SD_BLE_OPT_SET, uint32_t, sd_ble_opt_set(uint32_t opt_id, ble_opt_t const *p_opt));
+SVCALL(SD_BLE_EVT_GET, uint32_t, sd_ble_evt_get(uint8_t *p_dest, uint16_t *p_len));
+SVCALL(SD_BLE_UUID_VS_ADD, uint32_t, sd_ble_uuid_vs_add(ble_uuid128_t const *p_vs_uuid, uint8_t *p_uuid_type));
@@ -0,0 +1,217 @@
+// Stand-in for the SoftDevice ble_gap.h, used by the simulator (see sim/).
+// Only the GAP events and calls used by the bootloader are declared.
+
+#pragma once
+
+#include <stdint.h>
+#include "nrf_svc.h"
+#include "nrf_error.h"
+#include "ble_types.h"
+
+#define BLE_GAP_CP_MIN_CONN_INTVL_MIN 0x0006 // 7.5ms
+#define BLE_GAP_CP_MAX_CONN_INTVL_MIN 0x0006
+
+#define BLE_GAP_AD_TYPE_FLAGS                        0x01
+#define BLE_GAP_AD_TYPE_128BIT_SERVICE_UUID_COMPLETE 0x07
+#define BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME          0x09
+#define BLE_GAP_AD_TYPE_SERVICE_DATA_128BIT_UUID     0x21
+#define BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE  0x06
+
+#define BLE_GAP_ADV_TYPE_CONNECTABLE_SCANNABLE_UNDIRECTED                0x01
+#define BLE_GAP_ADV_TYPE_CONNECTABLE_NONSCANNABLE_DIRECTED_HIGH_DUTY_CYCLE 0x02
+#define BLE_GAP_ADV_FP_ANY                                               0x00
+#define BLE_GAP_ADV_SET_HANDLE_NOT_SET                                   0xff
+#define BLE_GAP_ADV_TIMEOUT_HIGH_DUTY_MAX                                128
+
+#define BLE_GAP_EVT_ADV_SET_TERMINATED_REASON_TIMEOUT 0x01
+
+#define BLE_GAP_SCAN_FP_ACCEPT_ALL       0x00
+#define BLE_GAP_SCAN_TIMEOUT_UNLIMITED   0x0000
+#define BLE_GAP_SCAN_BUFFER_EXTENDED_MIN 255
+#define BLE_GAP_ADV_DATA_STATUS_COMPLETE 0x00
+
+#define BLE_GAP_PHY_AUTO  0x00
+#define BLE_GAP_PHY_1MBPS 0x01
+#define BLE_GAP_PHY_2MBPS 0x02
+
+#define BLE_GAP_ADDR_LEN 6
+
+#define BLE_GAP_EVT_BASE 0x10
+enum BLE_GAP_EVTS {
+    BLE_GAP_EVT_CONNECTED = BLE_GAP_EVT_BASE,
+    BLE_GAP_EVT_DISCONNECTED,
+    BLE_GAP_EVT_CONN_PARAM_UPDATE,
+    BLE_GAP_EVT_SEC_PARAMS_REQUEST,
+    BLE_GAP_EVT_SEC_INFO_REQUEST,
+    BLE_GAP_EVT_PASSKEY_DISPLAY,
+    BLE_GAP_EVT_KEY_PRESSED,
+    BLE_GAP_EVT_AUTH_KEY_REQUEST,
+    BLE_GAP_EVT_LESC_DHKEY_REQUEST,
+    BLE_GAP_EVT_AUTH_STATUS,
+    BLE_GAP_EVT_CONN_SEC_UPDATE,
+    BLE_GAP_EVT_TIMEOUT,
+    BLE_GAP_EVT_RSSI_CHANGED,
+    BLE_GAP_EVT_ADV_REPORT,
+    BLE_GAP_EVT_SEC_REQUEST,
+    BLE_GAP_EVT_CONN_PARAM_UPDATE_REQUEST,
+    BLE_GAP_EVT_SCAN_REQ_REPORT,
+    BLE_GAP_EVT_PHY_UPDATE_REQUEST,
+    BLE_GAP_EVT_PHY_UPDATE,
+    BLE_GAP_EVT_DATA_LENGTH_UPDATE_REQUEST,
+    BLE_GAP_EVT_DATA_LENGTH_UPDATE,
+    BLE_GAP_EVT_QOS_CHANNEL_SURVEY_REPORT,
+    BLE_GAP_EVT_ADV_SET_TERMINATED,
+};
+
+typedef struct {
+    uint8_t sm : 4;
+    uint8_t lv : 4;
+} ble_gap_conn_sec_mode_t;
+
+typedef struct {
+    uint16_t min_conn_interval;
+    uint16_t max_conn_interval;
+    uint16_t slave_latency;
+    uint16_t conn_sup_timeout;
+} ble_gap_conn_params_t;
+
+typedef struct {
+    uint8_t addr_id_peer : 1;
+    uint8_t addr_type    : 7;
+    uint8_t addr[BLE_GAP_ADDR_LEN];
+} ble_gap_addr_t;
+
+typedef struct {
+    ble_data_t adv_data;
+    ble_data_t scan_rsp_data;
+} ble_gap_adv_data_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t anonymous        : 1;
+    uint8_t include_tx_power : 1;
+} ble_gap_adv_properties_t;
+
+typedef uint8_t ble_gap_ch_mask_t[5];
+
+typedef struct {
+    ble_gap_adv_properties_t properties;
+    ble_gap_addr_t const    *p_peer_addr;
+    uint32_t                 interval;
+    uint16_t                 duration;
+    uint8_t                  max_adv_evts;
+    ble_gap_ch_mask_t        channel_mask;
+    uint8_t                  filter_policy;
+    uint8_t                  primary_phy;
+    uint8_t                  secondary_phy;
+    uint8_t                  set_id                : 4;
+    uint8_t                  scan_req_notification : 1;
+} ble_gap_adv_params_t;
+
+typedef struct {
+    uint8_t           extended               : 1;
+    uint8_t           report_incomplete_evts : 1;
+    uint8_t           active                 : 1;
+    uint8_t           filter_policy          : 2;
+    uint8_t           scan_phys;
+    uint16_t          interval;
+    uint16_t          window;
+    uint16_t          timeout;
+    ble_gap_ch_mask_t channel_mask;
+} ble_gap_scan_params_t;
+
+typedef struct {
+    uint8_t tx_phys;
+    uint8_t rx_phys;
+} ble_gap_phys_t;
+
+typedef struct {
+    uint16_t max_tx_octets;
+    uint16_t max_rx_octets;
+    uint16_t max_tx_time_us;
+    uint16_t max_rx_time_us;
+} ble_gap_data_length_params_t;
+
+typedef struct {
+    uint16_t tx_payload_limited_octets;
+    uint16_t rx_payload_limited_octets;
+    uint16_t tx_rx_time_limited_us;
+} ble_gap_data_length_limitation_t;
+
+typedef struct {
+    uint8_t  conn_count;
+    uint16_t event_length; // in 1.25ms units
+} ble_gap_conn_cfg_t;
+
+typedef struct {
+    ble_gap_addr_t        peer_addr;
+    uint8_t               role;
+    ble_gap_conn_params_t conn_params;
+    uint8_t               adv_handle;
+} ble_gap_evt_connected_t;
+
+typedef struct {
+    uint8_t reason;
+} ble_gap_evt_disconnected_t;
+
+typedef struct {
+    ble_gap_conn_params_t conn_params;
+} ble_gap_evt_conn_param_update_t;
+
+typedef struct {
+    uint8_t status;
+    uint8_t tx_phy;
+    uint8_t rx_phy;
+} ble_gap_evt_phy_update_t;
+
+typedef struct {
+    ble_gap_data_length_params_t effective_params;
+} ble_gap_evt_data_length_update_t;
+
+typedef struct {
+    uint8_t reason;
+    uint8_t adv_handle;
+} ble_gap_evt_adv_set_terminated_t;
+
+typedef struct {
+    uint16_t connectable   : 1;
+    uint16_t scannable     : 1;
+    uint16_t directed      : 1;
+    uint16_t scan_response : 1;
+    uint16_t extended_pdu  : 1;
+    uint16_t status        : 2;
+    uint16_t reserved      : 9;
+} ble_gap_adv_report_type_t;
+
+typedef struct {
+    ble_gap_adv_report_type_t type;
+    ble_gap_addr_t            peer_addr;
+    uint8_t                   primary_phy;
+    uint8_t                   secondary_phy;
+    int8_t                    rssi;
+    ble_data_t                data;
+} ble_gap_evt_adv_report_t;
+
+typedef struct {
+    uint16_t conn_handle;
+    union {
+        ble_gap_evt_connected_t          connected;
+        ble_gap_evt_disconnected_t       disconnected;
+        ble_gap_evt_conn_param_update_t  conn_param_update;
+        ble_gap_evt_phy_update_t         phy_update;
+        ble_gap_evt_data_length_update_t data_length_update;
+        ble_gap_evt_adv_set_terminated_t adv_set_terminated;
+        ble_gap_evt_adv_report_t         adv_report;
+    } params;
+} ble_gap_evt_t;
+
+SVCALL(SD_BLE_GAP_DEVICE_NAME_SET, uint32_t, sd_ble_gap_device_name_set(ble_gap_conn_sec_mode_t const *p_write_perm, uint8_t const *p_dev_name, uint16_t len));
+SVCALL(SD_BLE_GAP_PPCP_SET, uint32_t, sd_ble_gap_ppcp_set(ble_gap_conn_params_t const *p_conn_params));
+SVCALL(SD_BLE_GAP_ADV_SET_CONFIGURE, uint32_t, sd_ble_gap_adv_set_configure(uint8_t *p_adv_handle, ble_gap_adv_data_t const *p_adv_data, ble_gap_adv_params_t const *p_adv_params));
+SVCALL(SD_BLE_GAP_ADV_START, uint32_t, sd_ble_gap_adv_start(uint8_t adv_handle, uint8_t conn_cfg_tag));
+SVCALL(SD_BLE_GAP_SCAN_START, uint32_t, sd_ble_gap_scan_start(ble_gap_scan_params_t const *p_scan_params, ble_data_t const *p_adv_report_buffer));
+SVCALL(SD_BLE_GAP_SCAN_STOP, uint32_t, sd_ble_gap_scan_stop(void));
+SVCALL(SD_BLE_GAP_CONN_PARAM_UPDATE, uint32_t, sd_ble_gap_conn_param_update(uint16_t conn_handle, ble_gap_conn_params_t const *p_conn_params));
+SVCALL(SD_BLE_GAP_DISCONNECT, uint32_t, sd_ble_gap_disconnect(uint16_t conn_handle, uint8_t hci_status_code));
+SVCALL(SD_BLE_GAP_PHY_UPDATE, uint32_t, sd_ble_gap_phy_update(uint16_t conn_handle, ble_gap_phys_t const *p_gap_phys));
+SVCALL(SD_BLE_GAP_DATA_LENGTH_UPDATE, uint32_t, sd_ble_gap_data_length_update(uint16_t conn_handle, ble_gap_data_length_params_t const *p_dl_params, ble_gap_data_length_limitation_t *p_dl_limitation));
@@ -0,0 +1,28 @@
+// Stand-in for the SoftDevice ble_gatt.h, used by the simulator (see sim/).
+
+#pragma once
+
+#include <stdint.h>
+
+#define BLE_GATT_ATT_MTU_DEFAULT  23
+#define BLE_GATT_HANDLE_INVALID   0x0000
+#define BLE_GATT_HVX_NOTIFICATION 0x01
+
+typedef struct {
+    uint16_t att_mtu;
+} ble_gatt_conn_cfg_t;
+
+typedef struct {
+    uint8_t broadcast      : 1;
+    uint8_t read           : 1;
+    uint8_t write_wo_resp  : 1;
+    uint8_t write          : 1;
+    uint8_t notify         : 1;
+    uint8_t indicate       : 1;
+    uint8_t auth_signed_wr : 1;
+} ble_gatt_char_props_t;
+
+typedef struct {
+    uint8_t reliable_wr : 1;
+    uint8_t wr_aux      : 1;
+} ble_gatt_char_ext_props_t;
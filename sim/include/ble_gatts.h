@@ -0,0 +1,114 @@
+// Stand-in for the SoftDevice ble_gatts.h, used by the simulator (see sim/).
+// Only the GATT server events and calls used by the bootloader are declared.
+
+#pragma once
+
+#include <stdint.h>
+#include "nrf_svc.h"
+#include "ble_types.h"
+#include "ble_gap.h"
+#include "ble_gatt.h"
+
+#define BLE_GATTS_VLOC_STACK        0x01
+#define BLE_GATTS_SRVC_TYPE_PRIMARY 0x01
+
+#define BLE_GATTS_EVT_BASE 0x50
+enum BLE_GATTS_EVTS {
+    BLE_GATTS_EVT_WRITE = BLE_GATTS_EVT_BASE,
+    BLE_GATTS_EVT_RW_AUTHORIZE_REQUEST,
+    BLE_GATTS_EVT_SYS_ATTR_MISSING,
+    BLE_GATTS_EVT_HVC,
+    BLE_GATTS_EVT_SC_CONFIRM,
+    BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST,
+    BLE_GATTS_EVT_TIMEOUT,
+    BLE_GATTS_EVT_HVN_TX_COMPLETE,
+};
+
+typedef struct {
+    uint8_t hvn_tx_queue_size;
+} ble_gatts_conn_cfg_t;
+
+typedef struct {
+    ble_gap_conn_sec_mode_t read_perm;
+    ble_gap_conn_sec_mode_t write_perm;
+    uint8_t                 vlen    : 1;
+    uint8_t                 vloc    : 2;
+    uint8_t                 rd_auth : 1;
+    uint8_t                 wr_auth : 1;
+} ble_gatts_attr_md_t;
+
+typedef struct {
+    ble_uuid_t const          *p_uuid;
+    ble_gatts_attr_md_t const *p_attr_md;
+    uint16_t                   init_len;
+    uint16_t                   init_offs;
+    uint16_t                   max_len;
+    uint8_t                   *p_value;
+} ble_gatts_attr_t;
+
+typedef struct {
+    uint8_t  format;
+    int8_t   exponent;
+    uint16_t unit;
+    uint8_t  name_space;
+    uint16_t desc;
+} ble_gatts_char_pf_t;
+
+typedef struct {
+    ble_gatt_char_props_t      char_props;
+    ble_gatt_char_ext_props_t  char_ext_props;
+    uint8_t const             *p_char_user_desc;
+    uint16_t                   char_user_desc_max_size;
+    uint16_t                   char_user_desc_size;
+    ble_gatts_char_pf_t const *p_char_pf;
+    ble_gatts_attr_md_t const *p_user_desc_md;
+    ble_gatts_attr_md_t const *p_cccd_md;
+    ble_gatts_attr_md_t const *p_sccd_md;
+} ble_gatts_char_md_t;
+
+typedef struct {
+    uint16_t value_handle;
+    uint16_t user_desc_handle;
+    uint16_t cccd_handle;
+    uint16_t sccd_handle;
+} ble_gatts_char_handles_t;
+
+typedef struct {
+    uint16_t       handle;
+    uint8_t        type;
+    uint16_t       offset;
+    uint16_t      *p_len;
+    uint8_t const *p_data;
+} ble_gatts_hvx_params_t;
+
+typedef struct {
+    uint16_t   handle;
+    ble_uuid_t uuid;
+    uint8_t    op;
+    uint8_t    auth_required;
+    uint16_t   offset;
+    uint16_t   len;
+    uint8_t    data[1]; // variable length
+} ble_gatts_evt_write_t;
+
+typedef struct {
+    uint16_t client_rx_mtu;
+} ble_gatts_evt_exchange_mtu_request_t;
+
+typedef struct {
+    uint8_t count;
+} ble_gatts_evt_hvn_tx_complete_t;
+
+typedef struct {
+    uint16_t conn_handle;
+    union {
+        ble_gatts_evt_write_t                write;
+        ble_gatts_evt_exchange_mtu_request_t exchange_mtu_request;
+        ble_gatts_evt_hvn_tx_complete_t      hvn_tx_complete;
+    } params;
+} ble_gatts_evt_t;
+
+SVCALL(SD_BLE_GATTS_SERVICE_ADD, uint32_t, sd_ble_gatts_service_add(uint8_t type, ble_uuid_t const *p_uuid, uint16_t *p_handle));
+SVCALL(SD_BLE_GATTS_CHARACTERISTIC_ADD, uint32_t, sd_ble_gatts_characteristic_add(uint16_t service_handle, ble_gatts_char_md_t const *p_char_md, ble_gatts_attr_t const *p_attr_char_value, ble_gatts_char_handles_t *p_handles));
+SVCALL(SD_BLE_GATTS_HVX, uint32_t, sd_ble_gatts_hvx(uint16_t conn_handle, ble_gatts_hvx_params_t const *p_hvx_params));
+SVCALL(SD_BLE_GATTS_EXCHANGE_MTU_REPLY, uint32_t, sd_ble_gatts_exchange_mtu_reply(uint16_t conn_handle, uint16_t server_rx_mtu));
@@ -0,0 +1,8 @@
+// Stand-in for the SoftDevice ble_hci.h, used by the simulator (see sim/).
+
+#pragma once
+
+#define BLE_HCI_STATUS_CODE_SUCCESS               0x00
+#define BLE_HCI_CONNECTION_TIMEOUT                0x08
+#define BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION 0x13
+#define BLE_HCI_UNSUPPORTED_REMOTE_FEATURE        0x1A
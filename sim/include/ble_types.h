@@ -0,0 +1,21 @@
+// Stand-in for the SoftDevice ble_types.h, used by the simulator (see sim/).
+
+#pragma once
+
+#include <stdint.h>
+
+#define BLE_CONN_HANDLE_INVALID 0xFFFF
+
+typedef struct {
+    uint8_t uuid128[16];
+} ble_uuid128_t;
+
+typedef struct {
+    uint16_t uuid;
+    uint8_t  type;
+} ble_uuid_t;
+
+typedef struct {
+    uint8_t *p_data;
+    uint16_t len;
+} ble_data_t;
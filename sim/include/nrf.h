@@ -0,0 +1,37 @@
+// Stand-in for the nrfx/CMSIS device header, used by the simulator (see
+// sim/). Only the debug registers that the bootloader uses to count cycles
+// and RTC1 exist. The cycle counter doesn't run, as the simulator only models
+// time spent in flash operations and on the radio. The RTC counts simulated
+// time once started.
+
+#pragma once
+
+#include <stdint.h>
+
+typedef struct {
+    volatile uint32_t CTRL;
+    volatile uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+    volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+typedef struct {
+    volatile uint32_t TASKS_START;
+    volatile uint32_t COUNTER;
+    volatile uint32_t PRESCALER;
+} NRF_RTC_Type;
+
+extern DWT_Type       sim_dwt;
+extern CoreDebug_Type sim_core_debug;
+extern NRF_RTC_Type   sim_rtc1;
+
+#define DWT       (&sim_dwt)
+#define CoreDebug (&sim_core_debug)
+#define NRF_RTC1  (&sim_rtc1)
+
+#define DWT_CTRL_CYCCNTENA_Msk     (1UL << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk (1UL << 24)
+
+static inline void __WFE(void) {}
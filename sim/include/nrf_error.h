@@ -0,0 +1,17 @@
+// Stand-in for the SoftDevice nrf_error.h, used by the simulator (see sim/).
+
+#pragma once
+
+#define NRF_SUCCESS                     0
+#define NRF_ERROR_INTERNAL              3
+#define NRF_ERROR_NO_MEM                4
+#define NRF_ERROR_NOT_FOUND             5
+#define NRF_ERROR_NOT_SUPPORTED         6
+#define NRF_ERROR_INVALID_PARAM         7
+#define NRF_ERROR_INVALID_STATE         8
+#define NRF_ERROR_INVALID_LENGTH        9
+#define NRF_ERROR_DATA_SIZE             12
+#define NRF_ERROR_NULL                  14
+#define NRF_ERROR_INVALID_ADDR          16
+#define NRF_ERROR_BUSY                  17
+#define NRF_ERROR_RESOURCES             19
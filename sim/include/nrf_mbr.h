@@ -0,0 +1,6 @@
+// Stand-in for the SoftDevice nrf_mbr.h, used by the simulator (see sim/).
+// The bootloader doesn't call into the MBR.
+
+#pragma once
+
+#include "nrf_svc.h"
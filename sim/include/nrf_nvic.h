@@ -0,0 +1,10 @@
+// Stand-in for the SoftDevice nrf_nvic.h, used by the simulator (see sim/).
+// A reset ends the simulated session.
+
+#pragma once
+
+#include <stdint.h>
+#include "nrf.h"
+#include "nrf_svc.h"
+
+SVCALL(SD_NVIC_SYSTEMRESET, uint32_t, sd_nvic_SystemReset(void));
@@ -0,0 +1,20 @@
+// Stand-in for the SoftDevice nrf_sdm.h, used by the simulator (see sim/).
+
+#pragma once
+
+#include <stdint.h>
+#include "nrf_svc.h"
+#include "nrf_error.h"
+#include "nrf_soc.h"
+
+typedef struct {
+    uint8_t source;
+    uint8_t rc_ctiv;
+    uint8_t rc_temp_ctiv;
+    uint8_t accuracy;
+} nrf_clock_lf_cfg_t;
+
+typedef void (*nrf_fault_handler_t)(uint32_t id, uint32_t pc, uint32_t info);
+
+SVCALL(SD_SOFTDEVICE_ENABLE, uint32_t, sd_softdevice_enable(nrf_clock_lf_cfg_t const *p_clock_lf_cfg, nrf_fault_handler_t fault_handler));
+SVCALL(SD_SOFTDEVICE_DISABLE, uint32_t, sd_softdevice_disable(void));
@@ -0,0 +1,20 @@
+// Stand-in for the SoftDevice nrf_soc.h, used by the simulator (see sim/).
+
+#pragma once
+
+#include <stdint.h>
+#include "nrf.h"
+#include "nrf_svc.h"
+#include "nrf_error.h"
+
+enum NRF_SOC_EVTS {
+    NRF_EVT_HFCLKSTARTED,
+    NRF_EVT_POWER_FAILURE_WARNING,
+    NRF_EVT_FLASH_OPERATION_SUCCESS,
+    NRF_EVT_FLASH_OPERATION_ERROR,
+};
+
+SVCALL(SD_FLASH_PAGE_ERASE, uint32_t, sd_flash_page_erase(uint32_t page_number));
+SVCALL(SD_FLASH_WRITE, uint32_t, sd_flash_write(uint32_t *p_dst, uint32_t const *p_src, uint32_t size));
+SVCALL(SD_EVT_GET, uint32_t, sd_evt_get(uint32_t *p_evt_id));
+SVCALL(SD_APP_EVT_WAIT, uint32_t, sd_app_evt_wait(void));
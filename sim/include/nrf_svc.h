@@ -0,0 +1,6 @@
+// Stand-in for the SoftDevice nrf_svc.h, used by the simulator (see sim/).
+// SoftDevice calls are plain functions here, implemented in sim/softdevice.c.
+
+#pragma once
+
+#define SVCALL(number, return_type, signature) return_type signature
@@ -0,0 +1,183 @@
+// This file stands in for serial.c in the host simulator. The serial transport
+// runs over a pseudo terminal instead of the UART, so that dfuclient -serial
+// can update the socket server (-serial). Frames are found the same way as by
+// the UARTE receiver (see SERIAL_MAGIC in dfu.h), and the link passes one byte
+// every 10us of simulated time, like the UART at 1Mbaud.
+
+#define _DEFAULT_SOURCE   // cfmakeraw
+#define _XOPEN_SOURCE 600 // posix_openpt
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "nrf_error.h"
+
+#include "dfu.h"
+#include "sim.h"
+
+#define BYTE_TIME (10) // microseconds per byte at 1Mbaud (start and stop bit included)
+
+static uint32_t serial_send_reply(uint16_t data_len, const void *data);
+static void serial_disconnect(void);
+
+transport_t serial_transport = {
+    .send_reply = serial_send_reply,
+    .disconnect = serial_disconnect,
+    .mtu        = SERIAL_FRAME_SIZE - 4 + 3,
+    .phy        = 0,
+};
+
+// States of the receiver, as in serial.c.
+enum {
+    SERIAL_RX_SYNC,
+    SERIAL_RX_MAGIC,
+    SERIAL_RX_FRAME,
+};
+
+static int      master_fd = -1;
+static uint64_t rx_time;  // simulated time up to which bytes have been received
+static uint8_t  rx_state;
+static uint8_t  rx_frame[SERIAL_FRAME_SIZE] __attribute__((aligned(4)));
+static uint16_t rx_len;
+static uint8_t  closing;
+static uint8_t  send_failed; // a reply didn't fit in the pseudo terminal
+
+// sim_serial_open creates the pseudo terminal and returns the path of the
+// client side.
+const char *sim_serial_open(void) {
+    master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master_fd < 0 || grantpt(master_fd) < 0 || unlockpt(master_fd) < 0) {
+        return NULL;
+    }
+    const char *path = ptsname(master_fd);
+    if (path == NULL) {
+        return NULL;
+    }
+    // Keep the client side open, so that the server doesn't see a hangup
+    // between two clients. The client sets the same raw mode.
+    int slave_fd = open(path, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (slave_fd < 0 || tcgetattr(slave_fd, &tio) < 0) {
+        return NULL;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(slave_fd, TCSANOW, &tio);
+    fcntl(master_fd, F_SETFL, O_NONBLOCK);
+    return path;
+}
+
+// sim_serial_ready returns whether there is data from the client that can be
+// received now, so that sd_app_evt_wait returns like on a UARTE event.
+int sim_serial_ready(void) {
+    if (master_fd < 0) {
+        return 0;
+    }
+    struct pollfd pfd = {
+        .fd     = master_fd,
+        .events = POLLIN,
+    };
+    if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLIN)) {
+        rx_time = sim_now; // the link was idle
+        return 0;
+    }
+    return sim_now >= rx_time + BYTE_TIME;
+}
+
+void serial_init(void) {
+}
+
+// resync ends the session, see serial_resync in serial.c.
+static void resync(void) {
+    rx_state = SERIAL_RX_SYNC;
+    handle_disconnect(&serial_transport);
+}
+
+// receive_byte passes a byte through the state machine of the receiver.
+static void receive_byte(uint8_t b) {
+    switch (rx_state) {
+    case SERIAL_RX_SYNC:
+        if (b == SERIAL_SYNC) {
+            rx_state = SERIAL_RX_MAGIC;
+        }
+        break;
+    case SERIAL_RX_MAGIC:
+        if (b == SERIAL_MAGIC) {
+            rx_state = SERIAL_RX_FRAME;
+            rx_frame[0] = b;
+            rx_len = 1;
+        } else if (b != SERIAL_SYNC) {
+            rx_state = SERIAL_RX_SYNC;
+        }
+        break;
+    case SERIAL_RX_FRAME:
+        rx_frame[rx_len++] = b;
+        if (rx_len < SERIAL_FRAME_SIZE) {
+            break;
+        }
+        rx_len = 0;
+        uint16_t length = rx_frame[2] | (rx_frame[3] << 8);
+        if (rx_frame[0] != SERIAL_MAGIC || length > SERIAL_FRAME_SIZE - 4) {
+            resync();
+        } else if (rx_frame[1] == SERIAL_FRAME_COMMAND) {
+            handle_command(&serial_transport, length, (ble_command_t*)&rx_frame[4]);
+        } else if (rx_frame[1] == SERIAL_FRAME_DATA) {
+            handle_data(&serial_transport, length, &rx_frame[4]);
+        }
+        break;
+    }
+}
+
+void serial_poll(void) {
+    if (master_fd < 0) {
+        return;
+    }
+    // Receive the bytes that the link could have carried since last time.
+    uint8_t buf[SERIAL_FRAME_SIZE * 8];
+    uint64_t count = (sim_now - rx_time) / BYTE_TIME;
+    if (count > sizeof(buf)) {
+        count = sizeof(buf);
+    }
+    ssize_t n = count ? read(master_fd, buf, count) : 0;
+    if (n > 0) {
+        rx_time += n * BYTE_TIME;
+        for (ssize_t i = 0; i < n; i++) {
+            receive_byte(buf[i]);
+        }
+    }
+
+    if (send_failed) {
+        send_failed = 0;
+        handle_notification_sent();
+    }
+    if (closing) {
+        closing = 0;
+        resync();
+    }
+}
+
+static uint32_t serial_send_reply(uint16_t data_len, const void *data) {
+    uint8_t frame[SERIAL_FRAME_SIZE];
+    if (data_len > SERIAL_FRAME_SIZE - 4) {
+        return NRF_ERROR_RESOURCES;
+    }
+    frame[0] = SERIAL_MAGIC;
+    frame[1] = SERIAL_FRAME_REPLY;
+    frame[2] = data_len;
+    frame[3] = data_len >> 8;
+    memcpy(&frame[4], data, data_len);
+    sim_stats.notifications++;
+    if (write(master_fd, frame, 4 + data_len) != 4 + data_len) {
+        sim_stats.hvn_full++;
+        send_failed = 1;
+        return NRF_ERROR_RESOURCES;
+    }
+    return NRF_SUCCESS;
+}
+
+static void serial_disconnect(void) {
+    closing = 1;
+}
@@ -0,0 +1,256 @@
+
+// This file implements the socket server of the host simulator, and its main
+// function. It stands in for a device running the bootloader, so that
+// dfuclient can update it with -virtual and its bench command can measure
+// whole updates without a radio. The bootloader runs in real time, with the
+// same link and flash model as with the scripted client.
+// Every message on the socket (SOCK_SEQPACKET) is a single ATT operation: a
+// type byte (VIRTUAL_*) followed by the value. Connecting to the socket
+// connects to the bootloader and closing it is a lost connection. The server
+// exits when the bootloader resets.
+// With TRANSPORT_SERIAL=1, the server can also be updated over the serial
+// transport (dfuclient -serial), through a pseudo terminal (see sim/serial.c).
+// With BROADCAST=1, every datagram on a second socket (SOCK_DGRAM) at the path
+// with ".broadcast" appended is the data of an extended advertising packet, as
+// sent by dfuclient broadcast -virtual. The bootloader receives them while
+// scanning, whether a client is connected to the first socket or not.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ble_gap.h"
+
+#include "dfu.h"
+#include "sim.h"
+
+// Message types, the same as in dfuclient/virtual.go.
+#define VIRTUAL_COMMAND ('c') // write to the command characteristic
+#define VIRTUAL_DATA    ('d') // write to the data characteristic
+#define VIRTUAL_NOTIFY  ('n') // notification of the command characteristic
+
+#define MAX_MESSAGE (1 + 256)
+
+extern const uint32_t _sprogress[];
+
+// Options.
+static uint16_t client_mtu = 247;
+static uint8_t  client_phys = BLE_GAP_PHY_1MBPS | BLE_GAP_PHY_2MBPS;
+static uint8_t  verbose;
+
+static int      listen_fd = -1;
+static int      broadcast_fd = -1;
+static int      client_fd = -1;
+static uint8_t  pending[MAX_MESSAGE]; // message that didn't fit in the last connection event
+static ssize_t  pending_len;
+static uint32_t connections;
+
+// client_close handles a closed socket, which is a lost connection.
+static void client_close(void) {
+    if (verbose) {
+        fprintf(stderr, "%10.3fms  disconnected\n", sim_now / 1000.0);
+    }
+    close(client_fd);
+    client_fd = -1;
+    pending_len = 0;
+    sim_disconnect();
+}
+
+// sim_client_tick is called at every connection interval. It accepts new
+// connections and passes on as many writes as fit in the connection event.
+void sim_client_tick(void) {
+    if (broadcast_fd >= 0) {
+        // One advertising packet per connection interval at most, like a
+        // sender that advertises at least that far apart.
+        uint8_t adv_data[BLE_GAP_SCAN_BUFFER_EXTENDED_MIN];
+        ssize_t len = recv(broadcast_fd, adv_data, sizeof(adv_data), 0);
+        if (len > 0) {
+            sim_broadcast(adv_data, len);
+        }
+    }
+    if (listen_fd < 0) {
+        return; // only the serial transport
+    }
+    if (client_fd < 0) {
+        client_fd = accept(listen_fd, NULL, NULL);
+        if (client_fd < 0) {
+            return;
+        }
+        fcntl(client_fd, F_SETFL, O_NONBLOCK);
+        connections++;
+    }
+    if (!sim_connected()) {
+        // The bootloader may not be advertising again yet. Writes are passed
+        // on from the next connection event, once the ATT MTU and PHY have
+        // been negotiated.
+        if (sim_connect(client_mtu, client_phys) && verbose) {
+            fprintf(stderr, "%10.3fms  connected\n", sim_now / 1000.0);
+        }
+        return;
+    }
+    while (1) {
+        if (pending_len == 0) {
+            pending_len = recv(client_fd, pending, sizeof(pending), 0);
+            if (pending_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                pending_len = 0;
+                return;
+            }
+            if (pending_len <= 0) {
+                client_close();
+                return;
+            }
+        }
+        int sent;
+        if (pending[0] == VIRTUAL_COMMAND) {
+            sent = sim_write_command(&pending[1], pending_len - 1);
+        } else if (pending[0] == VIRTUAL_DATA) {
+            sent = sim_write_data(&pending[1], pending_len - 1);
+        } else {
+            fprintf(stderr, "sim: unknown message type 0x%02x\n", pending[0]);
+            client_close();
+            return;
+        }
+        if (!sent) {
+            return; // try again in the next connection event
+        }
+        pending_len = 0;
+    }
+}
+
+// sim_client_notify passes a notification on to the client. If the socket was
+// closed, the next recv finds out.
+void sim_client_notify(const uint8_t *data, uint16_t len) {
+    uint8_t msg[MAX_MESSAGE];
+    if (client_fd < 0 || len > sizeof(msg) - 1) {
+        return;
+    }
+    msg[0] = VIRTUAL_NOTIFY;
+    memcpy(&msg[1], data, len);
+    send(client_fd, msg, 1 + len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+// sim_client_reset is called when the bootloader resets, for example after
+// COMMAND_RESET. It prints what happened and exits. The exit status is 0 if
+// the bootloader would start the application.
+void sim_client_reset(void) {
+    printf("link:       %uM PHY, %.2fms interval, %u packets/event, %u connections\n",
+           sim_phy(), sim_config.conn_interval / 1000.0, sim_packets_per_event(), connections);
+    printf("packets:    %u sent, %u lost\n", sim_stats.packets, sim_stats.lost);
+    printf("flash:      %u erases (%.1fms), %u writes (%.1fms), %u busy\n",
+           sim_stats.erases, sim_stats.erase_time / 1000.0, sim_stats.writes, sim_stats.write_time / 1000.0, sim_stats.busy);
+    printf("notify:     %u sent, %u refused (queue full)\n", sim_stats.notifications, sim_stats.hvn_full);
+#if BROADCAST
+    printf("broadcast:  %u packets, %u missed\n", sim_stats.broadcasts, sim_stats.broadcasts_missed);
+#endif
+    if (!sim_app_image_valid()) {
+        printf("result:     the bootloader would not start the application\n");
+        exit(1);
+    }
+    printf("result:     ok\n");
+    exit(0);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [options] -socket path\n", name);
+    fprintf(stderr, "  -socket path     listen on this Unix socket\n");
+#if TRANSPORT_SERIAL
+    fprintf(stderr, "  -serial          accept the serial transport on a pseudo terminal, -socket is then optional\n");
+#endif
+    fprintf(stderr, "  -erased          start with erased flash instead of an old image\n");
+    fprintf(stderr, "  -mtu n           ATT MTU of the client (default 247)\n");
+    fprintf(stderr, "  -phy n           1 if the client only supports the 1M PHY (default 2)\n");
+    fprintf(stderr, "  -v               print connections to stderr\n");
+    sim_config_usage();
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    uint8_t erased_flash = 0;
+    uint8_t serial = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (!strcmp(arg, "-erased")) {
+            erased_flash = 1;
+        } else if (!strcmp(arg, "-v")) {
+            verbose = 1;
+#if TRANSPORT_SERIAL
+        } else if (!strcmp(arg, "-serial")) {
+            serial = 1;
+#endif
+        } else if (i + 1 == argc) {
+            usage(argv[0]);
+        } else if (!strcmp(arg, "-socket")) {
+            path = argv[++i];
+        } else {
+            uint32_t value = strtoul(argv[++i], NULL, 0);
+            if (!strcmp(arg, "-mtu")) {
+                client_mtu = value;
+            } else if (!strcmp(arg, "-phy")) {
+                client_phys = value == 1 ? BLE_GAP_PHY_1MBPS : BLE_GAP_PHY_1MBPS | BLE_GAP_PHY_2MBPS;
+            } else if (!sim_config_option(arg, value)) {
+                usage(argv[0]);
+            }
+        }
+    }
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+    if ((path == NULL && !serial) || (path != NULL && strlen(path) + strlen(".broadcast") >= sizeof(addr.sun_path))) {
+        usage(argv[0]);
+    }
+
+    // Like the scripted client, but the old application fills all of the
+    // application area as the size of the new one isn't known.
+    memset(sim_flash, 0xff, sizeof(sim_flash));
+    uint32_t app_code_base = SIM_APP_CODE_BASE;
+    memcpy(&sim_flash[0x3008], &app_code_base, 4);
+    if (!erased_flash) {
+        for (uint32_t i = SIM_APP_CODE_BASE; i < (uint32_t)_sprogress; i++) {
+            sim_flash[i] = sim_prng();
+        }
+    }
+
+    if (path != NULL) {
+        strcpy(addr.sun_path, path);
+        listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        unlink(path);
+        if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 1) < 0) {
+            perror(path);
+            return 1;
+        }
+        fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+#if BROADCAST
+        strcat(addr.sun_path, ".broadcast");
+        broadcast_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        unlink(addr.sun_path);
+        if (broadcast_fd < 0 || bind(broadcast_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror(addr.sun_path);
+            return 1;
+        }
+        fcntl(broadcast_fd, F_SETFL, O_NONBLOCK);
+#endif
+        // Whoever started the server can connect from now on.
+        printf("listening on %s\n", path);
+    }
+#if TRANSPORT_SERIAL
+    if (serial) {
+        const char *serial_path = sim_serial_open();
+        if (serial_path == NULL) {
+            perror("pseudo terminal");
+            return 1;
+        }
+        printf("serial port %s\n", serial_path);
+    }
+#endif
+    fflush(stdout);
+
+    sim_config.realtime = 1;
+    ble_init();
+    dfu_run();
+}
@@ -0,0 +1,94 @@
+
+// Declarations shared between the fake SoftDevice (softdevice.c) and the
+// scripted DFU client (client.c) or socket server (server.c) of the host
+// simulator. The simulator runs main.c and ble.c unmodified, so all time is
+// simulated time: it only passes when the bootloader waits for an event in
+// sd_app_evt_wait. The socket server lets it pass in real time.
+
+#pragma once
+
+#include <stdint.h>
+
+// Flash layout of the simulated chip, an nRF52840 with the s140 SoftDevice.
+// The bootloader and its progress record are at the end of flash (see
+// LDFLAGS_SIM in the Makefile).
+#define SIM_FLASH_SIZE    (1024 * 1024)
+#define SIM_PAGE_SIZE     (4096)
+#define SIM_APP_CODE_BASE (0x27000)
+
+// Timing model, in microseconds. The flash times are the maximums from the
+// nRF52840 product specification.
+typedef struct {
+    uint32_t erase_time;    // erasing a flash page
+    uint32_t write_time;    // writing a word to flash
+    uint32_t conn_interval; // time between connection events
+    uint32_t busy_every;    // every n-th flash operation finds the flash busy (0: never)
+    uint32_t busy_time;     // how long the flash is busy then
+    uint32_t loss;          // a data packet is lost with probability 1/loss (0: never)
+    uint32_t max_packets;   // packets per connection event (0: as many as fit)
+    uint8_t  realtime;      // let simulated time pass at the speed of the wall clock
+} sim_config_t;
+
+// What the simulated flash and radio have done during the session.
+typedef struct {
+    uint32_t erases;
+    uint32_t writes;
+    uint32_t busy;          // flash operations that returned NRF_ERROR_BUSY
+    uint64_t erase_time;
+    uint64_t write_time;
+    uint32_t packets;       // writes sent by the client
+    uint32_t lost;          // data packets that were lost (see loss)
+    uint32_t notifications; // notifications sent to the client
+    uint32_t hvn_full;      // notifications refused because the queue was full
+    uint32_t broadcasts;    // advertising packets of a broadcast update (BROADCAST=1)
+    uint32_t broadcasts_missed; // not received: not scanning, scanner paused or lost
+} sim_stats_t;
+
+extern sim_config_t sim_config;
+extern sim_stats_t  sim_stats;
+extern uint64_t     sim_now; // simulated time
+extern uint8_t      sim_flash[SIM_FLASH_SIZE];
+
+// Radio side of the fake SoftDevice, used by the client. Writes are only
+// possible while connected and as long as they fit in the current connection
+// event. They return 0 when the packet couldn't be sent.
+int  sim_connect(uint16_t mtu, uint8_t phys);
+void sim_disconnect(void);
+int  sim_connected(void);
+int  sim_write_command(const void *data, uint16_t len);
+int  sim_write_data(const void *data, uint16_t len);
+uint8_t sim_phy(void);
+uint32_t sim_packets_per_event(void);
+
+// sim_broadcast sends the data of an extended advertising packet to the
+// scanner of the bootloader (BROADCAST=1). It returns 0 if it wasn't received.
+int  sim_broadcast(const void *data, uint16_t len);
+
+// Options for the timing model that the client and the server share.
+// sim_config_option returns 0 if the option isn't one of them.
+int  sim_config_option(const char *name, uint32_t value);
+void sim_config_usage(void);
+
+// sim_prng returns the next pseudo random number, so that generated images
+// and old flash contents are the same in every run.
+extern uint32_t sim_prng_state;
+uint32_t sim_prng(void);
+
+// Client side, called by the fake SoftDevice. It is implemented by the
+// scripted client (client.c) or by the socket server (server.c). sim_client_tick is called at
+// every connection interval (also while disconnected), sim_client_notify for
+// every notification that reaches the client and sim_client_reset when the
+// bootloader resets, which ends the session.
+void sim_client_tick(void);
+void sim_client_notify(const uint8_t *data, uint16_t len);
+void sim_client_reset(void) __attribute__((noreturn));
+
+// Serial transport over a pseudo terminal (sim/serial.c, with
+// TRANSPORT_SERIAL=1). sim_serial_open returns the path of the client side, or
+// NULL on failure. sim_serial_ready returns whether data from the client can
+// be received, which ends sd_app_evt_wait.
+const char *sim_serial_open(void);
+int sim_serial_ready(void);
+
+// Implemented in main.c for the simulator.
+int sim_app_image_valid(void);
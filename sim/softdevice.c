@@ -0,0 +1,656 @@
+
+// This file implements a fake SoftDevice for the host simulator. It keeps
+// flash in RAM, models how long flash operations and the radio take and
+// delivers events through sd_evt_get and sd_ble_evt_get like the real
+// SoftDevice does. Simulated time advances in sd_app_evt_wait, to the next
+// flash operation that finishes or the next connection event, whichever comes
+// first. At each connection event, queued notifications go out to the client
+// and the client may send as many packets as fit in the event. With
+// sim_config.realtime set, sd_app_evt_wait sleeps until that time instead.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ble.h"
+#include "nrf_soc.h"
+#include "nrf_nvic.h"
+
+#include "dfu.h"
+#include "sim.h"
+
+#define BLE_EVT_MAX_SIZE (sizeof(ble_evt_t) + 256)
+#define BLE_EVT_QUEUE    (64)
+#define SOC_EVT_QUEUE    (8)
+#define HVN_QUEUE_MAX    (16)
+
+sim_config_t sim_config = {
+    .erase_time    = 85000,
+    .write_time    = 41,
+    .conn_interval = 7500,
+    .busy_time     = 5000,
+};
+sim_stats_t    sim_stats;
+uint64_t       sim_now;
+uint8_t        sim_flash[SIM_FLASH_SIZE] __attribute__((aligned(4)));
+DWT_Type       sim_dwt;
+CoreDebug_Type sim_core_debug;
+NRF_RTC_Type   sim_rtc1;
+dfu_peer_t     dfu_peer; // at a fixed address in RAM on a real chip
+
+// Flash operation that is in progress. FLASH_BUSY is a simulated operation of
+// someone else (see sim_config.busy_every), which the bootloader has to wait
+// for.
+enum {
+    FLASH_IDLE,
+    FLASH_ERASE,
+    FLASH_WRITE,
+    FLASH_BUSY,
+};
+static uint8_t         flash_state;
+static uint64_t        flash_done;  // time at which the operation finishes
+static uint32_t        flash_page;
+static uint32_t       *flash_dst;
+static const uint32_t *flash_src;
+static uint32_t        flash_words;
+static uint32_t        flash_ops;   // operations started, for busy_every
+
+static uint32_t soc_evts[SOC_EVT_QUEUE];
+static uint32_t soc_evt_count;
+
+static uint8_t  ble_evts[BLE_EVT_QUEUE][BLE_EVT_MAX_SIZE] __attribute__((aligned(4)));
+static uint16_t ble_evt_lens[BLE_EVT_QUEUE];
+static uint32_t ble_evt_head;
+static uint32_t ble_evt_tail;
+
+// Configuration set by the bootloader with sd_ble_cfg_set and sd_ble_opt_set.
+static uint16_t cfg_att_mtu = BLE_GATT_ATT_MTU_DEFAULT;
+static uint16_t cfg_event_length = 3; // 1.25ms units, the SoftDevice default
+static uint8_t  cfg_hvn_queue_size = 1;
+static uint8_t  cfg_conn_evt_ext;
+
+// State of the link.
+static uint8_t  advertising;
+static uint8_t  connected;
+static uint16_t client_mtu;
+static uint16_t att_mtu;
+static uint8_t  client_phy; // PHYs supported by the client
+static uint8_t  phy = BLE_GAP_PHY_1MBPS;
+static uint64_t next_conn_event;
+static uint8_t  scanning;        // sd_ble_gap_scan_start was called (BROADCAST=1)
+static uint8_t  scan_paused;     // an advertising report was delivered, see sim_broadcast
+static const ble_data_t *scan_buf;
+static uint32_t event_time_left; // radio time left in the current connection event
+static uint32_t event_packets;   // packets sent in the current connection event
+static uint32_t loss_prng_state = 0x9e3779b9; // see packet_lost, derived from -seed
+
+// GATT handles, as handed out to the bootloader.
+static uint16_t next_handle = 1;
+static uint16_t command_handle;
+static uint16_t data_handle;
+
+// Notifications that are waiting for the next connection event.
+static uint8_t  hvn_queue[HVN_QUEUE_MAX][BLE_GATT_ATT_MTU_DEFAULT + 256];
+static uint16_t hvn_lens[HVN_QUEUE_MAX];
+static uint8_t  hvn_count;
+
+static void fail(const char *msg) {
+    fprintf(stderr, "sim: %s\n", msg);
+    exit(1);
+}
+
+static ble_evt_t *push_ble_evt(uint16_t evt_id, uint16_t len) {
+    if (ble_evt_tail - ble_evt_head == BLE_EVT_QUEUE) {
+        fail("BLE event queue overflow");
+    }
+    ble_evt_t *evt = (ble_evt_t*)ble_evts[ble_evt_tail % BLE_EVT_QUEUE];
+    memset(evt, 0, BLE_EVT_MAX_SIZE);
+    evt->header.evt_id = evt_id;
+    evt->header.evt_len = len;
+    ble_evt_lens[ble_evt_tail % BLE_EVT_QUEUE] = len;
+    ble_evt_tail++;
+    return evt;
+}
+
+static void push_soc_evt(uint32_t evt_id) {
+    if (soc_evt_count == SOC_EVT_QUEUE) {
+        fail("SoC event queue overflow");
+    }
+    soc_evts[soc_evt_count++] = evt_id;
+}
+
+// xorshift32 advances a xorshift32 generator and returns the new state.
+static uint32_t xorshift32(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+// packet_lost returns 1 with a probability of 1/sim_config.loss. Lost packets
+// have their own generator, so that they don't change the generated image.
+static int packet_lost(void) {
+    return sim_config.loss && xorshift32(&loss_prng_state) % sim_config.loss == 0;
+}
+
+// packet_time returns how long it takes to send a link layer packet with the
+// given payload and receive the (empty) reply, including the inter frame
+// spaces. This is the same estimate as in the Makefile.
+static uint32_t packet_time(uint32_t payload) {
+    uint32_t overhead = phy == BLE_GAP_PHY_2MBPS ? 11 : 10; // preamble, access address, header, CRC
+    return ((payload + overhead) + overhead) * 8 / phy + 2 * 150;
+}
+
+// conn_event runs a connection event: queued notifications are sent, after
+// which the client may use the rest of the event to send packets.
+static void conn_event(void) {
+    event_time_left = cfg_conn_evt_ext ? sim_config.conn_interval : cfg_event_length * 1250;
+    if (event_time_left > sim_config.conn_interval) {
+        event_time_left = sim_config.conn_interval;
+    }
+    event_packets = 0;
+    if (connected && hvn_count) {
+        uint8_t count = hvn_count;
+        hvn_count = 0;
+        for (uint8_t i = 0; i < count; i++) {
+            sim_stats.notifications++;
+            sim_client_notify(hvn_queue[i], hvn_lens[i]);
+        }
+        ble_evt_t *evt = push_ble_evt(BLE_GATTS_EVT_HVN_TX_COMPLETE, sizeof(ble_evt_t));
+        evt->evt.gatts_evt.params.hvn_tx_complete.count = count;
+    }
+    sim_client_tick();
+}
+
+// flash_finish completes the current flash operation.
+static void flash_finish(void) {
+    if (flash_state == FLASH_ERASE) {
+        memset(&sim_flash[flash_page * SIM_PAGE_SIZE], 0xff, SIM_PAGE_SIZE);
+    } else if (flash_state == FLASH_WRITE) {
+        // Like real flash, writing can only clear bits.
+        for (uint32_t i = 0; i < flash_words; i++) {
+            flash_dst[i] &= flash_src[i];
+        }
+    }
+    flash_state = FLASH_IDLE;
+    push_soc_evt(NRF_EVT_FLASH_OPERATION_SUCCESS);
+}
+
+// flash_start starts a flash operation that takes the given time, unless the
+// flash is busy.
+static uint32_t flash_start(uint8_t state, uint32_t time) {
+    if (flash_state != FLASH_IDLE) {
+        sim_stats.busy++;
+        return NRF_ERROR_BUSY;
+    }
+    flash_ops++;
+    if (sim_config.busy_every && flash_ops % sim_config.busy_every == 0) {
+        // Someone else is using the flash. Its operation finishes with an
+        // event like any other, which is when the bootloader retries.
+        sim_stats.busy++;
+        flash_state = FLASH_BUSY;
+        flash_done = sim_now + sim_config.busy_time;
+        return NRF_ERROR_BUSY;
+    }
+    flash_state = state;
+    flash_done = sim_now + time;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_flash_page_erase(uint32_t page_number) {
+    if (page_number >= SIM_FLASH_SIZE / SIM_PAGE_SIZE) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    uint32_t err_code = flash_start(FLASH_ERASE, sim_config.erase_time);
+    if (err_code == NRF_SUCCESS) {
+        flash_page = page_number;
+        sim_stats.erases++;
+        sim_stats.erase_time += sim_config.erase_time;
+    }
+    return err_code;
+}
+
+uint32_t sd_flash_write(uint32_t *p_dst, uint32_t const *p_src, uint32_t size) {
+    uint8_t *dst = (uint8_t*)p_dst;
+    if (dst < sim_flash || dst + size * 4 > sim_flash + SIM_FLASH_SIZE || (uintptr_t)p_dst % 4 != 0 || (uintptr_t)p_src % 4 != 0) {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    if (size == 0 || size > SIM_PAGE_SIZE / 4) {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    uint32_t err_code = flash_start(FLASH_WRITE, sim_config.write_time * size);
+    if (err_code == NRF_SUCCESS) {
+        // The data is only read when the operation finishes, so the
+        // bootloader must not touch it before then.
+        flash_dst = p_dst;
+        flash_src = p_src;
+        flash_words = size;
+        sim_stats.writes++;
+        sim_stats.write_time += sim_config.write_time * size;
+    }
+    return err_code;
+}
+
+uint32_t sd_evt_get(uint32_t *p_evt_id) {
+    if (soc_evt_count == 0) {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    *p_evt_id = soc_evts[0];
+    soc_evt_count--;
+    memmove(&soc_evts[0], &soc_evts[1], soc_evt_count * sizeof(soc_evts[0]));
+    return NRF_SUCCESS;
+}
+
+// advance_to lets simulated time pass until the given time.
+static void advance_to(uint64_t time) {
+    if (sim_config.realtime) {
+        static struct timespec start;
+        if (start.tv_sec == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        uint64_t ns = start.tv_nsec + time * 1000;
+        struct timespec until = {
+            .tv_sec  = start.tv_sec + ns / 1000000000,
+            .tv_nsec = ns % 1000000000,
+        };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+    }
+    sim_now = time;
+    if (sim_rtc1.TASKS_START) {
+        sim_rtc1.COUNTER = (sim_now * 32768 / 1000000) & 0xffffff;
+    }
+}
+
+uint32_t sd_app_evt_wait(void) {
+    while (soc_evt_count == 0 && ble_evt_head == ble_evt_tail) {
+#if TRANSPORT_SERIAL
+        if (sim_serial_ready()) {
+            break;
+        }
+#endif
+        if (flash_state != FLASH_IDLE && flash_done <= next_conn_event) {
+            advance_to(flash_done);
+            flash_finish();
+        } else {
+            advance_to(next_conn_event);
+            next_conn_event += sim_config.conn_interval;
+            conn_event();
+        }
+    }
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_nvic_SystemReset(void) {
+    sim_client_reset();
+}
+
+uint32_t sd_ble_enable(uint32_t *p_app_ram_base) {
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_cfg_set(uint32_t cfg_id, ble_cfg_t const *p_cfg, uint32_t app_ram_base) {
+    switch (cfg_id) {
+    case BLE_CONN_CFG_GAP:
+        cfg_event_length = p_cfg->conn_cfg.params.gap_conn_cfg.event_length;
+        break;
+    case BLE_CONN_CFG_GATTS:
+        cfg_hvn_queue_size = p_cfg->conn_cfg.params.gatts_conn_cfg.hvn_tx_queue_size;
+        if (cfg_hvn_queue_size > HVN_QUEUE_MAX) {
+            return NRF_ERROR_INVALID_PARAM;
+        }
+        break;
+    case BLE_CONN_CFG_GATT:
+        cfg_att_mtu = p_cfg->conn_cfg.params.gatt_conn_cfg.att_mtu;
+        break;
+    default:
+        return NRF_ERROR_NOT_SUPPORTED;
+    }
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_opt_set(uint32_t opt_id, ble_opt_t const *p_opt) {
+    if (opt_id != BLE_COMMON_OPT_CONN_EVT_EXT) {
+        return NRF_ERROR_NOT_SUPPORTED;
+    }
+    cfg_conn_evt_ext = p_opt->common_opt.conn_evt_ext.enable;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_evt_get(uint8_t *p_dest, uint16_t *p_len) {
+    if (ble_evt_head == ble_evt_tail) {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    uint16_t len = ble_evt_lens[ble_evt_head % BLE_EVT_QUEUE];
+    if (*p_len < len) {
+        *p_len = len;
+        return NRF_ERROR_DATA_SIZE;
+    }
+    memcpy(p_dest, ble_evts[ble_evt_head % BLE_EVT_QUEUE], len);
+    *p_len = len;
+    ble_evt_head++;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_uuid_vs_add(ble_uuid128_t const *p_vs_uuid, uint8_t *p_uuid_type) {
+    *p_uuid_type = 2; // BLE_UUID_TYPE_VENDOR_BEGIN
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_device_name_set(ble_gap_conn_sec_mode_t const *p_write_perm, uint8_t const *p_dev_name, uint16_t len) {
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_ppcp_set(ble_gap_conn_params_t const *p_conn_params) {
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_adv_set_configure(uint8_t *p_adv_handle, ble_gap_adv_data_t const *p_adv_data, ble_gap_adv_params_t const *p_adv_params) {
+    if (*p_adv_handle == BLE_GAP_ADV_SET_HANDLE_NOT_SET) {
+        *p_adv_handle = 0;
+    }
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_adv_start(uint8_t adv_handle, uint8_t conn_cfg_tag) {
+    if (advertising || connected) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    advertising = 1;
+    return NRF_SUCCESS;
+}
+
+// sd_ble_gap_scan_start starts scanning, or continues after an advertising
+// report with NULL parameters. Scanning goes on while advertising, but like
+// with the default role configuration of the SoftDevice, not while connected.
+uint32_t sd_ble_gap_scan_start(ble_gap_scan_params_t const *p_scan_params, ble_data_t const *p_adv_report_buffer) {
+    if (connected || (p_scan_params == NULL && !scanning) || (p_scan_params != NULL && scanning)) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (p_adv_report_buffer->len < BLE_GAP_SCAN_BUFFER_EXTENDED_MIN) {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    scanning = 1;
+    scan_paused = 0;
+    scan_buf = p_adv_report_buffer;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_scan_stop(void) {
+    if (!scanning) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    scanning = 0;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_conn_param_update(uint16_t conn_handle, ble_gap_conn_params_t const *p_conn_params) {
+    return connected ? NRF_SUCCESS : NRF_ERROR_INVALID_STATE;
+}
+
+uint32_t sd_ble_gap_disconnect(uint16_t conn_handle, uint8_t hci_status_code) {
+    if (!connected) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    connected = 0;
+    ble_evt_t *evt = push_ble_evt(BLE_GAP_EVT_DISCONNECTED, sizeof(ble_evt_t));
+    evt->evt.gap_evt.params.disconnected.reason = BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_phy_update(uint16_t conn_handle, ble_gap_phys_t const *p_gap_phys) {
+    if (!connected) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    ble_evt_t *evt = push_ble_evt(BLE_GAP_EVT_PHY_UPDATE, sizeof(ble_evt_t));
+    if (p_gap_phys->tx_phys & client_phy & BLE_GAP_PHY_2MBPS) {
+        phy = BLE_GAP_PHY_2MBPS;
+        evt->evt.gap_evt.params.phy_update.status = BLE_HCI_STATUS_CODE_SUCCESS;
+    } else {
+        evt->evt.gap_evt.params.phy_update.status = BLE_HCI_UNSUPPORTED_REMOTE_FEATURE;
+    }
+    evt->evt.gap_evt.params.phy_update.tx_phy = phy;
+    evt->evt.gap_evt.params.phy_update.rx_phy = phy;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gap_data_length_update(uint16_t conn_handle, ble_gap_data_length_params_t const *p_dl_params, ble_gap_data_length_limitation_t *p_dl_limitation) {
+    // Both sides are assumed to support 251 byte link layer packets, so that
+    // every write fits in a single packet.
+    return connected ? NRF_SUCCESS : NRF_ERROR_INVALID_STATE;
+}
+
+uint32_t sd_ble_gatts_service_add(uint8_t type, ble_uuid_t const *p_uuid, uint16_t *p_handle) {
+    *p_handle = next_handle++;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_characteristic_add(uint16_t service_handle, ble_gatts_char_md_t const *p_char_md, ble_gatts_attr_t const *p_attr_char_value, ble_gatts_char_handles_t *p_handles) {
+    memset(p_handles, 0, sizeof(*p_handles));
+    next_handle++; // declaration
+    p_handles->value_handle = next_handle++;
+    if (p_char_md->char_props.notify) {
+        p_handles->cccd_handle = next_handle++;
+        command_handle = p_handles->value_handle;
+    } else {
+        data_handle = p_handles->value_handle;
+    }
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_hvx(uint16_t conn_handle, ble_gatts_hvx_params_t const *p_hvx_params) {
+    if (!connected) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (p_hvx_params->handle != command_handle || p_hvx_params->type != BLE_GATT_HVX_NOTIFICATION) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if (*p_hvx_params->p_len > att_mtu - 3) {
+        return NRF_ERROR_DATA_SIZE;
+    }
+    if (hvn_count >= cfg_hvn_queue_size) {
+        sim_stats.hvn_full++;
+        return NRF_ERROR_RESOURCES;
+    }
+    memcpy(hvn_queue[hvn_count], p_hvx_params->p_data, *p_hvx_params->p_len);
+    hvn_lens[hvn_count] = *p_hvx_params->p_len;
+    hvn_count++;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_exchange_mtu_reply(uint16_t conn_handle, uint16_t server_rx_mtu) {
+    if (!connected) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    att_mtu = client_mtu < server_rx_mtu ? client_mtu : server_rx_mtu;
+    if (att_mtu > cfg_att_mtu) {
+        att_mtu = cfg_att_mtu;
+    }
+    return NRF_SUCCESS;
+}
+
+// sim_connect connects the client, which then asks for the given ATT MTU. The
+// phy argument is a bitmask of the PHYs the client supports. It returns 0 if
+// the bootloader isn't advertising.
+int sim_connect(uint16_t mtu, uint8_t phys) {
+    if (!advertising) {
+        return 0;
+    }
+    advertising = 0;
+    connected = 1;
+    client_mtu = mtu;
+    client_phy = phys;
+    att_mtu = BLE_GATT_ATT_MTU_DEFAULT;
+    phy = BLE_GAP_PHY_1MBPS;
+    hvn_count = 0;
+    event_time_left = 0;
+    ble_evt_t *evt = push_ble_evt(BLE_GAP_EVT_CONNECTED, sizeof(ble_evt_t));
+    ble_gap_conn_params_t *params = &evt->evt.gap_evt.params.connected.conn_params;
+    params->min_conn_interval = sim_config.conn_interval / 1250;
+    params->max_conn_interval = sim_config.conn_interval / 1250;
+    params->conn_sup_timeout = 400; // 4s
+    evt = push_ble_evt(BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST, sizeof(ble_evt_t));
+    evt->evt.gatts_evt.params.exchange_mtu_request.client_rx_mtu = mtu;
+    return 1;
+}
+
+// sim_disconnect simulates a lost connection. Notifications that were still
+// queued are lost.
+void sim_disconnect(void) {
+    if (!connected) {
+        return;
+    }
+    connected = 0;
+    hvn_count = 0;
+    ble_evt_t *evt = push_ble_evt(BLE_GAP_EVT_DISCONNECTED, sizeof(ble_evt_t));
+    evt->evt.gap_evt.params.disconnected.reason = BLE_HCI_CONNECTION_TIMEOUT;
+}
+
+// sim_broadcast sends extended advertising data, which the bootloader receives
+// as an advertising report if it is scanning. Like the SoftDevice, the scanner
+// pauses after each report until the bootloader continues, and misses what is
+// sent in the mean time. It returns 0 if the data wasn't received.
+int sim_broadcast(const void *data, uint16_t len) {
+    sim_stats.broadcasts++;
+    if (!scanning || scan_paused || len > scan_buf->len) {
+        sim_stats.broadcasts_missed++;
+        return 0;
+    }
+    if (packet_lost()) {
+        sim_stats.broadcasts_missed++;
+        return 0;
+    }
+    memcpy(scan_buf->p_data, data, len);
+    scan_paused = 1;
+    ble_evt_t *evt = push_ble_evt(BLE_GAP_EVT_ADV_REPORT, sizeof(ble_evt_t));
+    ble_gap_evt_adv_report_t *report = &evt->evt.gap_evt.params.adv_report;
+    report->type.extended_pdu = 1;
+    report->type.status = BLE_GAP_ADV_DATA_STATUS_COMPLETE;
+    report->primary_phy = BLE_GAP_PHY_1MBPS;
+    report->secondary_phy = BLE_GAP_PHY_1MBPS;
+    report->data.p_data = scan_buf->p_data;
+    report->data.len = len;
+    return 1;
+}
+
+int sim_connected(void) {
+    return connected;
+}
+
+uint8_t sim_phy(void) {
+    return phy;
+}
+
+// sim_packets_per_event returns how many full size write packets fit in a
+// connection event.
+uint32_t sim_packets_per_event(void) {
+    uint32_t event_time = cfg_conn_evt_ext ? sim_config.conn_interval : cfg_event_length * 1250;
+    if (event_time > sim_config.conn_interval) {
+        event_time = sim_config.conn_interval;
+    }
+    uint32_t packets = event_time / packet_time(att_mtu + 4);
+    if (sim_config.max_packets && packets > sim_config.max_packets) {
+        packets = sim_config.max_packets;
+    }
+    return packets;
+}
+
+// sim_write sends a write command from the client, if it fits in the current
+// connection event. The link layer payload is the ATT value plus the L2CAP
+// and ATT headers. Data packets may be lost, to test START_FLAG_OFFSETS.
+static int sim_write(uint16_t handle, const void *data, uint16_t len) {
+    if (!connected) {
+        return 0;
+    }
+    if (len > att_mtu - 3) {
+        fail("write is larger than the ATT MTU allows");
+    }
+    uint32_t time = packet_time(len + 7);
+    if (time > event_time_left || (sim_config.max_packets && event_packets >= sim_config.max_packets)) {
+        return 0;
+    }
+    event_time_left -= time;
+    event_packets++;
+    sim_stats.packets++;
+    if (handle == data_handle && packet_lost()) {
+        sim_stats.lost++;
+        return 1; // the client can't tell
+    }
+    ble_evt_t *evt = push_ble_evt(BLE_GATTS_EVT_WRITE, sizeof(ble_evt_t) + len);
+    evt->evt.gatts_evt.params.write.handle = handle;
+    evt->evt.gatts_evt.params.write.len = len;
+    memcpy(evt->evt.gatts_evt.params.write.data, data, len);
+    return 1;
+}
+
+int sim_write_command(const void *data, uint16_t len) {
+    return sim_write(command_handle, data, len);
+}
+
+int sim_write_data(const void *data, uint16_t len) {
+    return sim_write(data_handle, data, len);
+}
+
+int sim_config_option(const char *name, uint32_t value) {
+    if (!strcmp(name, "-interval")) {
+        sim_config.conn_interval = value;
+    } else if (!strcmp(name, "-packets")) {
+        sim_config.max_packets = value;
+    } else if (!strcmp(name, "-erase-time")) {
+        sim_config.erase_time = value;
+    } else if (!strcmp(name, "-write-time")) {
+        sim_config.write_time = value;
+    } else if (!strcmp(name, "-busy")) {
+        sim_config.busy_every = value;
+    } else if (!strcmp(name, "-loss")) {
+        sim_config.loss = value;
+    } else if (!strcmp(name, "-seed")) {
+        sim_prng_state = value ? value : 1;
+        loss_prng_state = sim_prng_state * 0x9e3779b9; // odd, so never 0
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+void sim_config_usage(void) {
+    fprintf(stderr, "  -seed n          seed for the generated image, old flash contents and lost packets\n");
+    fprintf(stderr, "  -interval us     connection interval (default 7500)\n");
+    fprintf(stderr, "  -packets n       at most n packets per connection event\n");
+    fprintf(stderr, "  -erase-time us   time to erase a page (default 85000)\n");
+    fprintf(stderr, "  -write-time us   time to write a word (default 41)\n");
+    fprintf(stderr, "  -busy n          every n-th flash operation finds the flash busy\n");
+    fprintf(stderr, "  -loss n          a packet is lost with probability 1/n\n");
+}
+
+uint32_t sim_prng_state = 1;
+
+uint32_t sim_prng(void) {
+    return xorshift32(&sim_prng_state);
+}
+
+#if DEBUG
+// Debug output of the bootloader goes to stderr as text right away, with the
+// simulated time at the start of every line, instead of through the trace
+// buffer of uart.c.
+void uart_enable(void) {
+}
+
+void uart_disable(void) {
+}
+
+void trace(uint32_t type, const char *msg, uint32_t arg) {
+    fprintf(stderr, "%10.3fms  ", sim_now / 1000.0);
+    if (type == TRACE_NUM) {
+        fprintf(stderr, "%s 0x%08x\n", msg, arg);
+    } else {
+        fprintf(stderr, "%s\n", msg);
+    }
+}
+
+void trace_flush(void) {
+}
+
+void trace_flush_all(void) {
+}
+#endif
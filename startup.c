@@ -1,6 +1,7 @@
 
 #include <stdint.h>
 #include "nrf_nvic.h"
+#include "dfu.h"
 
 extern uint32_t _estack;
 extern uint32_t _sidata;
@@ -10,16 +11,16 @@ extern uint32_t _sbss;
 extern uint32_t _ebss;
 
 #if DEBUG
-void uart_write(char *s);
-
 void Default_Handler(void) {
-    uart_write("Default_Handler\r\n");
+    LOG("Default_Handler");
+    LOG_FLUSH();
     NRF_POWER->GPREGRET = 2;
     sd_nvic_SystemReset();
 }
 
 void HardFault_Handler(void) {
-    uart_write("HardFault_Handler\r\n");
+    LOG("HardFault_Handler");
+    LOG_FLUSH();
     NRF_POWER->GPREGRET = 2;
     sd_nvic_SystemReset();
 }
@@ -1,31 +1,93 @@
 
+// Debug output (DEBUG=1). Logging must not change the timing of the
+// bootloader much, so LOG and LOG_NUM don't format or send anything: they
+// append a 12 byte record to a ring buffer in RAM. The dfu_run loop sends the
+// buffer in the background with UARTE EasyDMA, as binary records that refer to
+// the messages by their address. `dfuclient trace` turns them back into text,
+// using the bootloader ELF file.
+// Everything runs in thread mode (see dfu_run), so the buffer needs no locks.
+
+#include <stddef.h>
 #include "nrf_soc.h"
+#include "nrf_nvic.h"
 #include "dfu.h"
 
-void uart_write_char(char ch) {
-    NRF_UART0->TXD = ch;
-    while (NRF_UART0->EVENTS_TXDRDY != 1) {}
-    NRF_UART0->EVENTS_TXDRDY = 0;
+#define TRACE_RECORDS     (64) // size of the ring buffer, must be a power of two
+#define TRACE_DMA_RECORDS (21) // 252 bytes, TXD.MAXCNT has 8 bits on the nRF52832
+
+// A trace record, as sent over the UART (little endian).
+typedef struct {
+    uint32_t time; // RTC1 counter in the low 24 bits, TRACE_* in the high 8 bits
+    uint32_t msg;  // address of the message
+    uint32_t arg;  // argument of LOG_NUM
+} trace_record_t;
+
+static trace_record_t trace_buf[TRACE_RECORDS];
+static uint32_t       trace_head;    // number of records written
+static uint32_t       trace_tail;    // number of records sent
+static uint32_t       trace_sending; // number of records in the running DMA transfer
+static uint32_t       trace_dropped; // records lost since the buffer was last full
+
+static void trace_put(uint32_t type, const char *msg, uint32_t arg) {
+    trace_record_t *record = &trace_buf[trace_head % TRACE_RECORDS];
+    record->time = (NRF_RTC1->COUNTER & 0xffffff) | (type << 24);
+    record->msg = (uint32_t)msg;
+    record->arg = arg;
+    trace_head++;
 }
 
-void uart_write(char *s) {
-    while (*s) {
-        uart_write_char(*s++);
+// trace adds a record to the ring buffer. When the buffer is full, new records
+// are dropped (the DMA may be reading the old ones) and counted in a
+// TRACE_DROPPED record once there is room again.
+void trace(uint32_t type, const char *msg, uint32_t arg) {
+    if (trace_head - trace_tail > TRACE_RECORDS - 2) { // keep room for TRACE_DROPPED
+        trace_dropped++;
+        return;
+    }
+    if (trace_dropped) {
+        trace_put(TRACE_DROPPED, NULL, trace_dropped);
+        trace_dropped = 0;
     }
+    trace_put(type, msg, arg);
 }
 
-void uart_write_num(uint32_t n) {
-    uart_write_char('0');
-    uart_write_char('x');
-
-    // write hex digits
-    for (int i = 0; i < 8; i++) {
-        char ch = (n >> 28) + '0';
-        if (ch > '9') {
-            ch = (n >> 28) + 'a' - 10;
+// trace_flush finishes the last DMA transfer if it is done and starts the next
+// one, if there is something to send. It does not wait.
+void trace_flush(void) {
+    if (trace_sending) {
+        if (!NRF_UARTE0->EVENTS_ENDTX) {
+            return;
         }
-        uart_write_char(ch);
-        n <<= 4;
+        NRF_UARTE0->EVENTS_ENDTX = 0;
+        sd_nvic_ClearPendingIRQ(UARTE0_UART0_IRQn);
+        trace_tail += trace_sending;
+        trace_sending = 0;
+    }
+
+    // Send the records up to the end of the buffer, the rest follows with the
+    // next transfer.
+    uint32_t index = trace_tail % TRACE_RECORDS;
+    uint32_t count = trace_head - trace_tail;
+    if (count > TRACE_RECORDS - index) {
+        count = TRACE_RECORDS - index;
+    }
+    if (count > TRACE_DMA_RECORDS) {
+        count = TRACE_DMA_RECORDS;
+    }
+    if (count == 0) {
+        return;
+    }
+    NRF_UARTE0->TXD.PTR = (uint32_t)&trace_buf[index];
+    NRF_UARTE0->TXD.MAXCNT = count * sizeof(trace_record_t);
+    NRF_UARTE0->TASKS_STARTTX = 1;
+    trace_sending = count;
+}
+
+// trace_flush_all waits until the whole buffer has been sent, for example
+// before a reset.
+void trace_flush_all(void) {
+    while (trace_head != trace_tail) {
+        trace_flush();
     }
 }
 
@@ -33,20 +95,34 @@ void uart_write_num(uint32_t n) {
 void uart_enable(void) {
     // TODO: set correct GPIO configuration? Only necessary when system
     // goes to OFF state.
-    NRF_UART0->ENABLE        = UART_ENABLE_ENABLE_Enabled;
-    NRF_UART0->BAUDRATE      = UART_BAUDRATE_BAUDRATE_Baud115200;
-    NRF_UART0->TASKS_STARTTX = 1;
+    NRF_UARTE0->ENABLE        = UARTE_ENABLE_ENABLE_Enabled;
+    NRF_UARTE0->BAUDRATE      = UARTE_BAUDRATE_BAUDRATE_Baud115200;
     #if defined(PCA10040)
-    NRF_UART0->PSELTXD       = 6; // P0.06
+    NRF_UARTE0->PSEL.TXD      = 6; // P0.06
     #elif defined(PCA10056)
-    NRF_UART0->PSELTXD       = 6; // P0.06
+    NRF_UARTE0->PSEL.TXD      = 6; // P0.06
     #else
     #error Setup TX pin for debugging
     #endif
+
+    // Wake up from sd_app_evt_wait when a transfer is done, so that the next
+    // one starts right away. The interrupt stays disabled in the NVIC (there
+    // is no handler), with SEVONPEND it only needs to become pending.
+    NRF_UARTE0->INTENSET      = UARTE_INTENSET_ENDTX_Msk;
+    SCB->SCR |= SCB_SCR_SEVONPEND_Msk;
+
+    // Timestamps. The RTC only counts once the SoftDevice has started the
+    // low frequency clock.
+    NRF_RTC1->TASKS_START = 1;
 }
 #endif
 
 void uart_disable(void) {
-    NRF_UART0->ENABLE  = UART_ENABLE_ENABLE_Disabled;
-    NRF_UART0->PSELTXD = 0xffffffff;
+#if DEBUG
+    trace_flush_all();
+    NRF_UARTE0->INTENCLR = UARTE_INTENSET_ENDTX_Msk;
+    sd_nvic_ClearPendingIRQ(UARTE0_UART0_IRQn);
+#endif
+    NRF_UARTE0->ENABLE   = UARTE_ENABLE_ENABLE_Disabled;
+    NRF_UARTE0->PSEL.TXD = 0xffffffff;
 }